@@ -8,12 +8,13 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
+#include <bit>
 
 #define TEXT_HEIGHT 20
 #define INDENT 10
 #define SLIDERSIZE 100
 #define WIDTH SLIDERSIZE*8 +INDENT*2
-#define HEIGHT TEXT_HEIGHT*3 + INDENT*4 + SLIDERSIZE*5
+#define HEIGHT TEXT_HEIGHT*5 + INDENT*4 + SLIDERSIZE*5
 //==============================================================================
 Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM_DrumsAudioProcessor& p, juce::AudioProcessorValueTreeState& vts)
     : AudioProcessorEditor (&p), audioProcessor (p), valueTreeState( vts )
@@ -104,6 +105,8 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
     {
         for ( int i = 0; i < patternMultiTog.getNumRows(); i++ )
             audioProcessor.setPattern( i, patternMultiTog.getRow( NUM_VOICES - 1 - i ) );
+        setDisplayedPatternFromGrid();
+        audioProcessor.storePatternHistory();
         audioProcessor.setNonAutomatableParameterValues();
     };
     for ( int i = 0; i < MAX_NUM_STEPS; i++ )
@@ -132,6 +135,8 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
         if ( juce::ModifierKeys::getCurrentModifiers().isShiftDown() && m_bankFlag )
             audioProcessor.copyPatternBankContents( m_selectedBank, selectedBank );
         m_selectedBank = selectedBank;
+        // the grid shows the stored bank, which the voices might not have loaded yet
+        m_displayedGenerations.fill( ~0u );
     };
     bankNumber.onDragStart = [this]
     {
@@ -157,7 +162,7 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
     ioiProbsSlider.onMouseEvent = [this]
     {
         for ( size_t i = 0; i < ioiProbsSlider.getNumSliders(); i++ )
-            audioProcessor.setIOIProbability( audioProcessor.ioiFactors[ i ], ioiProbsSlider.fetch( static_cast<int>(i) ) );
+            audioProcessor.setIOIProbability( i, ioiProbsSlider.fetch( static_cast<int>(i) ) );
         audioProcessor.setNonAutomatableParameterValues();
         displayChangedIOI();
     };
@@ -165,6 +170,42 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
         ioiProbsSlider.setSliderColour( static_cast<int>( i ), sliderColours[ i % sliderColours.size() ].withAlpha( 0.6f ) );
     setIOISliderValues();
     ioiProbsSlider.setTooltip( "This sets the probability of different rhythmic divisions. \nThe value for each rhythmic division is the underlying pulse multiplied by the division value (e.g. if the underlying pulse is 8th notes, then the 0.5 division is 16th notes, 0.6666 is 8th note triplets, etc).\nThe overall probability is then set using the Complexity slider" );
+    // the accents of the selected voice share the space with the divisions, scale above and offset below
+    for ( auto* accentSlider : { &accentScaleSlider, &accentOffsetSlider } )
+    {
+        addChildComponent( accentSlider );
+        accentSlider->setNumSliders( MAX_NUM_STEPS );
+        accentSlider->setColour( sjf_multislider::backgroundColourId, multiSliBgCol );
+        for ( int i = 0; i < MAX_NUM_STEPS; i++ )
+            accentSlider->setSliderColour( i, sliderColours[ static_cast< size_t >( i / 4 ) % sliderColours.size() ].withAlpha( 0.6f ) );
+        accentSlider->onMouseEvent = [this]
+        {
+            // halfway up is no change, a scale of 1 and an offset of 0
+            auto voice = static_cast< int >( voiceNumBox.getValue() ) - 1;
+            for ( int i = 0; i < MAX_NUM_STEPS; i++ )
+                audioProcessor.setAccent( voice, i, accentScaleSlider.fetch( i ) * 2.0f, accentOffsetSlider.fetch( i ) - 0.5f );
+            audioProcessor.storePatternHistory();
+            audioProcessor.setNonAutomatableParameterValues();
+        };
+    }
+    accentScaleSlider.setTooltip( "This scales the velocity of each step of the selected voice\n\nHalfway is the generator's velocity, the top doubles it and the bottom silences it as far as midi allows" );
+    accentOffsetSlider.setTooltip( "This adds to or takes away from the velocity of each step of the selected voice\n\nHalfway leaves it unchanged" );
+    
+    addChildComponent( &accentRandomNumBox );
+    accentRandomNumBox.setRange( 0, 1, 0.01 );
+    accentRandomNumBox.setNumDecimalPlacesToDisplay( 2 );
+    accentRandomNumBox.onValueChange = [this]
+    {
+        audioProcessor.setAccentRandomRange( static_cast< int >( voiceNumBox.getValue() ) - 1, static_cast< float >( accentRandomNumBox.getValue() ) );
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    accentRandomNumBox.setTooltip( "This randomly moves each velocity of the selected voice up or down by as much as this" );
+    
+    addAndMakeVisible( &accentsToggle );
+    accentsToggle.setButtonText( "Accents" );
+    accentsToggle.onClick = [this]{ showAccents( accentsToggle.getToggleState() ); };
+    accentsToggle.setTooltip( "This swaps the division probabilities for the accents of the voice selected below\n\nAccents are kept with each bank" );
+    
     addAndMakeVisible( &ioiLabel );
     ioiLabel.setColour( juce::Slider::backgroundColourId, juce::Colours::white.withAlpha( 0.0f ) );
     ioiLabel.setEditable( false );
@@ -245,6 +286,75 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
     };
     rotateRightButton.setTooltip( "This will rotate the current pattern one step to the right" );
     
+    //-------------------------------------------------
+    addAndMakeVisible( &undoButton );
+    undoButton.setButtonText( "Undo" );
+    undoButton.onClick = [this]
+    {
+        undoPatternEdit( true );
+    };
+    undoButton.setTooltip( "This will undo the last change to the pattern banks (cmd/ctrl + z)" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &redoButton );
+    redoButton.setButtonText( "Redo" );
+    redoButton.onClick = [this]
+    {
+        undoPatternEdit( false );
+    };
+    redoButton.setTooltip( "This will redo the last change that was undone (cmd/ctrl + shift + z)" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &similarButton );
+    similarButton.setButtonText( "Similar" );
+    similarButton.onClick = [this]
+    {
+        audioProcessor.loadSimilarPattern( metricSimilarityToggle.getToggleState() );
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    similarButton.setTooltip( "This will replace the current pattern with the closest pattern from the pattern library\n\nPress again to step through the next closest patterns" );
+    
+    addAndMakeVisible( &metricSimilarityToggle );
+    metricSimilarityToggle.setButtonText( "Metric" );
+    metricSimilarityToggle.setTooltip( "If activated differences on stronger beats count for more when searching for similar patterns" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &libraryButton );
+    libraryButton.setButtonText( "Library" );
+    libraryButton.onClick = [this]
+    {
+        libraryChooser = std::make_unique< juce::FileChooser >( "Select a pattern library, a midi file or a folder of midi files", juce::File(), "*.aaimlib;*.mid;*.midi" );
+        libraryChooser->launchAsync( juce::FileChooser::openMode | juce::FileChooser::canSelectFiles | juce::FileChooser::canSelectDirectories, [this]( const juce::FileChooser& chooser )
+        {
+            auto file = chooser.getResult();
+            if ( file.isDirectory() )
+                importMidiDirectory( file );
+            else if ( file.hasFileExtension( "mid;midi" ) )
+            {
+                if ( audioProcessor.importMidiFile( file ) > 0 )
+                    audioProcessor.setNonAutomatableParameterValues();
+            }
+            else if ( file.existsAsFile() && audioProcessor.loadPatternLibrary( file ) )
+                libraryButton.setTooltip( "Pattern library: " + audioProcessor.getPatternLibraryName() );
+        } );
+    };
+    libraryButton.setTooltip( "This loads a pattern library file, the patterns are read from disk when they are needed and are not stored in the session\n\nA midi file is imported into the banks, one bar per bank from the current bank onwards, on the current bank's grid\n\nA folder of midi files is imported into a new pattern library next to the folder, every bar with a note in it becomes a pattern" );
+    
+    addAndMakeVisible( &libraryPatternSlider );
+    libraryPatternAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "libraryPattern", libraryPatternSlider ) );
+    libraryPatternSlider.setSliderStyle( juce::Slider::LinearBar );
+    libraryPatternSlider.setNumDecimalPlacesToDisplay( 0 );
+    libraryPatternSlider.setTooltip( "This selects a pattern from the pattern library instead of the pattern banks\n\n-1 plays the pattern banks\nLibrary patterns are read only, use To Bank to copy the pattern into the current bank for editing" );
+    
+    addAndMakeVisible( &libraryToBankButton );
+    libraryToBankButton.setButtonText( "To Bank" );
+    libraryToBankButton.onClick = [this]
+    {
+        audioProcessor.copyActiveLibraryPatternToBank();
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    libraryToBankButton.setTooltip( "This copies the library pattern that is playing into the current pattern bank" );
+    
     //-------------------------------------------------
     addAndMakeVisible( &tooltipsToggle );
     tooltipsToggle.setTooltip( MAIN_TOOLTIP );
@@ -270,14 +380,141 @@ Sjf_AAIM_DrumsAudioProcessorEditor::Sjf_AAIM_DrumsAudioProcessorEditor (Sjf_AAIM
     tooltipLabel.setTooltip( MAIN_TOOLTIP );
     
     for ( size_t i = 0; i < NUM_IOIs; i++ )
-        m_ioiProbs[ 0 ] = 0;
+        m_ioiProbs[ i ] = 0;
      
+    //-------------------------------------------------
+    addChildComponent( &densityOverlay );
+    densityOverlay.getSettings = [this]
+    {
+        auto settings = sjf_densityOverlay::preview::settings();
+        settings.complexity = valueTreeState.getRawParameterValue( "complexity" )->load();
+        settings.rests = valueTreeState.getRawParameterValue( "rests" )->load();
+        settings.fills = valueTreeState.getRawParameterValue( "fills" )->load();
+        settings.nBeats = audioProcessor.getNumBeats();
+        for ( int i = 0; i < NUM_VOICES; i++ )
+        {
+            auto& pat = audioProcessor.getPattern( i );
+            for ( size_t j = 0; j < pat.size() && j < MAX_NUM_STEPS; j++ )
+                settings.pattern[ i ] |= pat[ j ] ? ( 1u << j ) : 0u;
+        }
+        settings.ioiProbabilities = audioProcessor.getIOIProbabilities();
+        return settings;
+    };
+    
+    addAndMakeVisible( &densityPreviewToggle );
+    densityPreviewToggle.setButtonText( "Preview" );
+    densityPreviewToggle.onClick = [this]
+    {
+        densityOverlay.setVisible( densityPreviewToggle.getToggleState() );
+    };
+    densityPreviewToggle.setTooltip( "This shows how often each step is likely to play with the current settings\n\nThe shading shows the chance of a step playing in each bar, the line shows the average velocity and the lighter band its spread" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &voiceNumBox );
+    voiceNumBox.setRange( 1, NUM_VOICES, 1 );
+    voiceNumBox.setValue( 1, juce::dontSendNotification );
+    voiceNumBox.setNumDecimalPlacesToDisplay( 0 );
+    voiceNumBox.onValueChange = [this]{ setVoiceControls(); };
+    voiceNumBox.setTooltip( "This selects the voice (row of the pattern, counting from the bottom) whose length, division and note length are set next to it" );
+    
+    addAndMakeVisible( &voiceLengthNumBox );
+    voiceLengthNumBox.setRange( 0, MAX_NUM_STEPS, 1 );
+    voiceLengthNumBox.setNumDecimalPlacesToDisplay( 0 );
+    voiceLengthNumBox.onValueChange = [this]
+    {
+        audioProcessor.setVoiceNumBeats( static_cast< int >( voiceNumBox.getValue() ) - 1, static_cast< int >( voiceLengthNumBox.getValue() ) );
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    voiceLengthNumBox.setTooltip( "This sets the number of beats for the selected voice so it can cycle independently of the rest of the pattern (e.g. a 5 beat hi hat over a 16 beat kick)\n\n0 follows the pattern length" );
+    
+    addAndMakeVisible( &voiceDivisionComboBox );
+    voiceDivisionComboBox.addItem( "=", 1 );
+    for ( size_t i = 0; i < divNames.size(); i++ )
+        voiceDivisionComboBox.addItem( divNames[ i ], static_cast< int >(i) + 2 );
+    voiceDivisionComboBox.onChange = [this]
+    {
+        audioProcessor.setVoiceDivision( static_cast< int >( voiceNumBox.getValue() ) - 1, voiceDivisionComboBox.getSelectedId() - 1 );
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    voiceDivisionComboBox.setTooltip( "This sets the pulse of the selected voice relative to the pattern's pulse\n\n= follows the pattern" );
+    
+    addAndMakeVisible( &voiceGateNumBox );
+    voiceGateNumBox.setRange( 0, Sjf_AAIM_DrumsAudioProcessor::MAX_GATE_LENGTH, 0.05 );
+    voiceGateNumBox.setNumDecimalPlacesToDisplay( 2 );
+    voiceGateNumBox.onValueChange = [this]
+    {
+        audioProcessor.setVoiceGateLength( static_cast< int >( voiceNumBox.getValue() ) - 1, static_cast< float >( voiceGateNumBox.getValue() ) );
+        audioProcessor.setNonAutomatableParameterValues();
+    };
+    voiceGateNumBox.setTooltip( "This sets how long each note of the selected voice lasts, in steps of the pattern (e.g. 0.5 is half a step)\n\nThe same in every bank\n\n0 holds each note until the voice plays again" );
+    setVoiceControls();
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &clockSourceComboBox );
+    clockSourceComboBox.addItemList( { "Host", "Int", "Auto" }, 1 );
+    clockSourceAttachment.reset( new juce::AudioProcessorValueTreeState::ComboBoxAttachment( valueTreeState, "clockSource", clockSourceComboBox ) );
+    clockSourceComboBox.setTooltip( "This sets where the timing comes from\n\nHost - only plays while the host is playing\nInt - always plays from the internal clock at the tempo set next to it (e.g. standalone)\nAuto - follows the host while it is playing and carries on from the internal clock when it stops" );
+    
+    addAndMakeVisible( &internalBpmNumBox );
+    internalBpmAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "internalBpm", internalBpmNumBox ) );
+    internalBpmNumBox.setNumDecimalPlacesToDisplay( 1 );
+    internalBpmNumBox.setTooltip( "This sets the tempo of the internal clock in beats per minute" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &followAmountNumBox );
+    followAmountAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "followAmount", followAmountNumBox ) );
+    followAmountNumBox.setNumDecimalPlacesToDisplay( 2 );
+    followAmountNumBox.setTooltip( "This sets how much the sidechain input pushes the generator\n\nA busier input raises the complexity, a louder input adds fills and removes rests\n\n0 ignores the input, the sidechain needs to be enabled in the host" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &syncModeComboBox );
+    syncModeComboBox.addItemList( { "Solo", "Lead", "Follow" }, 1 );
+    syncModeAttachment.reset( new juce::AudioProcessorValueTreeState::ComboBoxAttachment( valueTreeState, "syncMode", syncModeComboBox ) );
+    syncModeComboBox.setTooltip( "This lets several instances (e.g. a kit split across midi channels) play from one generator\n\nLead - this instance's generator drives the group\nFollow - plays this instance's patterns with the leader's timing, velocities and rests\n\nOnly one instance can lead each group" );
+    
+    addAndMakeVisible( &syncGroupNumBox );
+    syncGroupAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "syncGroup", syncGroupNumBox ) );
+    syncGroupNumBox.setNumDecimalPlacesToDisplay( 0 );
+    syncGroupNumBox.setTooltip( "This sets which sync group the instance leads or follows" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &morphNumBox );
+    morphAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "morph", morphNumBox ) );
+    morphNumBox.setNumDecimalPlacesToDisplay( 2 );
+    morphNumBox.setTooltip( "This blends the bank set next to it into the current bank step by step\n\nThe steps that matter least to the metre go over first, so the downbeats stay with the current bank the longest\n\n0 plays the current bank alone, 1 plays the other bank with the current bank's lengths" );
+    
+    addAndMakeVisible( &morphBankNumBox );
+    morphBankAttachment.reset( new juce::AudioProcessorValueTreeState::SliderAttachment( valueTreeState, "morphBank", morphBankNumBox ) );
+    morphBankNumBox.setNumDecimalPlacesToDisplay( 0 );
+    morphBankNumBox.setTooltip( "This sets the bank that the current bank morphs into" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &bankChainToggle );
+    bankChainAttachment.reset( new juce::AudioProcessorValueTreeState::ButtonAttachment( valueTreeState, "arrangement", bankChainToggle ) );
+    bankChainToggle.setButtonText( "Chain" );
+    bankChainToggle.setTooltip( "If activated the banks follow the chain set next to it bar by bar, wherever the host jumps to" );
+    
+    addAndMakeVisible( &bankChainEditor );
+    bankChainEditor.setText( audioProcessor.getBankChainText(), false );
+    bankChainEditor.onReturnKey = bankChainEditor.onFocusLost = [this]
+    {
+        // anything that isn't a valid chain goes back to the one playing
+        if ( !audioProcessor.setBankChain( bankChainEditor.getText() ) )
+            bankChainEditor.setText( audioProcessor.getBankChainText(), false );
+    };
+    bankChainEditor.setTooltip( "This sets the chain of banks, each one a bank, x and how many bars it plays for, e.g. 0x4 1x2 0x3 2\n\nAdding r, m, s, p, d, < or > to an entry plays it with that variation, the bank itself is not changed\n\nThe chain repeats after its last bar" );
+    
+    //-------------------------------------------------
+    addAndMakeVisible( &metricsLabel );
+    metricsLabel.setJustificationType( juce::Justification::centredLeft );
+    
     //-------------------------------------------------
     addAndMakeVisible( &posDisplay );
     posDisplay.setInterceptsMouseClicks( false, false );
     posDisplay.setBackGroundColour( juce::Colours::white.withAlpha( 0.0f ) );
     posDisplay.setForeGroundColour( juce::Colours::darkred.withAlpha( 0.2f ) );
     
+    setWantsKeyboardFocus( true );
     setSize (WIDTH, HEIGHT);
     startTimer( 50 );
 }
@@ -291,6 +528,19 @@ Sjf_AAIM_DrumsAudioProcessorEditor::~Sjf_AAIM_DrumsAudioProcessorEditor()
 //==============================================================================
 void Sjf_AAIM_DrumsAudioProcessorEditor::paint (juce::Graphics& g)
 {
+    auto scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+    if ( !m_staticLayer.isValid() || scale != m_staticLayerScale )
+        renderStaticLayer( scale );
+    g.drawImage( m_staticLayer, 0, 0, getWidth(), getHeight(), 0, 0, m_staticLayer.getWidth(), m_staticLayer.getHeight() );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::renderStaticLayer( float scale )
+{
+    m_staticLayerScale = scale;
+    m_staticLayer = juce::Image( juce::Image::ARGB, juce::jmax( 1, juce::roundToInt( getWidth() * scale ) ), juce::jmax( 1, juce::roundToInt( getHeight() * scale ) ), true );
+    juce::Graphics g( m_staticLayer );
+    g.addTransform( juce::AffineTransform::scale( scale ) );
+
     // (Our component is opaque, so we must completely fill the background with a solid colour)
 #ifdef JUCE_DEBUG
     g.fillAll (getLookAndFeel().findColour (juce::ResizableWindow::backgroundColourId));
@@ -310,8 +560,11 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::paint (juce::Graphics& g)
     g.drawFittedText ( "Rests", restSlider.getX(), restSlider.getY() - TEXT_HEIGHT, restSlider.getWidth(), TEXT_HEIGHT, juce::Justification::centred, 1);
     g.drawFittedText ( "Fills", fillsSlider.getX(), fillsSlider.getY() - TEXT_HEIGHT, fillsSlider.getWidth(), TEXT_HEIGHT, juce::Justification::centred, 1);
     g.drawFittedText( "Swing", swingSlider.getX(), swingSlider.getY() - TEXT_HEIGHT, swingSlider.getWidth(), TEXT_HEIGHT, juce::Justification::centred, 1);
-    g.drawFittedText ( "Rhythmic Division Probabilities", ioiProbsSlider.getX(), ioiProbsSlider.getY() - TEXT_HEIGHT, ioiProbsSlider.getWidth(), TEXT_HEIGHT, juce::Justification::centred, 1);
+    auto ioiTitle = accentsToggle.getToggleState() ? "Accents, Voice " + juce::String( static_cast< int >( voiceNumBox.getValue() ) ) : juce::String( "Rhythmic Division Probabilities" );
+    g.drawFittedText ( ioiTitle, ioiProbsSlider.getX(), ioiProbsSlider.getY() - TEXT_HEIGHT, ioiProbsSlider.getWidth(), TEXT_HEIGHT, juce::Justification::centred, 1);
+    g.drawFittedText ( "Morph: ", INDENT, 0, SLIDERSIZE/2, TEXT_HEIGHT, juce::Justification::right, 1);
     g.drawFittedText ( "Time Signature: ", nBeatsNumBox.getX()-SLIDERSIZE, nBeatsNumBox.getY(), SLIDERSIZE, TEXT_HEIGHT, juce::Justification::right, 1);
+    g.drawFittedText ( "Sync: ", syncModeComboBox.getX()-SLIDERSIZE/2, syncModeComboBox.getY(), SLIDERSIZE/2, TEXT_HEIGHT, juce::Justification::right, 1);
     for ( int i = 0; i < NUM_BANKS; i++ )
     {
         auto w = bankDisplay.getWidth()/NUM_BANKS;
@@ -320,14 +573,30 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::paint (juce::Graphics& g)
     }
 }
 
+void Sjf_AAIM_DrumsAudioProcessorEditor::lookAndFeelChanged()
+{
+    m_staticLayer = juce::Image();
+    repaint();
+}
+
 void Sjf_AAIM_DrumsAudioProcessorEditor::resized()
 {
+    m_staticLayer = juce::Image();
     compSlider.setBounds( INDENT, TEXT_HEIGHT*2, SLIDERSIZE, SLIDERSIZE);
+    morphNumBox.setBounds( INDENT + SLIDERSIZE/2, 0, SLIDERSIZE/2, TEXT_HEIGHT );
+    morphBankNumBox.setBounds( morphNumBox.getRight(), morphNumBox.getY(), SLIDERSIZE*2/5, TEXT_HEIGHT );
+    metricsLabel.setBounds( morphBankNumBox.getRight() + INDENT, 0, SLIDERSIZE*9/5, TEXT_HEIGHT );
     restSlider.setBounds( compSlider.getRight(), compSlider.getY(), SLIDERSIZE, SLIDERSIZE);
     fillsSlider.setBounds( restSlider.getRight(), restSlider.getY(), SLIDERSIZE, SLIDERSIZE);
     swingSlider.setBounds( fillsSlider.getRight(), fillsSlider.getY(), SLIDERSIZE, SLIDERSIZE);
     ioiProbsSlider.setBounds( swingSlider.getRight(), swingSlider.getY(), SLIDERSIZE*4, SLIDERSIZE );
+    bankChainEditor.setBounds( ioiProbsSlider.getRight() - SLIDERSIZE*2, 0, SLIDERSIZE*2, TEXT_HEIGHT );
+    bankChainToggle.setBounds( bankChainEditor.getX() - SLIDERSIZE*3/4, 0, SLIDERSIZE*3/4, TEXT_HEIGHT );
     ioiLabel.setBounds( ioiProbsSlider.getX(), ioiProbsSlider.getY(), ioiProbsSlider.getWidth(), ioiProbsSlider.getHeight() );
+    accentScaleSlider.setBounds( ioiProbsSlider.getX(), ioiProbsSlider.getY(), ioiProbsSlider.getWidth(), ioiProbsSlider.getHeight()/2 );
+    accentOffsetSlider.setBounds( accentScaleSlider.getX(), accentScaleSlider.getBottom(), accentScaleSlider.getWidth(), ioiProbsSlider.getHeight()/2 );
+    accentsToggle.setBounds( ioiProbsSlider.getRight() - SLIDERSIZE*3/4, ioiProbsSlider.getY() - TEXT_HEIGHT, SLIDERSIZE*3/4, TEXT_HEIGHT );
+    accentRandomNumBox.setBounds( ioiProbsSlider.getX(), ioiProbsSlider.getY() - TEXT_HEIGHT, SLIDERSIZE*2/5, TEXT_HEIGHT );
     
     
     nBeatsNumBox.setBounds( restSlider.getX(), restSlider.getBottom()+INDENT, SLIDERSIZE/2, TEXT_HEIGHT );
@@ -342,13 +611,33 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::resized()
     
     internalSyncResetButton.setBounds( ioiProbsSlider.getRight() - SLIDERSIZE*2, divisionComboBox.getY(), SLIDERSIZE, TEXT_HEIGHT );
     tooltipsToggle.setBounds( internalSyncResetButton.getRight(), divisionComboBox.getY(), SLIDERSIZE, TEXT_HEIGHT );
+    followAmountNumBox.setBounds( rotateRightButton.getRight(), rotateRightButton.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
     
     patternMultiTog.setBounds( compSlider.getX(), nBeatsNumBox.getBottom(), SLIDERSIZE*8, SLIDERSIZE*4 );
     posDisplay.setBounds( patternMultiTog.getBounds() );
+    densityOverlay.setBounds( patternMultiTog.getBounds() );
     
     bankNumber.setBounds( patternMultiTog.getX(), patternMultiTog.getBottom(), patternMultiTog.getWidth(), TEXT_HEIGHT );
     bankDisplay.setBounds( patternMultiTog.getX(), patternMultiTog.getBottom(), patternMultiTog.getWidth(), TEXT_HEIGHT );
     
+    undoButton.setBounds( bankNumber.getX(), bankNumber.getBottom(), SLIDERSIZE/2, TEXT_HEIGHT );
+    redoButton.setBounds( undoButton.getRight(), undoButton.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    similarButton.setBounds( redoButton.getRight() + INDENT, redoButton.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    metricSimilarityToggle.setBounds( similarButton.getRight(), similarButton.getY(), SLIDERSIZE*3/4, TEXT_HEIGHT );
+    libraryButton.setBounds( metricSimilarityToggle.getRight() + INDENT, metricSimilarityToggle.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    libraryPatternSlider.setBounds( libraryButton.getRight(), libraryButton.getY(), SLIDERSIZE*3/4, TEXT_HEIGHT );
+    libraryToBankButton.setBounds( libraryPatternSlider.getRight(), libraryPatternSlider.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    densityPreviewToggle.setBounds( libraryToBankButton.getRight() + INDENT, libraryToBankButton.getY(), SLIDERSIZE*3/4, TEXT_HEIGHT );
+    voiceNumBox.setBounds( densityPreviewToggle.getRight() + INDENT, densityPreviewToggle.getY(), SLIDERSIZE*2/5, TEXT_HEIGHT );
+    voiceLengthNumBox.setBounds( voiceNumBox.getRight(), voiceNumBox.getY(), SLIDERSIZE*2/5, TEXT_HEIGHT );
+    voiceDivisionComboBox.setBounds( voiceLengthNumBox.getRight(), voiceLengthNumBox.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    voiceGateNumBox.setBounds( voiceDivisionComboBox.getRight(), voiceDivisionComboBox.getY(), SLIDERSIZE*2/5, TEXT_HEIGHT );
+    clockSourceComboBox.setBounds( voiceGateNumBox.getRight() + INDENT, voiceGateNumBox.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    internalBpmNumBox.setBounds( clockSourceComboBox.getRight(), clockSourceComboBox.getY(), SLIDERSIZE/2, TEXT_HEIGHT );
+    
+    syncModeComboBox.setBounds( undoButton.getX() + SLIDERSIZE/2, undoButton.getBottom(), SLIDERSIZE/2, TEXT_HEIGHT );
+    syncGroupNumBox.setBounds( syncModeComboBox.getRight(), syncModeComboBox.getY(), SLIDERSIZE*2/5, TEXT_HEIGHT );
+    
     tooltipLabel.setBounds( 0, HEIGHT, WIDTH, TEXT_HEIGHT*4 );
 }
 
@@ -362,7 +651,10 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::timerCallback()
         setPattern();
         setIOISliderValues();
         setPatternMultiTogColours();
+        setVoiceControls();
         displayChangedIOI();
+        if ( !bankChainEditor.hasKeyboardFocus( true ) )
+            bankChainEditor.setText( audioProcessor.getBankChainText(), false );
         audioProcessor.setStateLoadedFalse();
     }
     auto step = audioProcessor.getCurrentStep();
@@ -371,48 +663,206 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::timerCallback()
         posDisplay.setCurrentStep( step );
         m_lastStep = step;
     }
+    auto metricsVoice = static_cast< int >( voiceNumBox.getValue() ) - 1;
+    if ( audioProcessor.updateRhythmMetrics() || metricsVoice != m_metricsVoice )
+    {
+        m_metricsVoice = metricsVoice;
+        setMetricsDisplay();
+    }
+    undoButton.setEnabled( audioProcessor.canUndoPatternEdit() );
+    redoButton.setEnabled( audioProcessor.canRedoPatternEdit() );
+    similarButton.setEnabled( audioProcessor.getPatternLibrarySize() > 0 );
+    // library patterns are read only
+    auto editable = !audioProcessor.isLibraryPatternActive();
+    libraryToBankButton.setEnabled( !editable );
+    for ( auto* c : std::initializer_list< juce::Component* >{ &patternMultiTog, &nBeatsNumBox, &divisionComboBox, &reverseButton, &markovHButton, &shuffleButton, &palindromeButton, &doubleButton, &rotateLeftButton, &rotateRightButton, &voiceLengthNumBox, &voiceDivisionComboBox } )
+        c->setEnabled( editable );
     if ( tooltipsToggle.getToggleState() )
         sjf_setTooltipLabel( this, MAIN_TOOLTIP, tooltipLabel );
 }
 
+bool Sjf_AAIM_DrumsAudioProcessorEditor::keyPressed( const juce::KeyPress& key )
+{
+    if ( key == juce::KeyPress( 'z', juce::ModifierKeys::commandModifier, 0 ) )
+    {
+        undoPatternEdit( true );
+        return true;
+    }
+    if ( key == juce::KeyPress( 'z', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        undoPatternEdit( false );
+        return true;
+    }
+#if SJF_AAIM_DIAGNOSTICS
+    if ( key == juce::KeyPress( 'b', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runMultiInstanceBenchmark();
+        return true;
+    }
+    if ( key == juce::KeyPress( 'g', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runGoldenComparison();
+        return true;
+    }
+    if ( key == juce::KeyPress( 'm', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runMicroBenchmarks();
+        return true;
+    }
+    if ( key == juce::KeyPress( 's', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runStartupBenchmark();
+        return true;
+    }
+    if ( key == juce::KeyPress( 'l', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runLibraryAnalysis();
+        return true;
+    }
+  #if SJF_AAIM_RT_AUDIT
+    if ( key == juce::KeyPress( 'a', juce::ModifierKeys::commandModifier | juce::ModifierKeys::shiftModifier, 0 ) )
+    {
+        runRealtimeAudit();
+        return true;
+    }
+  #endif
+#endif
+    return false;
+}
+
 
 void Sjf_AAIM_DrumsAudioProcessorEditor::setIOISliderValues()
 {
-    auto probs = audioProcessor.getIOIProbability();
+    auto& probs = audioProcessor.getIOIProbabilities();
     for ( size_t i = 0; i < probs.size(); i++ )
+        ioiProbsSlider.setSliderValue( static_cast<int>( i ), probs[ i ] );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::setPattern()
+{
+    for ( int i = 0; i < NUM_VOICES; i++ )
     {
-        auto sliderNum = 0;
-        for ( size_t j = 0; j < audioProcessor.ioiFactors.size(); j++ )
+        auto generation = audioProcessor.getPatternGeneration( i );
+        if ( generation == m_displayedGenerations[ i ] )
+            continue;
+        m_displayedGenerations[ i ] = generation;
+        auto word = audioProcessor.getPatternWord( i );
+        auto changed = word ^ m_displayedPattern[ i ];
+        m_displayedPattern[ i ] = word;
+        auto row = NUM_VOICES - 1 - i;
+        while ( changed != 0 )
         {
-            if ( probs[ i ][ 0 ] == audioProcessor.ioiFactors[ j ] )
-            {
-                sliderNum = static_cast<int>(j);
-                break;
-            }
+            auto step = std::countr_zero( changed );
+            changed &= changed - 1;
+            patternMultiTog.setToggleState( row, step, ( word >> step ) & 1u );
         }
-        ioiProbsSlider.setSliderValue( sliderNum, probs[ i ][ 1 ] );
     }
 }
 
-void Sjf_AAIM_DrumsAudioProcessorEditor::setPattern()
+void Sjf_AAIM_DrumsAudioProcessorEditor::setDisplayedPatternFromGrid()
 {
-    patternMultiTog.setAllToggles( false );
+    // after an edit in the grid itself the grid is already up to date
     for ( int i = 0; i < NUM_VOICES; i++ )
     {
-        auto pat = audioProcessor.getPattern( i );
-        auto row = NUM_VOICES - 1 - i;
-        for ( size_t j = 0; j < pat.size(); j++ )
-            patternMultiTog.setToggleState( row, static_cast<int>(j), pat[ j ] );
+        auto row = patternMultiTog.getRow( NUM_VOICES - 1 - i );
+        auto word = 0u;
+        for ( size_t j = 0; j < row.size() && j < MAX_NUM_STEPS; j++ )
+            word |= row[ j ] ? ( 1u << j ) : 0u;
+        m_displayedPattern[ i ] = word;
+        m_displayedGenerations[ i ] = audioProcessor.getPatternGeneration( i );
     }
 }
 
 
-void Sjf_AAIM_DrumsAudioProcessorEditor::setPatternMultiTogColours()
+void Sjf_AAIM_DrumsAudioProcessorEditor::setVoiceControls()
+{
+    auto voice = static_cast< int >( voiceNumBox.getValue() ) - 1;
+    voiceLengthNumBox.setValue( audioProcessor.getVoiceNumBeats( voice ), juce::dontSendNotification );
+    voiceDivisionComboBox.setSelectedId( audioProcessor.getVoiceDivision( voice ) + 1, juce::dontSendNotification );
+    voiceGateNumBox.setValue( audioProcessor.getVoiceGateLength( voice ), juce::dontSendNotification );
+    setAccentControls();
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::setMetricsDisplay()
+{
+    auto& metrics = audioProcessor.getRhythmMetrics();
+    auto describe = []( const juce::String& name, const Sjf_AAIM_DrumsAudioProcessor::rhythmMetrics::values& v )
+    {
+        return name + " - density " + juce::String( v.density, 2 ) + ", syncopation " + juce::String( v.syncopation, 2 )
+            + ", evenness " + juce::String( v.evenness, 2 ) + ", overlap " + juce::String( v.overlap, 2 );
+    };
+    auto kit = metrics.getKit();
+    metricsLabel.setText( "D " + juce::String( kit.density, 2 ) + "  S " + juce::String( kit.syncopation, 2 ) + "  E " + juce::String( kit.evenness, 2 ) + "  O " + juce::String( kit.overlap, 2 ), juce::dontSendNotification );
+    metricsLabel.setTooltip( "This shows the density (D), syncopation (S), evenness (E) and overlap between voices (O) of the whole kit as it is playing\n\n"
+        + describe( "Kit", kit ) + "\n" + describe( "Voice " + juce::String( m_metricsVoice + 1 ), metrics.getVoice( static_cast< size_t >( m_metricsVoice ) ) ) );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::importMidiDirectory( const juce::File& directory )
 {
+    // a new file each time, a library that is already open keeps its mapping of the old one
+    auto libraryFile = directory.getSiblingFile( directory.getFileName() + ".aaimlib" ).getNonexistentSibling();
+    auto nBeats = audioProcessor.getNumBeats();
+    auto division = static_cast< size_t >( audioProcessor.getTsDenominator() );
+    libraryButton.setEnabled( false );
+    libraryButton.setTooltip( "Importing " + directory.getFileName() + "..." );
+    juce::Component::SafePointer< Sjf_AAIM_DrumsAudioProcessorEditor > editor( this );
+    juce::Thread::launch( [ editor, directory, libraryFile, nBeats, division ]
+    {
+        auto nRecords = Sjf_AAIM_DrumsAudioProcessor::midiImport::importDirectory( directory, libraryFile, nBeats, division, juce::SystemStats::getNumCpus() );
+        juce::MessageManager::callAsync( [ editor, libraryFile, nRecords ]
+        {
+            if ( editor == nullptr )
+                return;
+            editor->libraryButton.setEnabled( true );
+            if ( nRecords > 0 && editor->audioProcessor.loadPatternLibrary( libraryFile ) )
+                editor->libraryButton.setTooltip( "Pattern library: " + editor->audioProcessor.getPatternLibraryName() );
+            else
+                editor->libraryButton.setTooltip( "No patterns could be imported from the midi files" );
+        } );
+    } );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::setAccentControls()
+{
+    auto& accents = audioProcessor.getAccents( static_cast< int >( voiceNumBox.getValue() ) - 1 );
     for ( int i = 0; i < MAX_NUM_STEPS; i++ )
+    {
+        accentScaleSlider.setSliderValue( i, accents.scale[ static_cast< size_t >( i ) ] * 0.5f );
+        accentOffsetSlider.setSliderValue( i, accents.offset[ static_cast< size_t >( i ) ] + 0.5f );
+    }
+    accentRandomNumBox.setValue( accents.randomRange, juce::dontSendNotification );
+    if ( accentsToggle.getToggleState() )
+    {
+        // the title shows the voice
+        m_staticLayer = juce::Image();
+        repaint();
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::showAccents( bool shouldShowAccents )
+{
+    ioiProbsSlider.setVisible( !shouldShowAccents );
+    ioiLabel.setVisible( !shouldShowAccents );
+    accentScaleSlider.setVisible( shouldShowAccents );
+    accentOffsetSlider.setVisible( shouldShowAccents );
+    accentRandomNumBox.setVisible( shouldShowAccents );
+    setAccentControls();
+    m_staticLayer = juce::Image();
+    repaint();
+}
+
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::setPatternMultiTogColours()
+{
+    // only the columns between the old and new length change colour
+    auto nBeats = static_cast< int >( nBeatsNumBox.getValue() );
+    auto first = m_colouredNumBeats < 0 ? 0 : juce::jmin( nBeats, m_colouredNumBeats );
+    auto last = m_colouredNumBeats < 0 ? MAX_NUM_STEPS : juce::jmax( nBeats, m_colouredNumBeats );
+    m_colouredNumBeats = nBeats;
+    for ( int i = first; i < last; i++ )
     {
         auto colour1 = otherLookAndFeel.sliderFillColour;
-        if( i >= nBeatsNumBox.getValue() )
+        if( i >= nBeats )
             patternMultiTog.setColumnColour( i, juce::Colours::darkgrey );
         else if ( i % 4 == 0 )
             patternMultiTog.setColumnColour( i, colour1 );
@@ -424,14 +874,120 @@ void Sjf_AAIM_DrumsAudioProcessorEditor::setPatternMultiTogColours()
 
 void Sjf_AAIM_DrumsAudioProcessorEditor::displayChangedIOI()
 {
-    auto probs = audioProcessor.getIOIProbability();
+    auto version = audioProcessor.getIOIVersion();
+    if ( version == m_ioiVersion )
+        return;
+    m_ioiVersion = version;
+    auto& probs = audioProcessor.getIOIProbabilities();
     for ( size_t i = 0; i < probs.size(); i++ )
     {
-        if ( m_ioiProbs[ i ] != probs[ i ][ 1 ] )
+        if ( m_ioiProbs[ i ] != probs[ i ] )
         {
-            m_ioiProbs[ i ] = probs[ i ][ 1 ];
+            m_ioiProbs[ i ] = probs[ i ];
             m_changedIOI = i;
-            ioiLabel.setText( "division:"+juce::String( probs[ i ][ 0 ] ) + " chance:" + juce::String( probs[ i ][ 1 ] ), juce::dontSendNotification );
+            ioiLabel.setText( "division:"+juce::String( audioProcessor.ioiFactors[ i ] ) + " chance:" + juce::String( probs[ i ] ), juce::dontSendNotification );
         }
     }
 }
+
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::undoPatternEdit( bool trueIfUndoFalseIfRedo )
+{
+    // the editor is refreshed once the processor has reloaded the current bank
+    if ( trueIfUndoFalseIfRedo )
+        audioProcessor.undoPatternEdit();
+    else
+        audioProcessor.redoPatternEdit();
+    audioProcessor.setNonAutomatableParameterValues();
+}
+//==============================================================================
+#if SJF_AAIM_DIAGNOSTICS
+void Sjf_AAIM_DrumsAudioProcessorEditor::runMultiInstanceBenchmark()
+{
+    // the instances are created and deleted on the message thread, only the processing is done in the background
+    auto benchmark = std::make_shared< sjf_AAIM_diagnostics::multiInstanceBenchmark >( 128 );
+    juce::Thread::launch( [ benchmark ]() mutable
+    {
+        auto report = benchmark->run( juce::SystemStats::getNumCpus() );
+        juce::MessageManager::callAsync( [ benchmark = std::move( benchmark ), report ]
+        {
+            DBG( report );
+            juce::SystemClipboard::copyTextToClipboard( report );
+            juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Multi-instance benchmark", report );
+        } );
+    } );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::runGoldenComparison()
+{
+    // several hundred renders, so they are done in the background
+    auto goldenFile = juce::File::getSpecialLocation( juce::File::tempDirectory ).getChildFile( "sjf_AAIM_Drums_golden.txt" );
+    juce::Thread::launch( [ goldenFile ]
+    {
+        auto report = sjf_AAIM_diagnostics::compareGoldenRenders( goldenFile );
+        juce::MessageManager::callAsync( [ report ]
+        {
+            DBG( report );
+            juce::SystemClipboard::copyTextToClipboard( report );
+            juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Golden output comparison", report );
+        } );
+    } );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::runMicroBenchmarks()
+{
+    // keep the baseline between builds, delete it to start a new one
+    auto baselineFile = juce::File::getSpecialLocation( juce::File::tempDirectory ).getChildFile( "sjf_AAIM_Drums_microbenchmarks.tsv" );
+    juce::Thread::launch( [ baselineFile ]
+    {
+        auto report = sjf_AAIM_diagnostics::compareMicroBenchmarks( baselineFile );
+        juce::MessageManager::callAsync( [ report ]
+        {
+            DBG( report );
+            juce::SystemClipboard::copyTextToClipboard( report );
+            juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Microbenchmarks", report );
+        } );
+    } );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::runStartupBenchmark()
+{
+    // the editors have to be made on the message thread, so this one blocks for a moment
+    auto report = sjf_AAIM_diagnostics::runStartupBenchmark();
+    DBG( report );
+    juce::SystemClipboard::copyTextToClipboard( report );
+    juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Startup benchmark", report );
+}
+
+void Sjf_AAIM_DrumsAudioProcessorEditor::runLibraryAnalysis()
+{
+    auto libraryFile = audioProcessor.getPatternLibraryFile();
+    auto outputFile = juce::File::getSpecialLocation( juce::File::tempDirectory ).getChildFile( "sjf_AAIM_Drums_libraryMetrics.tsv" );
+    juce::Thread::launch( [ libraryFile, outputFile ]
+    {
+        auto report = sjf_AAIM_diagnostics::analysePatternLibrary( libraryFile, outputFile );
+        juce::MessageManager::callAsync( [ report ]
+        {
+            DBG( report );
+            juce::SystemClipboard::copyTextToClipboard( report );
+            juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Pattern library metrics", report );
+        } );
+    } );
+}
+
+#if SJF_AAIM_RT_AUDIT
+void Sjf_AAIM_DrumsAudioProcessorEditor::runRealtimeAudit()
+{
+    juce::Thread::launch( []
+    {
+        auto report = sjf_AAIM_diagnostics::runRealtimeAudit();
+        juce::MessageManager::callAsync( [ report ]
+        {
+            DBG( report );
+            juce::SystemClipboard::copyTextToClipboard( report );
+            juce::AlertWindow::showMessageBoxAsync( juce::MessageBoxIconType::InfoIcon, "Real-time safety audit", report );
+        } );
+    } );
+}
+#endif
+#endif
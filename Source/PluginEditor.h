@@ -15,6 +15,8 @@
 //#include "../../sjf_audio/sjf_LookAndFeel.h"
 #include "../sjf_AAIM_Cplusplus/sjf_audio/sjf_widgets.h"
 #include "../sjf_AAIM_Cplusplus/sjf_audio/sjf_LookAndFeel.h"
+#include "sjf_AAIM_densityPreview.h"
+#include "sjf_AAIM_Drums_diagnostics.h"
 //==============================================================================
 /**
 */
@@ -38,17 +40,21 @@ public:
         g.fillAll( m_bgColour );
         
         g.setColour( m_fgColour );
-        auto w = static_cast< float >( getWidth() ) / static_cast< float >( m_nSteps );
-        auto r = juce::Rectangle< float >( m_Xpos, 0, w, getHeight() );
-        g.fillRect( r );
+        g.fillRect( getStepBounds( m_step ) );
         
         if (!m_drawOutlineFlag )
             return;
         
-        g.setColour( m_outlineColour );
-        g.drawRect( getLocalBounds() );
-        for ( int i = 1; i < m_nSteps-1; i++ )
-            g.drawLine( w*i, 0, w*i, getHeight() );
+        // the grid only changes with the size, colour or number of steps so it is drawn once and reused
+        auto scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+        if ( !m_gridImage.isValid() || scale != m_gridScale )
+            renderGrid( scale );
+        g.drawImage( m_gridImage, 0, 0, getWidth(), getHeight(), 0, 0, m_gridImage.getWidth(), m_gridImage.getHeight() );
+    }
+    
+    void resized() override
+    {
+        m_gridImage = juce::Image();
     }
     
     void setBackGroundColour( juce::Colour c )
@@ -64,19 +70,24 @@ public:
     void setOutlineColour( juce::Colour c )
     {
         m_outlineColour = c;
+        m_gridImage = juce::Image();
     }
     
     
     void setCurrentStep( int step )
     {
-        m_Xpos = static_cast< float >( getWidth() * step ) / static_cast< float >( m_nSteps );
-        DBG("posX " << m_Xpos << " step " << step );
-        repaint();
+        if ( step == m_step )
+            return;
+        // only the column the cursor leaves and the one it moves to need redrawing
+        repaint( getStepBounds( m_step ) );
+        m_step = step;
+        repaint( getStepBounds( m_step ) );
     }
     
     void setNumSteps( int steps )
     {
         m_nSteps = steps;
+        m_gridImage = juce::Image();
     }
     
     void shouldDrawOutline( bool trueIfShouldDrawOutline )
@@ -85,12 +96,111 @@ public:
     }
     
 private:
+    juce::Rectangle< int > getStepBounds( int step ) const
+    {
+        auto w = static_cast< float >( getWidth() ) / static_cast< float >( m_nSteps );
+        return juce::Rectangle< float >( w * step, 0, w, getHeight() ).getSmallestIntegerContainer();
+    }
+    
+    void renderGrid( float scale )
+    {
+        m_gridScale = scale;
+        m_gridImage = juce::Image( juce::Image::ARGB, juce::jmax( 1, juce::roundToInt( getWidth() * scale ) ), juce::jmax( 1, juce::roundToInt( getHeight() * scale ) ), true );
+        juce::Graphics g( m_gridImage );
+        g.addTransform( juce::AffineTransform::scale( scale ) );
+        g.setColour( m_outlineColour );
+        g.drawRect( getLocalBounds() );
+        auto w = static_cast< float >( getWidth() ) / static_cast< float >( m_nSteps );
+        for ( int i = 1; i < m_nSteps-1; i++ )
+            g.drawLine( w*i, 0, w*i, getHeight() );
+    }
+    
     juce::Colour m_bgColour, m_fgColour, m_outlineColour;
-    float m_Xpos = 0;
-    int m_nSteps = 32;
+    juce::Image m_gridImage;
+    float m_gridScale = 1;
+    int m_nSteps = 32, m_step = 0;
     bool m_drawOutlineFlag = false;
 };
 
+class sjf_densityOverlay : public juce::Component, private juce::Timer
+{
+public:
+    using preview = sjf_densityPreview< NUM_VOICES, MAX_NUM_STEPS, NUM_IOIs >;
+    
+    sjf_densityOverlay()
+    {
+        setInterceptsMouseClicks( false, false );
+    }
+    ~sjf_densityOverlay(){ stopTimer(); }
+    
+    // called from the overlay's timer to find out what the generator is currently set to
+    std::function< preview::settings() > getSettings;
+    
+    void paint (juce::Graphics& g) override
+    {
+        if ( m_result.nBars == 0 )
+            return;
+        auto w = static_cast< float >( getWidth() ) / static_cast< float >( MAX_NUM_STEPS );
+        auto h = static_cast< float >( getHeight() ) / static_cast< float >( NUM_VOICES );
+        for ( size_t v = 0; v < NUM_VOICES; v++ )
+        {
+            auto y = h * static_cast< float >( NUM_VOICES - 1 - v );
+            for ( size_t s = 0; s < m_result.nBeats; s++ )
+            {
+                auto p = m_result.probability[ v ][ s ];
+                if ( p <= 0 )
+                    continue;
+                auto x = w * static_cast< float >( s );
+                g.setColour( m_colour.withAlpha( 0.7f * p ) );
+                g.fillRect( x, y, w, h );
+                // mean velocity as a line across the cell, the spread either side of it
+                auto vel = m_result.meanVelocity[ v ][ s ];
+                auto dev = m_result.velocityDeviation[ v ][ s ];
+                g.setColour( juce::Colours::white.withAlpha( 0.25f ) );
+                g.fillRect( x, y + h * ( 1.0f - juce::jmin( 1.0f, vel + dev ) ), w, h * juce::jmin( 1.0f, 2.0f * dev ) );
+                g.setColour( juce::Colours::white.withAlpha( 0.8f ) );
+                g.drawLine( x, y + h * ( 1.0f - vel ), x + w, y + h * ( 1.0f - vel ) );
+            }
+        }
+    }
+    
+    void visibilityChanged() override
+    {
+        if ( isVisible() )
+        {
+            if ( m_preview == nullptr )
+                m_preview = std::make_unique< preview >( Sjf_AAIM_DrumsAudioProcessor::ioiFactors, juce::jlimit( 1, 4, juce::SystemStats::getNumCpus() / 2 ) );
+            m_preview->start();
+            startTimerHz( 30 );
+        }
+        else
+        {
+            stopTimer();
+            m_preview.reset();
+            m_result = preview::result();
+        }
+    }
+    
+    void setDensityColour( juce::Colour c )
+    {
+        m_colour = c;
+    }
+    
+private:
+    void timerCallback() override
+    {
+        if ( m_preview == nullptr || !getSettings )
+            return;
+        m_preview->setSettings( getSettings() );
+        if ( m_preview->getResult( m_result ) )
+            repaint();
+    }
+    
+    std::unique_ptr< preview > m_preview;
+    preview::result m_result;
+    juce::Colour m_colour = juce::Colours::orange;
+};
+
 class Sjf_AAIM_DrumsAudioProcessorEditor  : public juce::AudioProcessorEditor, public juce::Timer
 {
 public:
@@ -102,6 +212,10 @@ public:
     void resized() override;
 
     void timerCallback() override;
+    
+    void lookAndFeelChanged() override;
+    
+    bool keyPressed( const juce::KeyPress& key ) override;
 private:
     // This reference is provided as a quick way for your editor to
     // access the processor object that created it.
@@ -109,24 +223,46 @@ private:
     
     void setIOISliderValues();
     void setPattern();
+    void setDisplayedPatternFromGrid();
+    void setVoiceControls();
+    void setAccentControls();
+    // the kit's metrics on the label, the selected voice's too in its tooltip
+    void setMetricsDisplay();
+    // parses every midi file in the directory on a background thread and loads the library they were written to
+    void importMidiDirectory( const juce::File& directory );
+    void showAccents( bool shouldShowAccents );
     void setPatternMultiTogColours();
     void displayChangedIOI();
+    void undoPatternEdit( bool trueIfUndoFalseIfRedo );
+    void renderStaticLayer( float scale );
+#if SJF_AAIM_DIAGNOSTICS
+    void runMultiInstanceBenchmark();
+    void runGoldenComparison();
+    void runMicroBenchmarks();
+    void runStartupBenchmark();
+    void runLibraryAnalysis();
+  #if SJF_AAIM_RT_AUDIT
+    void runRealtimeAudit();
+  #endif
+#endif
     
     juce::AudioProcessorValueTreeState& valueTreeState;
     
-    juce::Slider compSlider, restSlider, fillsSlider, swingSlider, bankNumber;
+    juce::Slider compSlider, restSlider, fillsSlider, swingSlider, bankNumber, libraryPatternSlider;
 //    sjf_radioButtonSlider bankNumber;
     
-    sjf_numBox nBeatsNumBox;
-    juce::ComboBox divisionComboBox;
+    sjf_numBox nBeatsNumBox, voiceNumBox, voiceLengthNumBox, voiceGateNumBox, accentRandomNumBox, morphNumBox, morphBankNumBox, internalBpmNumBox, followAmountNumBox, syncGroupNumBox;
+    juce::ComboBox divisionComboBox, voiceDivisionComboBox, clockSourceComboBox, syncModeComboBox;
     
-    std::unique_ptr< juce::AudioProcessorValueTreeState::SliderAttachment > compSliderAttachment, restSliderAttachment, fillsSliderAttachment, swingSliderAttachment, bankNumberAttachment;
-    std::unique_ptr< juce::AudioProcessorValueTreeState::ButtonAttachment > internalSyncResetButtonAttachment;
+    std::unique_ptr< juce::AudioProcessorValueTreeState::SliderAttachment > compSliderAttachment, restSliderAttachment, fillsSliderAttachment, swingSliderAttachment, bankNumberAttachment, libraryPatternAttachment, internalBpmAttachment, followAmountAttachment, syncGroupAttachment, morphAttachment, morphBankAttachment;
+    std::unique_ptr< juce::AudioProcessorValueTreeState::ComboBoxAttachment > clockSourceAttachment, syncModeAttachment;
+    std::unique_ptr< juce::AudioProcessorValueTreeState::ButtonAttachment > internalSyncResetButtonAttachment, bankChainAttachment;
     
     
     sjf_multitoggle patternMultiTog;
     sjf_positionDisplay posDisplay, bankDisplay;
-    sjf_multislider ioiProbsSlider;
+    sjf_densityOverlay densityOverlay;
+    sjf_multislider ioiProbsSlider, accentScaleSlider, accentOffsetSlider;
     
     sjf_lookAndFeel otherLookAndFeel;
     juce::LookAndFeel_V4 LandF2;
@@ -138,19 +274,30 @@ private:
         juce::Colours::darkred, juce::Colours::darkblue, juce::Colours::darkgreen, juce::Colours::darkcyan, juce::Colours::darksalmon
     };
     
-    juce::ToggleButton tooltipsToggle, internalSyncResetButton;
-    juce::TextButton reverseButton, markovHButton, shuffleButton, palindromeButton, doubleButton, rotateLeftButton, rotateRightButton;
+    juce::ToggleButton tooltipsToggle, internalSyncResetButton, metricSimilarityToggle, densityPreviewToggle, accentsToggle, bankChainToggle;
+    juce::TextButton reverseButton, markovHButton, shuffleButton, palindromeButton, doubleButton, rotateLeftButton, rotateRightButton, undoButton, redoButton, similarButton, libraryButton, libraryToBankButton;
     juce::Label tooltipLabel;
-    juce::String MAIN_TOOLTIP = "sjf_AAIM_Drums: \nAlgorithmic variations of drum patterns \n";
+    juce::TextEditor bankChainEditor;
+    juce::Label metricsLabel;
+    juce::String MAIN_TOOLTIP = "sjf_AAIM_Drums: \nAlgorithmic variations of drum patterns \n\nMIDI input: notes 0-15 select banks, 16-22 trigger the variations, 23 restarts the pattern, 24-39 mute/unmute voices, 40 or cc64 hold fills, cc102 selects banks \n";
+    
+    std::unique_ptr< juce::FileChooser > libraryChooser;
     
-    juce::Image AAIM_logo = juce::ImageFileFormat::loadFrom( BinaryData::aaim_logo_png, BinaryData::aaim_logo_pngSize );
+    juce::Image AAIM_logo = juce::ImageCache::getFromMemory( BinaryData::aaim_logo_png, BinaryData::aaim_logo_pngSize ); // decoded once and shared by every editor
+    // background, logo and labels, redrawn only after a resize or look and feel change
+    juce::Image m_staticLayer;
+    float m_staticLayerScale = 1;
 
     
-    int m_selectedBank = 0, m_lastStep = -1;
+    int m_selectedBank = 0, m_lastStep = -1, m_metricsVoice = -1;
     size_t m_changedIOI = 0;
     bool m_nBeatsDragFlag = false, m_bankFlag = false;
     
     std::array< float, NUM_IOIs > m_ioiProbs;
+    // what the pattern grid is currently showing, so only the cells that differ are updated
+    std::array< uint32_t, NUM_VOICES > m_displayedPattern{}, m_displayedGenerations{};
+    int m_colouredNumBeats = -1;
+    uint32_t m_ioiVersion = 0;
     juce::Label ioiLabel;
     
     
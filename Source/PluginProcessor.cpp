@@ -8,6 +8,7 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
+#include <bit>
 
 //==============================================================================
 Sjf_AAIM_DrumsAudioProcessor::Sjf_AAIM_DrumsAudioProcessor()
@@ -26,45 +27,61 @@ Sjf_AAIM_DrumsAudioProcessor::Sjf_AAIM_DrumsAudioProcessor()
 {
     DBG( "AAIM Drums" );
     
-    midiChannelParameter = parameters.getRawParameterValue( "midiChannel" );
-    complexityParameter = parameters.getRawParameterValue( "complexity" );
-    restsParameter = parameters.getRawParameterValue( "rests" );
-    fillsParameter = parameters.getRawParameterValue( "fills" );
-    swingParameter = parameters.getRawParameterValue( "swing" );
-    bankNumberParameter = parameters.getRawParameterValue( "patternBank" );
-    internalResetParameter = parameters.getRawParameterValue( "internalReset" );
+    m_hot.midiChannelParameter = parameters.getRawParameterValue( "midiChannel" );
+    m_hot.complexityParameter = parameters.getRawParameterValue( "complexity" );
+    m_hot.restsParameter = parameters.getRawParameterValue( "rests" );
+    m_hot.fillsParameter = parameters.getRawParameterValue( "fills" );
+    m_hot.swingParameter = parameters.getRawParameterValue( "swing" );
+    m_hot.bankNumberParameter = parameters.getRawParameterValue( "patternBank" );
+    m_hot.internalResetParameter = parameters.getRawParameterValue( "internalReset" );
+    m_hot.libraryPatternParameter = parameters.getRawParameterValue( "libraryPattern" );
+    m_hot.clockSourceParameter = parameters.getRawParameterValue( "clockSource" );
+    m_hot.internalBpmParameter = parameters.getRawParameterValue( "internalBpm" );
+    m_hot.followAmountParameter = parameters.getRawParameterValue( "followAmount" );
+    m_hot.syncModeParameter = parameters.getRawParameterValue( "syncMode" );
+    m_hot.syncGroupParameter = parameters.getRawParameterValue( "syncGroup" );
+    m_hot.morphParameter = parameters.getRawParameterValue( "morph" );
+    m_hot.morphBankParameter = parameters.getRawParameterValue( "morphBank" );
+    m_hot.arrangementParameter = parameters.getRawParameterValue( "arrangement" );
+    m_bankParameter = parameters.getParameter( "patternBank" );
     
-    for ( size_t i = 0; i < NUM_IOIs; i++ )
-    {
-        ioiDivParameters[ i ] = parameters.state.getPropertyAsValue( "ioiDiv" + juce::String(i), nullptr, true );
-        ioiProbParameters[ i ] = parameters.state.getPropertyAsValue( "ioiProb" + juce::String(i), nullptr, true );
-    }
+    // the banks, divisions and gate lengths only go into the state when it is saved, see setNonAutomatableParameterValues
+    patternLibraryFileParameter = parameters.state.getPropertyAsValue( "patternLibraryFile", nullptr, true );
+    bankChainParameter = parameters.state.getPropertyAsValue( "bankChain", nullptr, true );
+    m_bankChain = std::make_shared< const sjf_bankChain >();
+    for ( auto& gate : m_voiceGateLengths )
+        gate.store( DEFAULT_GATE_LENGTH );
     
-    for ( size_t i = 0; i < NUM_BANKS; i++ )
-    {
-        for ( size_t j = 0; j < NUM_VOICES; j++ )
-        {
-            patternBanksParameters[ i ][ j ] = parameters.state.getPropertyAsValue( "patternBank" + juce::String( i ) + "Voice" + juce::String( j ), nullptr, true );
-        }
-        patternBanksNumBeatsParameters[ i ] = parameters.state.getPropertyAsValue( "patternBankNumBeats" + juce::String( i ), nullptr, true );
-        divBanksParameters[ i ] = parameters.state.getPropertyAsValue( "divisionBank" + juce::String( i ), nullptr, true );
-    }
+    for ( auto& ioi : m_rGen.getIOIProbabilities() )
+        m_ioiTable.setProbability( m_ioiTable.findIndex( ioi[ 0 ] ), ioi[ 1 ] );
     
-    auto nBeats = m_rGen.getNumBeats();
-    for ( size_t i = 0; i < NUM_BANKS; i++ )
+    auto& metres = getMetres();
+    for ( size_t n = 1; n <= MAX_NUM_STEPS; n++ )
     {
-        m_nBeatsBanks[ i ] = nBeats;
-        m_divBanks[ i ] = eightNote;
-        for ( size_t j = 0; j < NUM_VOICES; j++ )
-            m_patternBanks[ i ][ j ].reset();
+        m_bankMorph.setOrdering( n, metres[ n ] );
+        m_rhythmMetrics.setMetre( n, metres[ n ] );
     }
+    // so the first update takes every voice
+    for ( auto& g : m_metricsGenerations )
+        g = ~0u;
+    
+    // the patterns start empty, the bitsets are already cleared
+    m_nBeatsBanks.fill( m_rGen.getNumBeats() );
+    m_divBanks.fill( eightNote );
+    publishPatternBanks();
+    publishAccents();
 
     selectPatternBank();
     setParameters();
+    m_patternHistory.reset( getPatternBankSnapshots(), m_accentBanks );
+    startTimerHz( 30 );
 }
 
 Sjf_AAIM_DrumsAudioProcessor::~Sjf_AAIM_DrumsAudioProcessor()
 {
+    stopTimer();
+    if ( m_hot.syncRing != nullptr )
+        m_hot.syncRing->releaseLeader( this );
 }
 
 //==============================================================================
@@ -132,6 +149,11 @@ void Sjf_AAIM_DrumsAudioProcessor::changeProgramName (int index, const juce::Str
 //==============================================================================
 void Sjf_AAIM_DrumsAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
+    m_gateOutput.prepare( sampleRate );
+    m_onsetFollower.prepare( sampleRate, samplesPerBlock );
+    m_noteOffs.clear();
+    m_hot.blockStartSample = m_hot.blockEndSample = 0;
+    m_hot.followerDelay = samplesPerBlock;
     selectPatternBank();
     setParameters();
 }
@@ -146,8 +168,14 @@ void Sjf_AAIM_DrumsAudioProcessor::releaseResources()
 bool Sjf_AAIM_DrumsAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) const
 {
   #if JucePlugin_IsMidiEffect
-    juce::ignoreUnused (layouts);
-    return true;
+    if ( !m_auxiliaryBuses )
+        return true;
+    // the gates are the last output, every voice or nothing, and the sidechain is the only input
+    auto gates = layouts.getChannelSet( false, layouts.outputBuses.size() - 1 );
+    if ( !gates.isDisabled() && gates != juce::AudioChannelSet::discreteChannels( NUM_VOICES * 2 ) )
+        return false;
+    auto sidechain = layouts.getChannelSet( true, 0 );
+    return sidechain.isDisabled() || sidechain == juce::AudioChannelSet::mono() || sidechain == juce::AudioChannelSet::stereo();
   #else
     // This is the place where you check if the layout is supported.
     // In this template code we only support mono or stereo.
@@ -170,96 +198,352 @@ bool Sjf_AAIM_DrumsAudioProcessor::isBusesLayoutSupported (const BusesLayout& la
 
 void Sjf_AAIM_DrumsAudioProcessor::processBlock ( juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages )
 {
-    //    selectPatternBank();
-        setParameters();
-    
-    auto swing = static_cast< float > ( *swingParameter );
-    swing = swing >= 0 ? 1.0f + ( swing * swing ) : 1.0f - ( 0.5f * swing * swing );
-    auto swingOnFlag = swing == 1 ? false : true;
+#if SJF_AAIM_RT_AUDIT
+    sjf_rtAudit::scopedAudioThread audit; // every allocation from here on is recorded
+#endif
     juce::ScopedNoDenormals noDenormals;
+    // the sidechain has to be read before the buffer is cleared, it has no channels when the host hasn't enabled it
+    if ( m_auxiliaryBuses && *m_hot.followAmountParameter > 0 )
+        m_onsetFollower.process( getBusBuffer( buffer, true, 0 ) );
     buffer.clear(); // remove any noise in buffer...
     auto bufferSize = buffer.getNumSamples();
     
+    m_midiControl.parse( midiMessages ); // read any control events before the buffer is reused for output
     midiMessages.clear(); // clear midi messages
-    playHead = this->getPlayHead();
-    // if there is an available playhead
-    if (playHead != nullptr )
+    
+    // note offs scheduled in earlier blocks are placed relative to this
+    m_hot.blockStartSample = m_hot.blockEndSample;
+    m_hot.blockEndSample += bufferSize;
+    
+    double pos, increment;
+    if ( !updateClock( bufferSize, pos, increment ) )
+    {
+        // nothing is playing, bank and fill changes are only recorded here and the generator is left alone until playback resumes
+        flushNoteOffs( midiMessages, 0 );
+        m_hot.chainBar.store( NO_CHAIN_BAR, std::memory_order_relaxed ); // the bar is looked up again when playback starts
+        m_hot.idle = true;
+        while ( auto e = m_midiControl.next( bufferSize ) )
+            applyMidiControl( *e );
+        renderGateOutput( buffer );
+        return;
+    }
+#if SJF_AAIM_DIAGNOSTICS
+    scopedPlaying playing; // from here on the generator can draw random numbers
+#endif
+    
+    if ( m_hot.idle )
+    {
+        // whatever was chosen while stopped is loaded before the first step plays
+        m_hot.idle = false;
+        selectPatternBank();
+    }
+    setParameters();
+    // gate lengths are in steps of the pattern, swing is ignored so every note of a voice is the same length
+    m_hot.samplesPerStep = 1.0 / ( increment * std::pow( 2.0, static_cast< double >( getActiveDivision() ) - 2.0 ) );
+    if ( updateSyncRole() == syncFollower )
+    {
+        renderFollowerBlock( midiMessages, bufferSize, pos, increment );
+        sendNoteOffs( midiMessages, bufferSize );
+        renderGateOutput( buffer );
+        return;
+    }
+    // the block is split wherever a midi event lands, a bar of the arrangement starts or the bank changes,
+    // each part is rendered from a fresh snapshot
+    auto chainOn = static_cast< bool >( *m_hot.arrangementParameter );
+    if ( !chainOn )
+    {
+        m_hot.chainBar.store( NO_CHAIN_BAR, std::memory_order_relaxed );
+        // a variation only lasts as long as its entry, so the bank goes back to how it is stored at the next step
+        if ( m_hot.chainVariationPlaying )
+        {
+            m_hot.chainVariationPlaying = false;
+            m_hot.lastLoadedBank = -1;
+        }
+    }
+    auto start = 0;
+    while ( start < bufferSize )
+    {
+        while ( auto e = m_midiControl.next( start ) )
+            applyMidiControl( *e );
+        if ( chainOn )
+            applyBankChain( pos + start * increment );
+        auto context = makeRenderContext( pos, increment );
+        if ( m_hot.bankChangePending )
+            flushNoteOffs( midiMessages, start ); // the new bank may use the notes differently
+        if ( m_hot.restartPending || m_hot.bankChangePending )
+        {
+            // start again from the first step on this sample, after a bank change only if internal reset is on
+            auto beat = context.swingOn ? applySwingToPosition( context.position + start * context.increment, context.swing ) : context.position + start * context.increment;
+            m_hot.internalSyncCompensation = m_hot.restartPending || static_cast< bool >( *m_hot.internalResetParameter ) ? beat : 0;
+            context.compensation = m_hot.internalSyncCompensation;
+            m_hot.restartPending = m_hot.bankChangePending = false;
+        }
+        auto end = juce::jmin( bufferSize, m_midiControl.getNextPosition() );
+        if ( chainOn )
+            end = juce::jmin( end, getNextBarSample( pos, increment, start ) );
+        start = context.swingOn ? renderSegment< true >( context, midiMessages, start, end ) : renderSegment< false >( context, midiMessages, start, end );
+    }
+    // anything left at the very end of the block
+    while ( auto e = m_midiControl.next( bufferSize ) )
+        applyMidiControl( *e );
+    sendNoteOffs( midiMessages, bufferSize );
+    renderGateOutput( buffer );
+}
+
+Sjf_AAIM_DrumsAudioProcessor::renderContext Sjf_AAIM_DrumsAudioProcessor::makeRenderContext( double quarterNotePosition, double quarterNotesPerSample )
+{
+    renderContext context;
+    auto swing = static_cast< float > ( *m_hot.swingParameter );
+    context.swing = swing >= 0 ? 1.0f + ( swing * swing ) : 1.0f - ( 0.5f * swing * swing );
+    context.swingOn = context.swing != 1;
+    context.division = getActiveDivision();
+    context.nBeats = getActiveNumBeats();
+    auto indx = static_cast< double >( static_cast<int>( context.division ) - 2 );
+    auto beatDivFactor = std::pow( 2.0, indx ); // multiple for converting from quarterNotes to other beat types
+    // convert from quarter notes to the underlying rhythmic division of the drumMachine
+    context.position = quarterNotePosition * beatDivFactor;
+    context.increment = quarterNotesPerSample * beatDivFactor;
+    context.quarterNotePosition = quarterNotePosition;
+    context.quarterNotesPerSample = quarterNotesPerSample;
+    context.compensation = m_hot.internalSyncCompensation;
+    context.midiChannel = m_hot.midiChannel;
+    context.mutedVoices = m_hot.mutedVoices;
+    return context;
+}
+
+template< bool SWING >
+int Sjf_AAIM_DrumsAudioProcessor::renderSegment( const renderContext& context, juce::MidiBuffer& midiMessages, int start, int end )
+{
+    auto lastPhase = m_hot.lastRGenPhase;
+    auto beatIndex = m_hot.lastBeatIndex;
+    auto step = m_hot.lastPublishedStep;
+    auto nBeats = static_cast< double >( context.nBeats );
+    auto i = start;
+    for ( ; i < end; i++ )
     {
-        positionInfo = *playHead->getPosition();
-        if ( positionInfo.getIsPlaying() && positionInfo.getBpm() && positionInfo.getTimeInSamples() )
+        auto unwrappedBeat = context.position + ( i * context.increment );
+        if constexpr ( SWING )
+            unwrappedBeat = applySwingToPosition( unwrappedBeat, context.swing );
+        auto index = static_cast< int64_t >( std::floor( unwrappedBeat ) );
+        if ( index != beatIndex )
         {
-            auto indx = static_cast< double >( static_cast<int>(m_divBanks[ *bankNumberParameter ]) - 2 );
-            auto beatDivFactor = std::pow( 2.0f, indx ); // multiple for converting from quarterNotes to other beat types
-            //            auto nBeats = static_cast< double >(m_rGen.getNumBeats());
-            auto timeInSamps = static_cast< double >(*positionInfo.getTimeInSamples());
-            auto bpm = *positionInfo.getBpm();
-            auto sr = getSampleRate();
-            // calculate the increment per sample
-            auto increment = (static_cast<double>(bpm) * beatDivFactor )/ ( sr * static_cast< double >(60) );
-            // convert sample position to position on timeline in the underlying rhythmic division of the drumMachine
-            auto hostPos = ( (bpm * beatDivFactor * timeInSamps) / ( sr * static_cast< double >(60) ) );
-            auto pos = hostPos;
-            auto currentBeat = pos;
-            for ( int i = 0; i < bufferSize; i++ )
+            // a new step is the only place the bank or its settings can change, if they have the rest needs a new context
+            beatIndex = index;
+            if ( selectPatternBank() )
             {
-                currentBeat = pos + ( i * increment );
-                currentBeat = swingOnFlag ? applySwingToPosition( currentBeat, swing ) : currentBeat ;
-                if ( static_cast<int>( currentBeat ) != m_currentStep )
-                {
-                    if ( selectPatternBank() )
-                        m_internalSyncCompensation = static_cast< bool >( *internalResetParameter ) ? currentBeat : 0;
-//                    setParameters();
-                    currentBeat = fastMod4< double >( currentBeat - m_internalSyncCompensation, m_nBeatsBanks[ *bankNumberParameter ] );
-                    m_currentStep = static_cast< int >( currentBeat );
-                }
-                else
-                {
-                    currentBeat = fastMod4< double >( currentBeat - m_internalSyncCompensation, m_nBeatsBanks[ *bankNumberParameter ] );
-                }
-                auto genOut = m_rGen.runGenerator( currentBeat );
-                if ( genOut[ 0 ] < m_lastRGenPhase*0.5 ) // just a debounce check, it's possible to go backwards, but it has to go a good way
-                {
-                    for ( size_t j = 0; j < m_pVary.size(); j++ )
-                    {
-                        auto noteOff = juce::MidiMessage::noteOff( m_midiChannel, static_cast< int >(j)+36, 0.0f );
-                        midiMessages.addEvent( noteOff, i );
-                        // check if current beat is a rest, check if voice should output trigger
-                        if ( genOut[ 2 ] > 0 && m_pVary[ j ].triggerBeat( currentBeat, genOut[ 4 ] ) )
-                        {
-                            auto note = juce::MidiMessage::noteOn( m_midiChannel, static_cast< int >(j)+36, genOut[ 1 ] );
-                            midiMessages.addEvent( note, i );
-                        }
-                    }
-                }
-                m_lastRGenPhase = genOut[ 0 ];
+                m_hot.bankChangePending = true;
+                break;
             }
+            if ( getActiveNumBeats() != context.nBeats || getActiveDivision() != context.division )
+                break;
+        }
+        auto currentBeat = fastMod4< double >( unwrappedBeat - context.compensation, nBeats );
+        if ( static_cast< int >( currentBeat ) != step )
+        {
+            step = static_cast< int >( currentBeat );
+            m_hot.currentStep.store( step, std::memory_order_relaxed );
         }
-        else
+        auto genOut = m_rGen.runGenerator( currentBeat );
+        if ( genOut[ 0 ] < lastPhase*0.5 ) // just a debounce check, it's possible to go backwards, but it has to go a good way
         {
-            selectPatternBank();
-//            setParameters();
+            m_hot.pulseVelocity = genOut[ 1 ];
+            m_hot.pulseIOI = genOut[ 4 ];
+            m_hot.pulsePlay = genOut[ 2 ] > 0;
+            triggerVoices( unwrappedBeat - context.compensation, genOut[ 1 ], genOut[ 4 ], genOut[ 2 ] > 0, midiMessages, i, context.midiChannel, context.mutedVoices, m_voiceClock.getPulseVoices() );
+            if ( m_hot.syncRing != nullptr )
+            {
+                // leading a sync group, followers play this pulse too
+                sjf_syncBus::pulse p;
+                p.quarterNotePosition = context.quarterNotePosition + i * context.quarterNotesPerSample;
+                p.patternBeat = unwrappedBeat - context.compensation;
+                p.velocity = genOut[ 1 ];
+                p.ioi = genOut[ 4 ];
+                p.bank = m_hot.libraryPatternActive ? -1 : static_cast< int32_t >( m_hot.lastLoadedBank ); // followers keep their own bank while this plays from the library
+                p.play = genOut[ 2 ] > 0;
+                m_hot.syncRing->publish( p );
+            }
         }
+        // voices with a division of their own play each of their steps as they reach it, with the generator's last decision
+        if ( auto crossed = m_voiceClock.stepsCrossed( unwrappedBeat - context.compensation ) )
+            triggerVoices( unwrappedBeat - context.compensation, m_hot.pulseVelocity, m_hot.pulseIOI, m_hot.pulsePlay, midiMessages, i, context.midiChannel, context.mutedVoices, crossed );
+        lastPhase = genOut[ 0 ];
     }
-    else
+    m_hot.lastRGenPhase = lastPhase;
+    m_hot.lastBeatIndex = beatIndex;
+    m_hot.lastPublishedStep = step;
+    return i;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::triggerVoices( double patternBeat, float velocity, float ioi, bool play, juce::MidiBuffer& midiMessages, int samplePosition, int midiChannel, uint32_t mutedVoices, uint32_t voices )
+{
+    // the generator decides when to play, each voice decides whether to from its place in its own cycle
+    m_voiceClock.advance( patternBeat );
+    std::array< size_t, NUM_VOICES > steps;
+    std::array< float, NUM_VOICES > velocities;
+    for ( size_t j = 0; j < NUM_VOICES; j++ )
+        steps[ j ] = static_cast< size_t >( m_voiceClock.getPosition( j ) );
+    m_accentTable.resolve( velocity, steps, velocities, m_accentRandom );
+    // including any due on this sample, so they come before the new notes
+    sendNoteOffs( midiMessages, samplePosition + 1 );
+    auto now = m_hot.blockStartSample + samplePosition;
+    for ( size_t j = 0; j < m_pVary.size(); j++ )
     {
-        selectPatternBank();
-//        setParameters();
+        if ( !( ( voices >> j ) & 1u ) )
+            continue;
+        // check if current beat is a rest, check if voice should output trigger
+        // muted voices still follow the pattern so they come back in the right place
+        if ( play && m_pVary[ j ].triggerBeat( m_voiceClock.getPosition( j ), ioi ) )
+        {
+            // a voice that is still sounding is ended first, muted ones are only ended
+            m_noteOffs.release( j, [ & ]( const auto& p )
+            {
+                midiMessages.addEvent( juce::MidiMessage::noteOff( p.channel, p.note, 0.0f ), samplePosition );
+            } );
+            if ( ( mutedVoices >> j ) & 1u )
+                continue;
+            auto noteNumber = static_cast< int >(j)+36;
+            auto note = juce::MidiMessage::noteOn( midiChannel, noteNumber, velocities[ j ] );
+            midiMessages.addEvent( note, samplePosition );
+            m_gateOutput.addOnset( samplePosition, j, velocities[ j ] );
+            auto gate = m_voiceGateLengths[ j ].load( std::memory_order_relaxed );
+            auto due = gate > 0 ? now + juce::jmax< int64_t >( 1, static_cast< int64_t >( gate * m_hot.samplesPerStep ) ) : sjf_noteOffQueue< NUM_VOICES >::HOLD;
+            m_noteOffs.schedule( j, due, midiChannel, noteNumber );
+        }
     }
 }
 
-//==============================================================================
-double Sjf_AAIM_DrumsAudioProcessor::calculateCurrentBeat( double currentBeat, double hostPosition, double increment, size_t sampleIndex, bool swingOnFlag, float swing )
+Sjf_AAIM_DrumsAudioProcessor::syncModes Sjf_AAIM_DrumsAudioProcessor::updateSyncRole()
 {
-    currentBeat = swingOnFlag ? applySwingToPosition( hostPosition + ( sampleIndex * increment ), swing ) : hostPosition + ( sampleIndex * increment ) ;
-    currentBeat = fastMod4< double >( currentBeat, m_nBeatsBanks[ *bankNumberParameter ] );
-    if ( static_cast<int>( currentBeat ) != m_currentStep )
+    auto mode = static_cast< syncModes >( static_cast< int >( *m_hot.syncModeParameter ) );
+    auto* group = mode == syncOff ? nullptr : &sjf_syncBus::getGroup( static_cast< size_t >( *m_hot.syncGroupParameter ) - 1 );
+    auto* leading = mode == syncLeader && group != nullptr && group->claimLeader( this ) ? group : nullptr;
+    if ( m_hot.syncRing != nullptr && m_hot.syncRing != leading )
+        m_hot.syncRing->releaseLeader( this );
+    m_hot.syncRing = leading;
+    if ( mode != syncFollower )
     {
-        selectPatternBank();
-        m_currentStep = static_cast< int >( currentBeat );
+        m_hot.followedRing = nullptr;
+        // another instance already leads the group, so play independently rather than fight over it
+        return leading != nullptr ? syncLeader : syncOff;
+    }
+    if ( group != m_hot.followedRing )
+    {
+        // only what the leader plays from now on
+        m_hot.followedRing = group;
+        m_hot.syncReadIndex = group->getWriteIndex();
+    }
+    return syncFollower;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::renderFollowerBlock( juce::MidiBuffer& midiMessages, int numSamples, double quarterNotePosition, double quarterNotesPerSample )
+{
+    // the window played is a whole block behind, by the time it is played the leader has finished it,
+    // so every pulse lands on its own sample with the host's latency compensation lining it up again
+    auto windowStart = quarterNotePosition - m_hot.followerDelay * quarterNotesPerSample;
+    auto windowEnd = windowStart + numSamples * quarterNotesPerSample;
+    // anything further ahead was published before a jump back in the host's position and is skipped
+    auto tolerance = 2.0 * numSamples * quarterNotesPerSample;
+    while ( auto p = m_hot.followedRing->peek( m_hot.syncReadIndex ) )
+    {
+        // behind the window it was published before a jump forward, or in a block larger than the host said it would send
+        if ( p->quarterNotePosition < windowStart || p->quarterNotePosition >= windowEnd + tolerance )
+        {
+            m_hot.syncReadIndex++;
+            continue;
+        }
+        if ( p->quarterNotePosition >= windowEnd )
+            break; // for the next block
+        auto samplePosition = static_cast< int >( ( p->quarterNotePosition - windowStart ) / quarterNotesPerSample );
+        while ( auto e = m_midiControl.next( samplePosition ) )
+            applyMidiControl( *e );
+        // the leader's bank changes land on the same pulse here, -1 while it plays from the library, the timer tells the host
+        if ( p->bank >= 0 && p->bank != static_cast< int32_t >( getCurrentBank() ) )
+            m_hot.bankOverride.store( p->bank, std::memory_order_relaxed );
+        if ( selectPatternBank() )
+            flushNoteOffs( midiMessages, samplePosition );
+        m_hot.currentStep.store( static_cast< int >( fastMod4< double >( p->patternBeat, static_cast< double >( getActiveNumBeats() ) ) ), std::memory_order_relaxed );
+        // voices with a division of their own can only play on the leader's pulses here, once for each new step they reach
+        auto voices = m_voiceClock.getPulseVoices() | m_voiceClock.stepsCrossed( p->patternBeat );
+        triggerVoices( p->patternBeat, p->velocity, p->ioi, p->play, midiMessages, samplePosition, m_hot.midiChannel, m_hot.mutedVoices, voices );
+        m_hot.syncReadIndex++;
     }
-    return currentBeat;
+    while ( auto e = m_midiControl.next( numSamples ) )
+        applyMidiControl( *e );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::sendNoteOffs( juce::MidiBuffer& midiMessages, int samplePosition )
+{
+    auto blockStart = m_hot.blockStartSample;
+    m_noteOffs.popDue( blockStart + samplePosition, [ & ]( const auto& p )
+    {
+        midiMessages.addEvent( juce::MidiMessage::noteOff( p.channel, p.note, 0.0f ), static_cast< int >( p.dueSample - blockStart ) );
+    } );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::flushNoteOffs( juce::MidiBuffer& midiMessages, int samplePosition )
+{
+    m_noteOffs.popAll( [ & ]( const auto& p )
+    {
+        midiMessages.addEvent( juce::MidiMessage::noteOff( p.channel, p.note, 0.0f ), samplePosition );
+    } );
 }
 
+void Sjf_AAIM_DrumsAudioProcessor::renderGateOutput( juce::AudioBuffer<float>& buffer )
+{
+    // the gate bus is always the last output, it has no channels when the host hasn't enabled it
+    if ( !m_auxiliaryBuses )
+        return;
+    auto gates = getBusBuffer( buffer, false, getBusCount( false ) - 1 );
+    m_gateOutput.render( gates );
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::updateClock( int numSamples, double& position, double& increment )
+{
+    auto source = static_cast< int >( *m_hot.clockSourceParameter );
+    auto sr = getSampleRate();
+    if ( source != internalClock )
+    {
+        m_hot.playHead = this->getPlayHead();
+        auto hostPlaying = false;
+        if ( m_hot.playHead != nullptr )
+        {
+            if ( auto info = m_hot.playHead->getPosition() )
+            {
+                m_hot.positionInfo = *info;
+                hostPlaying = m_hot.positionInfo.getIsPlaying() && m_hot.positionInfo.getBpm() && m_hot.positionInfo.getTimeInSamples();
+            }
+        }
+        if ( hostPlaying )
+        {
+            increment = *m_hot.positionInfo.getBpm() / ( sr * 60.0 );
+            position = static_cast< double >( *m_hot.positionInfo.getTimeInSamples() ) * increment;
+            // if the host stops the internal clock carries on from where the host left off
+            m_hot.clockOrigin = position + numSamples * increment;
+            m_hot.clockIncrement = increment;
+            m_hot.clockSamples = 0;
+            auto timeSignature = m_hot.positionInfo.getTimeSignature();
+            m_hot.barLength = timeSignature && timeSignature->numerator > 0 && timeSignature->denominator > 0 ? timeSignature->numerator * 4.0 / timeSignature->denominator : 4.0;
+            return true;
+        }
+        if ( source == hostClock )
+            return false;
+    }
+    // the position is counted in whole samples since the last tempo change rather than summed per block,
+    // so there's no rounding error to accumulate however long it runs
+    m_hot.barLength = 4.0;
+    increment = static_cast< double >( *m_hot.internalBpmParameter ) / ( sr * 60.0 );
+    if ( increment != m_hot.clockIncrement )
+    {
+        m_hot.clockOrigin += static_cast< double >( m_hot.clockSamples ) * m_hot.clockIncrement;
+        m_hot.clockIncrement = increment;
+        m_hot.clockSamples = 0;
+    }
+    position = m_hot.clockOrigin + static_cast< double >( m_hot.clockSamples ) * increment;
+    m_hot.clockSamples += static_cast< uint64_t >( numSamples );
+    return true;
+}
+
+//==============================================================================
 double Sjf_AAIM_DrumsAudioProcessor::applySwingToPosition( double currentBeat, float swing )
 {
     auto halfPos = currentBeat * 0.5;
@@ -280,6 +564,68 @@ juce::AudioProcessorEditor* Sjf_AAIM_DrumsAudioProcessor::createEditor()
 }
 
 //==============================================================================
+const std::array< std::vector< float >, MAX_NUM_STEPS + 1 >& Sjf_AAIM_DrumsAudioProcessor::getMetres()
+{
+    // the generator only hands its metre out as a vector, so each instance takes what it needs from these
+    static const auto metres = []
+    {
+        std::array< std::vector< float >, MAX_NUM_STEPS + 1 > m;
+        AAIM_rhythmGen< float > metre;
+        for ( size_t n = 1; n <= MAX_NUM_STEPS; n++ )
+        {
+            metre.setNumBeats( n );
+            m[ n ] = metre.getBaseindispensability();
+        }
+        return m;
+    }();
+    return metres;
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::updateRhythmMetrics()
+{
+    auto changed = false;
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+    {
+        auto generation = getPatternGeneration( static_cast< int >( i ) );
+        if ( generation == m_metricsGenerations[ i ] )
+            continue;
+        m_metricsGenerations[ i ] = generation;
+        m_rhythmMetrics.setVoice( i, getPatternWord( static_cast< int >( i ) ), m_hot.libraryPatternActive ? m_hot.libraryNumBeats : getStoredVoiceLength( getCurrentBank(), i ) );
+        changed = true;
+    }
+    return changed;
+}
+
+Sjf_AAIM_DrumsAudioProcessor::stateIdentifiers::stateIdentifiers()
+{
+    for ( size_t i = 0; i < NUM_IOIs; i++ )
+    {
+        ioiDiv[ i ] = "ioiDiv" + juce::String( i );
+        ioiProb[ i ] = "ioiProb" + juce::String( i );
+    }
+    for ( size_t i = 0; i < NUM_BANKS; i++ )
+    {
+        for ( size_t j = 0; j < NUM_VOICES; j++ )
+        {
+            auto voice = "patternBank" + juce::String( i ) + "Voice" + juce::String( j );
+            pattern[ i ][ j ] = voice;
+            voiceNumBeats[ i ][ j ] = voice + "NumBeats";
+            voiceDiv[ i ][ j ] = voice + "Division";
+            voiceAccents[ i ][ j ] = voice + "Accents";
+        }
+        bankNumBeats[ i ] = "patternBankNumBeats" + juce::String( i );
+        bankDiv[ i ] = "divisionBank" + juce::String( i );
+    }
+    for ( size_t j = 0; j < NUM_VOICES; j++ )
+        voiceGateLength[ j ] = "voice" + juce::String( j ) + "GateLength";
+}
+
+const Sjf_AAIM_DrumsAudioProcessor::stateIdentifiers& Sjf_AAIM_DrumsAudioProcessor::getStateIdentifiers()
+{
+    static const stateIdentifiers ids;
+    return ids;
+}
+
 void Sjf_AAIM_DrumsAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
     setNonAutomatableParameterValues();
@@ -291,13 +637,14 @@ void Sjf_AAIM_DrumsAudioProcessor::getStateInformation (juce::MemoryBlock& destD
 
 void Sjf_AAIM_DrumsAudioProcessor::setNonAutomatableParameterValues()
 {
+    auto& ids = getStateIdentifiers();
+    auto& state = parameters.state;
     // set IOI divs and probabilities
     {
-        auto IOIs = m_rGen.getIOIProbabilities();
-        for ( size_t i = 0; i < IOIs.size(); i++ )
+        for ( size_t i = 0; i < NUM_IOIs; i++ )
         {
-            ioiDivParameters[ i ].setValue( IOIs[ i ][ 0 ] );
-            ioiProbParameters[ i ].setValue( IOIs[ i ][ 1 ] );
+            state.setProperty( ids.ioiDiv[ i ], m_ioiTable.getFactor( i ), nullptr );
+            state.setProperty( ids.ioiProb[ i ], m_ioiTable.getProbability( i ), nullptr );
         }
         
         for ( size_t i = 0; i < NUM_BANKS; i++ )
@@ -306,10 +653,33 @@ void Sjf_AAIM_DrumsAudioProcessor::setNonAutomatableParameterValues()
             {
                 auto pat = m_patternBanks[ i ][ j ].to_ullong();
                 auto patDouble = static_cast<double>( pat );
-                patternBanksParameters[ i ][ j ].setValue( patDouble );
+                state.setProperty( ids.pattern[ i ][ j ], patDouble, nullptr );
+                state.setProperty( ids.voiceNumBeats[ i ][ j ], static_cast< int >( m_voiceNBeatsBanks[ i ][ j ] ), nullptr );
+                state.setProperty( ids.voiceDiv[ i ][ j ], static_cast< int >( m_voiceDivBanks[ i ][ j ] ), nullptr );
+            }
+            state.setProperty( ids.bankNumBeats[ i ], static_cast<double>( m_nBeatsBanks[ i ] ), nullptr );
+            state.setProperty( ids.bankDiv[ i ], static_cast< double >( m_divBanks[ i ] ), nullptr );
+        }
+        for ( size_t j = 0; j < NUM_VOICES; j++ )
+            state.setProperty( ids.voiceGateLength[ j ], m_voiceGateLengths[ j ].load(), nullptr );
+        
+        // each map is a line of scales, offsets and the random range, neutral ones are left empty
+        for ( size_t i = 0; i < NUM_BANKS; i++ )
+        {
+            for ( size_t j = 0; j < NUM_VOICES; j++ )
+            {
+                auto& accents = m_accentBanks[ i ][ j ];
+                juce::String text;
+                if ( !accents.isNeutral() )
+                {
+                    for ( auto v : accents.scale )
+                        text << v << " ";
+                    for ( auto v : accents.offset )
+                        text << v << " ";
+                    text << accents.randomRange;
+                }
+                state.setProperty( ids.voiceAccents[ i ][ j ], text, nullptr );
             }
-            patternBanksNumBeatsParameters[ i ].setValue( static_cast<double>( m_nBeatsBanks[ i ] ) );
-            divBanksParameters[ i ].setValue( static_cast< double >( m_divBanks[ i ] ) );
         }
     }
     updateHostDisplay();
@@ -317,41 +687,75 @@ void Sjf_AAIM_DrumsAudioProcessor::setNonAutomatableParameterValues()
 
 void Sjf_AAIM_DrumsAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
-    m_lastLoadedBank = -1;
+    m_hot.lastLoadedBank = -1;
+    m_hot.bankOverride.store( noBankOverride ); // the saved bank takes over from anything midi picked
     std::unique_ptr<juce::XmlElement> xmlState (getXmlFromBinary (data, sizeInBytes));
     if (xmlState.get() != nullptr)
     {
         if (xmlState->hasTagName (parameters.state.getType()))
         {
             parameters.replaceState (juce::ValueTree::fromXml (*xmlState));
+            auto& ids = getStateIdentifiers();
+            auto& state = parameters.state;
             for ( size_t i = 0; i < NUM_BANKS; i++ )
             {
-                patternBanksNumBeatsParameters[ i ].referTo( parameters.state.getPropertyAsValue( "patternBankNumBeats" + juce::String( i ), nullptr, true ) );
-                m_nBeatsBanks[ i ] = static_cast< long long >( patternBanksNumBeatsParameters[ i ].getValue() );
-                
-                divBanksParameters[ i ].referTo( parameters.state.getPropertyAsValue( "divisionBank" + juce::String( i ), nullptr, true ) );
-                m_divBanks[ i ] = static_cast< long long >( divBanksParameters[ i ].getValue() );
+                m_nBeatsBanks[ i ] = static_cast< long long >( state.getProperty( ids.bankNumBeats[ i ] ) );
+                m_divBanks[ i ] = static_cast< long long >( state.getProperty( ids.bankDiv[ i ] ) );
                 
                 for ( size_t j = 0; j < NUM_VOICES; j++ )
                 {
-                    patternBanksParameters[ i ][ j ].referTo( parameters.state.getPropertyAsValue( "patternBank" + juce::String( i ) + "Voice" + juce::String( j ), nullptr, true ) );
-                    auto val = static_cast<double>(patternBanksParameters[ i ][ j ].getValue());
+                    auto val = static_cast<double>( state.getProperty( ids.pattern[ i ][ j ] ) );
                     m_patternBanks[ i ][ j ] = val;
+                    
+                    m_voiceNBeatsBanks[ i ][ j ] = static_cast< uint8_t >( juce::jlimit( 0, MAX_NUM_STEPS, static_cast< int >( state.getProperty( ids.voiceNumBeats[ i ][ j ] ) ) ) );
+                    m_voiceDivBanks[ i ][ j ] = static_cast< uint8_t >( juce::jlimit( 0, static_cast< int >( sixtyFourthNote ), static_cast< int >( state.getProperty( ids.voiceDiv[ i ][ j ] ) ) ) );
+                    
+                    auto values = juce::StringArray::fromTokens( state.getProperty( ids.voiceAccents[ i ][ j ] ).toString(), " ", "" );
+                    m_accentBanks[ i ][ j ] = accentTable::voiceAccents();
+                    if ( values.size() == MAX_NUM_STEPS * 2 + 1 )
+                    {
+                        for ( size_t k = 0; k < MAX_NUM_STEPS; k++ )
+                        {
+                            m_accentBanks[ i ][ j ].scale[ k ] = values[ static_cast< int >( k ) ].getFloatValue();
+                            m_accentBanks[ i ][ j ].offset[ k ] = values[ static_cast< int >( k + MAX_NUM_STEPS ) ].getFloatValue();
+                        }
+                        m_accentBanks[ i ][ j ].randomRange = values[ MAX_NUM_STEPS * 2 ].getFloatValue();
+                    }
                 }
             }
             
             for ( size_t i = 0; i < NUM_IOIs; i++ )
             {
-                ioiDivParameters[ i ].referTo( parameters.state.getPropertyAsValue( "ioiDiv"+juce::String(i), nullptr, true ) );
-                ioiProbParameters[ i ].referTo( parameters.state.getPropertyAsValue( "ioiProb"+juce::String(i), nullptr, true ) );
-                auto div = ioiDivParameters[ i ].getValue();
-                auto prob = ioiProbParameters[ i ].getValue();
-                m_rGen.setIOIProbability( div, prob );
+                if ( state.getProperty( ids.ioiDiv[ i ] ).isVoid() )
+                    continue;
+                auto div = static_cast< float >( state.getProperty( ids.ioiDiv[ i ] ) );
+                auto prob = static_cast< float >( state.getProperty( ids.ioiProb[ i ] ) );
+                setIOIProbability( m_ioiTable.findIndex( div ), prob );
             }
+            
+            for ( size_t j = 0; j < NUM_VOICES; j++ )
+            {
+                // sessions saved before gate lengths existed get the default
+                auto& gate = state.getProperty( ids.voiceGateLength[ j ] );
+                m_voiceGateLengths[ j ].store( gate.isVoid() ? DEFAULT_GATE_LENGTH : juce::jlimit( 0.0f, MAX_GATE_LENGTH, static_cast< float >( gate ) ) );
+            }
+            
+            bankChainParameter.referTo( parameters.state.getPropertyAsValue( "bankChain", nullptr, true ) );
+            auto chainText = bankChainParameter.getValue().toString();
+            if ( chainText.isEmpty() || !setBankChain( chainText ) )
+                setBankChain( "0" );
+            
+            patternLibraryFileParameter.referTo( parameters.state.getPropertyAsValue( "patternLibraryFile", nullptr, true ) );
+            auto libraryPath = patternLibraryFileParameter.getValue().toString();
+            if ( libraryPath.isNotEmpty() )
+                loadPatternLibrary( juce::File( libraryPath ) );
         }
     }
-    selectPatternBank();
+    // the voices load the restored banks at their next step
+    publishPatternBanks();
+    publishAccents();
     setParameters();
+    m_patternHistory.reset( getPatternBankSnapshots(), m_accentBanks );
     m_stateLoadedFlag = true;
 }
 //==============================================================================
@@ -366,17 +770,27 @@ juce::AudioProcessorValueTreeState::ParameterLayout Sjf_AAIM_DrumsAudioProcessor
     params.add( std::make_unique<juce::AudioParameterInt>( juce::ParameterID{ "midiChannel", pIDVersionNumber }, "MidiChannel", 1, 16, 1 ) );
     params.add( std::make_unique<juce::AudioParameterInt>( juce::ParameterID{ "patternBank", pIDVersionNumber }, "PatternBank", 0, 15, 0 ) );
     params.add( std::make_unique<juce::AudioParameterBool>( juce::ParameterID{ "internalReset", pIDVersionNumber }, "InternalReset", true ) );
+    params.add( std::make_unique<juce::AudioParameterInt>( juce::ParameterID{ "libraryPattern", pIDVersionNumber }, "LibraryPattern", -1, 65535, -1 ) );
+    params.add( std::make_unique<juce::AudioParameterChoice>( juce::ParameterID{ "clockSource", pIDVersionNumber }, "ClockSource", juce::StringArray{ "Host", "Internal", "Auto" }, 0 ) );
+    params.add( std::make_unique<juce::AudioParameterFloat>( juce::ParameterID{ "internalBpm", pIDVersionNumber }, "InternalBpm", 20, 300, 120 ) );
+    params.add( std::make_unique<juce::AudioParameterFloat>( juce::ParameterID{ "followAmount", pIDVersionNumber }, "FollowAmount", 0, 1, 0 ) );
+    params.add( std::make_unique<juce::AudioParameterChoice>( juce::ParameterID{ "syncMode", pIDVersionNumber }, "SyncMode", juce::StringArray{ "Off", "Leader", "Follower" }, 0 ) );
+    params.add( std::make_unique<juce::AudioParameterInt>( juce::ParameterID{ "syncGroup", pIDVersionNumber }, "SyncGroup", 1, static_cast< int >( sjf_syncBus::NUM_GROUPS ), 1 ) );
+    params.add( std::make_unique<juce::AudioParameterFloat>( juce::ParameterID{ "morph", pIDVersionNumber }, "Morph", 0, 1, 0 ) );
+    params.add( std::make_unique<juce::AudioParameterInt>( juce::ParameterID{ "morphBank", pIDVersionNumber }, "MorphBank", 0, NUM_BANKS - 1, 0 ) );
+    params.add( std::make_unique<juce::AudioParameterBool>( juce::ParameterID{ "arrangement", pIDVersionNumber }, "Arrangement", false ) );
     return params;
 }
 
 void Sjf_AAIM_DrumsAudioProcessor::setPattern( int row, std::vector<bool> pattern )
 {
-    auto nBeats = pattern.size() < m_nBeatsBanks[ *bankNumberParameter ] ? pattern.size() : m_nBeatsBanks[ *bankNumberParameter ] ;
+    auto bank = getCurrentBank();
+    auto nBeats = std::min( pattern.size(), getStoredVoiceLength( bank, static_cast< size_t >( row ) ) );
     for ( size_t i = 0; i < nBeats; i++ )
-    {
-        m_patternBanks[ *bankNumberParameter ][ row ][ i ] = pattern[ i ];
-        m_pVary[ row ].setBeat( i, pattern[ i ] );
-    }
+        m_patternBanks[ bank ][ row ][ i ] = pattern[ i ];
+    // the voices pick the edit up at their next step, blended with the morph bank again if there is one
+    publishPatternBanks();
+    markPatternChanged( row );
 }
 
 const std::vector<bool>& Sjf_AAIM_DrumsAudioProcessor::getPattern( int row )
@@ -387,27 +801,415 @@ const std::vector<bool>& Sjf_AAIM_DrumsAudioProcessor::getPattern( int row )
 void Sjf_AAIM_DrumsAudioProcessor::setParameters()
 {
 //    selectPatternBank();
-    m_rGen.setComplexity( *complexityParameter );
-    m_rGen.setRests( *restsParameter );
+    float complexity = *m_hot.complexityParameter, rests = *m_hot.restsParameter, fills = *m_hot.fillsParameter;
+    auto follow = static_cast< float >( *m_hot.followAmountParameter );
+    if ( follow > 0 )
+    {
+        // a busier band pushes the complexity up, a louder one adds fills and takes away rests
+        auto density = follow * m_onsetFollower.getDensity();
+        auto energy = follow * m_onsetFollower.getEnergy();
+        complexity += density * ( 1.0f - complexity );
+        fills += energy * ( 1.0f - fills );
+        rests *= 1.0f - energy;
+    }
+    m_rGen.setComplexity( complexity );
+    m_rGen.setRests( rests );
     for (size_t i = 0; i < m_pVary.size(); i++ )
-        m_pVary[ i ].setFills( *fillsParameter );
-    m_midiChannel = *midiChannelParameter;
+        m_pVary[ i ].setFills( m_hot.fillHeld ? 1.0f : fills );
+    m_hot.midiChannel = *m_hot.midiChannelParameter;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::applyMidiControl( const sjf_midiControl::event& e )
+{
+    switch ( e.type )
+    {
+        case sjf_midiControl::selectBank:
+            // picked up by selectPatternBank at the next step, the timer tells the host
+            m_hot.bankOverride.store( static_cast< int >( e.index ), std::memory_order_relaxed );
+            break;
+        case sjf_midiControl::variation:
+            // variations allocate and write the state, so they are left to the message thread
+            // and change the bank at the timer's next tick rather than on the event's sample
+            m_pendingVariations.fetch_or( 1u << e.index );
+            break;
+        case sjf_midiControl::restart:
+            m_hot.restartPending = true;
+            break;
+        case sjf_midiControl::toggleMute:
+            m_hot.mutedVoices ^= ( 1u << e.index );
+            break;
+        case sjf_midiControl::fill:
+            m_hot.fillHeld = e.on;
+            if ( !m_hot.idle ) // otherwise picked up when playback resumes
+                setParameters();
+            break;
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::applyBankChain( double quarterNotePosition )
+{
+    // the chain can be replaced by the message thread, if it is busy we just try again at the next segment
+    const sjf_rtAudit::spinLock::ScopedTryLockType lock( m_bankChainLock );
+    if ( !lock.isLocked() || m_bankChain == nullptr )
+        return;
+    auto barIndex = static_cast< int64_t >( std::floor( quarterNotePosition / m_hot.barLength + 1.0e-9 ) );
+    if ( barIndex == m_hot.chainBar.load( std::memory_order_relaxed ) )
+        return;
+    m_hot.chainBar.store( barIndex, std::memory_order_relaxed );
+    auto& bar = m_bankChain->getBar( barIndex );
+    if ( bar.bank != static_cast< int >( getCurrentBank() ) )
+    {
+        // played straight away, the timer tells the host
+        m_hot.bankOverride.store( bar.bank, std::memory_order_relaxed );
+        // take the generator the timer set up for this bank, if it did and nothing it depends on has changed since
+        auto prepared = static_cast< int >( bar.bank );
+        if ( !m_hot.libraryPatternActive && m_preparedBank.compare_exchange_strong( prepared, preparedInUse, std::memory_order_acquire ) )
+        {
+            if ( m_preparedIOIVersion == m_ioiTable.getVersion() )
+                std::swap( m_rGen, m_preparedGen );
+            m_preparedBank.store( notPrepared, std::memory_order_release );
+        }
+    }
+    // the bar line is the step the bank changes on, rather than the next one
+    auto bankChanged = selectPatternBank();
+    if ( bar.entryStart && !m_hot.libraryPatternActive )
+    {
+        // every entry starts from the bank as it is stored, so variations never build up as the chain repeats
+        if ( m_hot.chainVariationPlaying && !bankChanged )
+        {
+            loadPatternBank();
+            updateMorph();
+        }
+        m_hot.chainVariationPlaying = bar.variation >= 0;
+        if ( m_hot.chainVariationPlaying )
+            playChainVariation( bar.variation );
+    }
+    if ( bankChanged )
+    {
+        m_hot.bankChangePending = true;
+        setParameters();
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::playChainVariation( int variation )
+{
+    std::array< size_t, NUM_VOICES > lengths;
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+        lengths[ i ] = getVoiceLength( i );
+    auto words = m_hot.playingWords;
+    sjf_bankChain::applyVariation( variation, words, lengths, getMetres(), m_chainRandom );
+    // only the steps that changed, as updateMorph
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+    {
+        auto changed = words[ i ] ^ m_hot.playingWords[ i ];
+        if ( changed == 0 )
+            continue;
+        for ( ; changed != 0; changed &= changed - 1 )
+        {
+            auto step = static_cast< size_t >( std::countr_zero( changed ) );
+            m_pVary[ i ].setBeat( step, ( words[ i ] >> step ) & 1u );
+        }
+        m_hot.playingWords[ i ] = words[ i ];
+        markPatternChanged( i );
+    }
+}
+
+int Sjf_AAIM_DrumsAudioProcessor::getNextBarSample( double quarterNotePosition, double quarterNotesPerSample, int start )
+{
+    auto position = quarterNotePosition + start * quarterNotesPerSample;
+    auto nextBar = ( std::floor( position / m_hot.barLength + 1.0e-9 ) + 1.0 ) * m_hot.barLength;
+    auto samples = std::ceil( ( nextBar - position ) / quarterNotesPerSample - 1.0e-9 );
+    return start + static_cast< int >( juce::jlimit( 1.0, static_cast< double >( std::numeric_limits< int >::max() / 2 ), samples ) );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::prepareNextChainBank()
+{
+    auto bar = m_hot.chainBar.load( std::memory_order_relaxed );
+    if ( bar == NO_CHAIN_BAR || m_hot.libraryPatternActive )
+        return;
+    auto next = 0;
+    {
+        const sjf_rtAudit::spinLock::ScopedLockType lock( m_bankChainLock );
+        next = m_bankChain->getBar( bar + 1 ).bank;
+        if ( next == m_bankChain->getBar( bar ).bank )
+            return;
+    }
+    auto prepared = m_preparedBank.load( std::memory_order_acquire );
+    if ( prepared == next || prepared == preparedInUse )
+        return;
+    // prepared for a bank that isn't coming next any more, take it back unless the audio thread just did
+    if ( prepared >= 0 && !m_preparedBank.compare_exchange_strong( prepared, notPrepared ) )
+        return;
+    // working out the metre for a new length is what is kept off the audio thread
+    if ( m_preparedGen.getNumBeats() != m_nBeatsBanks[ static_cast< size_t >( next ) ] )
+        m_preparedGen.setNumBeats( m_nBeatsBanks[ static_cast< size_t >( next ) ] );
+    for ( size_t i = 0; i < NUM_IOIs; i++ )
+        m_preparedGen.setIOIProbability( ioiFactors[ i ], m_ioiTable.getProbability( i ) );
+    m_preparedIOIVersion = m_ioiTable.getVersion();
+    m_preparedBank.store( next, std::memory_order_release );
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::setBankChain( const juce::String& text )
+{
+    auto chain = std::make_shared< sjf_bankChain >();
+    if ( !chain->set( text, NUM_BANKS ) )
+        return false;
+    std::shared_ptr< const sjf_bankChain > old = chain;
+    {
+        const sjf_rtAudit::spinLock::ScopedLockType lock( m_bankChainLock );
+        std::swap( m_bankChain, old );
+    }
+    // so the bank for the bar that is playing is looked up again in the new chain
+    m_hot.chainBar.store( NO_CHAIN_BAR, std::memory_order_relaxed );
+    bankChainParameter.setValue( m_bankChain->getText() );
+    return true;
+}
+
+juce::String Sjf_AAIM_DrumsAudioProcessor::getBankChainText()
+{
+    return m_bankChain->getText();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::timerCallback()
+{
+    // setValueNotifyingHost locks and can post messages, so banks picked on the audio thread are passed on from here
+    auto bank = m_hot.bankOverride.load();
+    if ( bank != noBankOverride )
+    {
+        if ( bank != static_cast< int >( *m_hot.bankNumberParameter ) )
+            m_bankParameter->setValueNotifyingHost( m_bankParameter->convertTo0to1( static_cast< float >( bank ) ) );
+        // the parameter is the bank now, unless the audio thread has picked another one in the meantime
+        m_hot.bankOverride.compare_exchange_strong( bank, noBankOverride );
+    }
+    // followers play a block behind their leader, reported so the host plays them ahead by as much
+    auto latency = static_cast< int >( *m_hot.syncModeParameter ) == syncFollower ? m_hot.followerDelay : 0;
+    if ( latency != getLatencySamples() )
+        setLatencySamples( latency );
+    prepareNextChainBank();
+    auto variations = m_pendingVariations.exchange( 0 );
+    if ( variations == 0 || m_hot.libraryPatternActive )
+        return;
+    for ( uint32_t i = 0; i < sjf_midiControl::NUM_VARIATIONS; i++ )
+    {
+        if ( !( ( variations >> i ) & 1u ) )
+            continue;
+        switch ( i )
+        {
+            case 0: reversePattern(); break;
+            case 1: markovHorizontal(); break;
+            case 2: cellShuffleVariation(); break;
+            case 3: palindromeVariation(); break;
+            case 4: doublePattern(); break;
+            case 5: rotatePattern( true ); break;
+            case 6: rotatePattern( false ); break;
+        }
+    }
+    // so an open editor refreshes everything, including the number of steps
+    m_stateLoadedFlag = true;
 }
 
 bool Sjf_AAIM_DrumsAudioProcessor::selectPatternBank()
 {
-    if ( m_lastLoadedBank == *bankNumberParameter )
+    auto libraryPattern = static_cast< int >( *m_hot.libraryPatternParameter );
+    if ( libraryPattern >= 0 )
+    {
+        if ( libraryPattern == m_hot.lastLoadedLibraryPattern )
+            return false;
+        switch ( loadLibraryPatternForPlayback( libraryPattern ) )
+        {
+            case libraryLoaded:
+                return true;
+            case libraryBusy:
+                return false; // whatever is playing carries on, the pattern is tried again at the next step
+            case libraryUnavailable:
+                break;
+        }
+    }
+    if ( m_hot.libraryPatternActive )
+    {
+        // back to the banks
+        restoreIOIProbabilities();
+        m_hot.libraryPatternActive = false;
+        m_hot.lastLoadedLibraryPattern = -1;
+        m_hot.lastLoadedBank = -1;
+    }
+    // the message thread publishes the banks after every edit, undo included
+    auto banksPublished = m_playingBanks.update();
+    auto accentsPublished = m_playingAccents.update();
+    if ( m_hot.lastLoadedBank == static_cast< int >( getCurrentBank() ) )
+    {
+        if ( banksPublished )
+            loadPatternBank();
+        else if ( accentsPublished )
+            buildAccentTable();
+        updateMorph();
         return false;
-    m_rGen.setNumBeats( m_nBeatsBanks[ *bankNumberParameter ] );
+    }
+    loadPatternBank();
+    updateMorph();
+    return true;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::updateMorph()
+{
+    auto bankA = static_cast< size_t >( m_hot.lastLoadedBank );
+    auto bankB = static_cast< int >( *m_hot.morphBankParameter );
+    auto level = bankB == static_cast< int >( bankA ) ? 0 : m_bankMorph.getLevel( *m_hot.morphParameter );
+    if ( level == m_hot.morphLevel && bankB == m_hot.morphBank && !m_hot.morphMasksDirty )
+        return;
+    if ( m_hot.morphMasksDirty || bankB != m_hot.morphBank )
+    {
+        // a fresh draw for every new pair of banks
+        m_bankMorph.makeMasks( getPlayingBank( bankA ).nBeats, m_morphRandom );
+        m_hot.morphMasksDirty = false;
+    }
+    m_hot.morphLevel = level;
+    m_hot.morphBank = bankB;
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+    {
+        auto length = getVoiceLength( i );
+        auto lengthMask = length >= 32 ? ~0u : ( 1u << length ) - 1u;
+        auto word = m_bankMorph.blend( getPlayingBank( bankA ).words[ i ], getPlayingBank( static_cast< size_t >( bankB ) ).words[ i ], level, i ) & lengthMask;
+        auto changed = word ^ m_hot.playingWords[ i ];
+        if ( changed == 0 )
+            continue;
+        for ( ; changed != 0; changed &= changed - 1 )
+        {
+            auto step = static_cast< size_t >( std::countr_zero( changed ) );
+            m_pVary[ i ].setBeat( step, ( word >> step ) & 1u );
+        }
+        m_hot.playingWords[ i ] = word;
+        markPatternChanged( i );
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setIOIProbability( size_t ioiIndex, float chanceForThatDivision )
+{
+    // the generator looks its entries up by division, so only pass on what has actually changed
+    if ( m_ioiTable.setProbability( ioiIndex, chanceForThatDivision ) )
+        m_rGen.setIOIProbability( ioiFactors[ ioiIndex ], chanceForThatDivision );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::restoreIOIProbabilities()
+{
+    for ( size_t i = 0; i < NUM_IOIs; i++ )
+        m_rGen.setIOIProbability( ioiFactors[ i ], m_ioiTable.getProbability( i ) );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::updateVoiceClock()
+{
+    auto& bank = getPlayingBank( getCurrentBank() );
+    auto bankDivision = static_cast< int >( bank.division );
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+    {
+        auto length = getVoiceLength( i );
+        auto division = bank.voiceDivisions[ i ] > 0 ? static_cast< int >( bank.voiceDivisions[ i ] ) : bankDivision;
+        // each division is twice as fast as the one before
+        m_voiceClock.setVoice( i, static_cast< double >( length ), std::pow( 2.0, division - bankDivision ) );
+        m_pVary[ i ].setNumBeats( length );
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setVoiceNumBeats( int voice, int nBeats )
+{
+    if ( m_hot.libraryPatternActive )
+        return;
+    m_voiceNBeatsBanks[ getCurrentBank() ][ voice ] = static_cast< uint8_t >( juce::jlimit( 0, MAX_NUM_STEPS, nBeats ) );
+    publishPatternBanks();
+    storePatternHistory();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setVoiceDivision( int voice, int division )
+{
+    if ( m_hot.libraryPatternActive )
+        return;
+    m_voiceDivBanks[ getCurrentBank() ][ voice ] = static_cast< uint8_t >( juce::jlimit( 0, static_cast< int >( sixtyFourthNote ), division ) );
+    publishPatternBanks();
+    storePatternHistory();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setVoiceGateLength( int voice, float steps )
+{
+    // not part of the banks so there is nothing to undo or reload, the next note just uses it
+    m_voiceGateLengths[ voice ].store( juce::jlimit( 0.0f, MAX_GATE_LENGTH, steps ), std::memory_order_relaxed );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setAccent( int voice, int step, float scale, float offset )
+{
+    auto& accents = m_accentBanks[ getCurrentBank() ][ voice ];
+    accents.scale[ static_cast< size_t >( step ) ] = juce::jlimit( 0.0f, 2.0f, scale );
+    accents.offset[ static_cast< size_t >( step ) ] = juce::jlimit( -1.0f, 1.0f, offset );
+    publishAccents();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::setAccentRandomRange( int voice, float range )
+{
+    m_accentBanks[ getCurrentBank() ][ voice ].randomRange = juce::jlimit( 0.0f, 1.0f, range );
+    publishAccents();
+    storePatternHistory();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::buildAccentTable()
+{
+    m_accentTable.build( m_hot.libraryPatternActive ? accentTable::bankAccents() : m_playingAccents.read()[ getCurrentBank() ] );
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::loadPatternBank()
+{
+    auto& bank = getPlayingBank( getCurrentBank() );
+    // a generator prepared for this bank by the arrangement already has its length
+    if ( m_rGen.getNumBeats() != bank.nBeats )
+        m_rGen.setNumBeats( bank.nBeats );
+    updateVoiceClock();
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+        for ( size_t j = 0; j < getVoiceLength( i ); j++ )
+            m_pVary[ i ].setBeat( j, ( bank.words[ i ] >> j ) & 1u );
+    markPatternChanged();
+    m_hot.lastLoadedBank = static_cast< int >( getCurrentBank() );
+    buildAccentTable();
+    // the voices are back to playing this bank alone, updateMorph blends it again
     for ( size_t i = 0; i < NUM_VOICES; i++ )
     {
-        m_pVary[ i ].setNumBeats( m_nBeatsBanks[ *bankNumberParameter ] );
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]; j++ )
-            m_pVary[ i ].setBeat( j, m_patternBanks[ *bankNumberParameter ][ i ][ j ] );
+        auto length = getVoiceLength( i );
+        m_hot.playingWords[ i ] = bank.words[ i ] & ( length >= 32 ? ~0u : ( 1u << length ) - 1u );
     }
-    m_lastLoadedBank = *bankNumberParameter;
+    m_hot.morphLevel = 0;
+    m_hot.morphMasksDirty = true;
     m_stateLoadedFlag = true;
-    return true;
+}
+
+Sjf_AAIM_DrumsAudioProcessor::libraryLoadResults Sjf_AAIM_DrumsAudioProcessor::loadLibraryPatternForPlayback( int libraryIndex )
+{
+    // the library can be swapped by the message thread, if it is busy we just try again at the next step
+    const sjf_rtAudit::spinLock::ScopedTryLockType lock( m_libraryFileLock );
+    if ( !lock.isLocked() )
+        return libraryBusy;
+    if ( m_libraryFile == nullptr )
+        return libraryUnavailable;
+    auto record = m_libraryFile->getRecord( static_cast< size_t >( libraryIndex ) );
+    if ( record == nullptr )
+        return libraryUnavailable;
+    
+    m_hot.libraryNumBeats = juce::jlimit< size_t >( 1, MAX_NUM_STEPS, record->nBeats );
+    m_hot.libraryDivision = juce::jlimit< size_t >( halfNote, sixtyFourthNote, record->division );
+    m_rGen.setNumBeats( m_hot.libraryNumBeats );
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+    {
+        // library patterns have no per voice lengths
+        m_pVary[ i ].setNumBeats( m_hot.libraryNumBeats );
+        m_voiceClock.setVoice( i, static_cast< double >( m_hot.libraryNumBeats ), 1.0 );
+        for ( size_t j = 0; j < m_hot.libraryNumBeats; j++ )
+            m_pVary[ i ].setBeat( j, ( record->voices[ i ] >> j ) & 1u );
+    }
+    if ( record->flags & sjf_patternLibraryFile::hasIOIs )
+        for ( size_t i = 0; i < NUM_IOIs; i++ )
+            m_rGen.setIOIProbability( ioiFactors[ i ], record->ioiProbabilities[ i ] );
+    markPatternChanged();
+    m_hot.lastLoadedLibraryPattern = libraryIndex;
+    m_hot.libraryPatternActive = true;
+    buildAccentTable();
+    m_stateLoadedFlag = true;
+    return libraryLoaded;
 }
 
 void Sjf_AAIM_DrumsAudioProcessor::copyPatternBankContents( size_t bankToCopyFrom, size_t bankToCopyTo )
@@ -416,22 +1218,231 @@ void Sjf_AAIM_DrumsAudioProcessor::copyPatternBankContents( size_t bankToCopyFro
         m_patternBanks[ bankToCopyTo ][ i ] = m_patternBanks[ bankToCopyFrom ][ i ];
     m_nBeatsBanks[ bankToCopyTo ] = m_nBeatsBanks[ bankToCopyFrom ];
     m_divBanks[ bankToCopyTo ] = m_divBanks[ bankToCopyFrom ];
+    m_voiceNBeatsBanks[ bankToCopyTo ] = m_voiceNBeatsBanks[ bankToCopyFrom ];
+    m_voiceDivBanks[ bankToCopyTo ] = m_voiceDivBanks[ bankToCopyFrom ];
+    m_accentBanks[ bankToCopyTo ] = m_accentBanks[ bankToCopyFrom ];
+    publishPatternBanks();
+    publishAccents();
+    storePatternHistory();
+}
+//==============================================================================
+//      UNDO HISTORY
+void Sjf_AAIM_DrumsAudioProcessor::storePatternHistory()
+{
+    m_patternHistory.commit( getPatternBankSnapshots(), m_accentBanks );
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::undoPatternEdit()
+{
+    auto changedBanks = m_patternHistory.undo();
+    restorePatternBanks( changedBanks );
+    return changedBanks != 0;
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::redoPatternEdit()
+{
+    auto changedBanks = m_patternHistory.redo();
+    restorePatternBanks( changedBanks );
+    return changedBanks != 0;
+}
+
+Sjf_AAIM_DrumsAudioProcessor::patternHistory::bankSet Sjf_AAIM_DrumsAudioProcessor::getPatternBankSnapshots()
+{
+    patternHistory::bankSet banks;
+    for ( size_t i = 0; i < NUM_BANKS; i++ )
+    {
+        for ( size_t j = 0; j < NUM_VOICES; j++ )
+            banks[ i ].words[ j ] = static_cast< uint32_t >( m_patternBanks[ i ][ j ].to_ulong() );
+        banks[ i ].nBeats = static_cast< uint8_t >( m_nBeatsBanks[ i ] );
+        banks[ i ].division = static_cast< uint8_t >( m_divBanks[ i ] );
+        banks[ i ].voiceNBeats = m_voiceNBeatsBanks[ i ];
+        banks[ i ].voiceDivisions = m_voiceDivBanks[ i ];
+    }
+    return banks;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::restorePatternBanks( uint32_t changedBanks )
+{
+    if ( changedBanks == 0 )
+        return;
+    for ( size_t i = 0; i < NUM_BANKS; i++ )
+    {
+        if ( !( changedBanks & ( 1u << i ) ) )
+            continue;
+        auto& bank = m_patternHistory.getBank( i );
+        for ( size_t j = 0; j < NUM_VOICES; j++ )
+            m_patternBanks[ i ][ j ] = std::bitset< MAX_NUM_STEPS >( bank.words[ j ] );
+        m_nBeatsBanks[ i ] = bank.nBeats;
+        m_divBanks[ i ] = bank.division;
+        m_voiceNBeatsBanks[ i ] = bank.voiceNBeats;
+        m_voiceDivBanks[ i ] = bank.voiceDivisions;
+        m_accentBanks[ i ] = m_patternHistory.getAccents( i );
+    }
+    // the audio thread keeps playing its own copy until it swaps this one in at its next step
+    publishPatternBanks();
+    publishAccents();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::publishPatternBanks()
+{
+    m_playingBanks.getWriteBuffer() = getPatternBankSnapshots();
+    m_playingBanks.publish();
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::publishAccents()
+{
+    m_playingAccents.getWriteBuffer() = m_accentBanks;
+    m_playingAccents.publish();
+}
+//==============================================================================
+//      PATTERN LIBRARY
+bool Sjf_AAIM_DrumsAudioProcessor::loadPatternLibrary( const juce::File& libraryFile )
+{
+    auto library = sjf_patternLibraryFile::open( libraryFile );
+    if ( library == nullptr )
+        return false;
+    {
+        const sjf_rtAudit::spinLock::ScopedLockType lock( m_libraryFileLock );
+        std::swap( m_libraryFile, library );
+        m_hot.lastLoadedLibraryPattern = -1;
+    }
+    // the search index is only built when it is first needed
+    m_patternLibrary.clear();
+    m_similarPatterns.clear();
+    patternLibraryFileParameter.setValue( libraryFile.getFullPathName() );
+    return true;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::buildPatternLibraryIndex()
+{
+    m_patternLibrary.clear();
+    if ( m_libraryFile == nullptr )
+        return;
+    m_patternLibrary.reserve( m_libraryFile->size() );
+    auto words = sjf_patternLibraryIndex< NUM_VOICES >::words();
+    for ( size_t i = 0; i < m_libraryFile->size(); i++ )
+    {
+        auto record = m_libraryFile->getRecord( i );
+        std::copy( std::begin( record->voices ), std::end( record->voices ), words.begin() );
+        m_patternLibrary.addPattern( words, record->nBeats, record->division );
+    }
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::copyActiveLibraryPatternToBank()
+{
+    auto libraryPattern = static_cast< int >( *m_hot.libraryPatternParameter );
+    if ( libraryPattern < 0 )
+        return;
+    loadLibraryPattern( static_cast< size_t >( libraryPattern ), getCurrentBank() );
+    auto param = parameters.getParameter( "libraryPattern" );
+    param->beginChangeGesture();
+    param->setValueNotifyingHost( param->convertTo0to1( -1 ) );
+    param->endChangeGesture();
+}
+
+std::vector< size_t > Sjf_AAIM_DrumsAudioProcessor::findSimilarPatterns( size_t nMatches, bool useMetricWeights )
+{
+    if ( m_patternLibrary.size() == 0 )
+        buildPatternLibraryIndex();
+    auto bank = getCurrentBank();
+    auto query = sjf_patternLibraryIndex< NUM_VOICES >::words();
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+        query[ i ] = static_cast< uint32_t >( m_patternBanks[ bank ][ i ].to_ulong() );
+    if ( useMetricWeights )
+        m_patternLibrary.setMetricWeights( m_rGen.getBaseindispensability() );
+    auto matches = m_patternLibrary.findNearest( query, nMatches, m_nBeatsBanks[ bank ], useMetricWeights );
+    std::vector< size_t > indices;
+    indices.reserve( matches.size() );
+    for ( auto& m : matches )
+        indices.push_back( m.index );
+    return indices;
+}
+
+void Sjf_AAIM_DrumsAudioProcessor::loadLibraryPattern( size_t libraryIndex, size_t bank )
+{
+    auto record = m_libraryFile == nullptr ? nullptr : m_libraryFile->getRecord( libraryIndex );
+    if ( record == nullptr || bank >= NUM_BANKS )
+        return;
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
+        m_patternBanks[ bank ][ i ] = std::bitset< MAX_NUM_STEPS >( record->voices[ i ] );
+    m_nBeatsBanks[ bank ] = juce::jlimit< size_t >( 1, MAX_NUM_STEPS, record->nBeats );
+    m_divBanks[ bank ] = juce::jlimit< size_t >( halfNote, sixtyFourthNote, record->division );
+    m_voiceNBeatsBanks[ bank ].fill( 0 );
+    m_voiceDivBanks[ bank ].fill( 0 );
+    publishPatternBanks();
+    storePatternHistory();
+}
+
+int Sjf_AAIM_DrumsAudioProcessor::importMidiFile( const juce::File& midiFile )
+{
+    auto first = getCurrentBank();
+    auto nBeats = m_nBeatsBanks[ first ], division = m_divBanks[ first ];
+    // read in place from the mapping, nothing is copied but the packed words
+    juce::MemoryMappedFile mapped( midiFile, juce::MemoryMappedFile::readOnly );
+    std::vector< midiImport::bar > bars;
+    if ( mapped.getData() == nullptr || !midiImport::parse( static_cast< const uint8_t* >( mapped.getData() ), mapped.getSize(), nBeats, division, bars ) )
+        return 0;
+    auto nBanks = std::min( bars.size(), NUM_BANKS - first );
+    for ( size_t b = 0; b < nBanks; b++ )
+    {
+        auto bank = first + b;
+        for ( size_t i = 0; i < NUM_VOICES; i++ )
+            m_patternBanks[ bank ][ i ] = std::bitset< MAX_NUM_STEPS >( bars[ b ][ i ] );
+        m_nBeatsBanks[ bank ] = nBeats;
+        m_divBanks[ bank ] = division;
+        m_voiceNBeatsBanks[ bank ].fill( 0 );
+        m_voiceDivBanks[ bank ].fill( 0 );
+    }
+    if ( nBanks > 0 )
+    {
+        publishPatternBanks();
+        storePatternHistory();
+    }
+    return static_cast< int >( nBanks );
+}
+
+bool Sjf_AAIM_DrumsAudioProcessor::loadSimilarPattern( bool useMetricWeights )
+{
+    static constexpr size_t nMatches = 16;
+    auto bank = getCurrentBank();
+    // if the bank still holds the last match we loaded, move on to the next one, otherwise search again
+    auto stillLoaded = m_similarPatternPosition < m_similarPatterns.size();
+    for ( size_t i = 0; i < NUM_VOICES && stillLoaded; i++ )
+        stillLoaded = m_patternBanks[ bank ][ i ].to_ulong() == m_libraryFile->getRecord( m_similarPatterns[ m_similarPatternPosition ] )->voices[ i ];
+    if ( stillLoaded )
+        m_similarPatternPosition = ( m_similarPatternPosition + 1 ) % m_similarPatterns.size();
+    else
+    {
+        m_similarPatterns = findSimilarPatterns( nMatches, useMetricWeights );
+        m_similarPatternPosition = 0;
+    }
+    if ( m_similarPatterns.empty() )
+        return false;
+    loadLibraryPattern( m_similarPatterns[ m_similarPatternPosition ], bank );
+    return true;
 }
 //==============================================================================
 //      ALGORITHMIC VARIATIONS
+// the variations work on the stored bank, never on what the voices play, which can be a blend with
+// the morph bank or a varied copy from the arrangement, the voices reload the bank at their next step
+void Sjf_AAIM_DrumsAudioProcessor::patternBankVaried()
+{
+    publishPatternBanks();
+    markPatternChanged();
+    storePatternHistory();
+}
+
 void Sjf_AAIM_DrumsAudioProcessor::reversePattern()
 {
-    for ( size_t i = 0; i < m_pVary.size(); i++ )
+    auto bank = getCurrentBank();
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
     {
-        auto pat = std::bitset< MAX_NUM_STEPS >( m_pVary[ i ].getPatternLong() );
-        
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]; j++ )
-        {
-            auto revStep = m_nBeatsBanks[ *bankNumberParameter ] - j - 1;
-            m_pVary[ i ].setBeat( revStep, pat[ j ] );
-            m_patternBanks[ *bankNumberParameter ][ i ][ revStep ] = pat[ j ];
-        }
+        auto pat = m_patternBanks[ bank ][ i ];
+        auto nBeats = getStoredVoiceLength( bank, i );
+        for ( size_t j = 0; j < nBeats; j++ )
+            m_patternBanks[ bank ][ i ][ nBeats - j - 1 ] = pat[ j ];
     }
+    patternBankVaried();
 }
 
 
@@ -439,15 +1450,17 @@ void Sjf_AAIM_DrumsAudioProcessor::markovHorizontal()
 {
     // create a transition table for each voice
     // then pass each into markov chain
-    auto nVoices = m_pVary.size();
+    auto bank = getCurrentBank();
+    auto nVoices = static_cast< size_t >( NUM_VOICES );
     for ( size_t i = 0; i < nVoices; i++ )
     {
+        auto nBeats = getStoredVoiceLength( bank, i );
         auto transitionTable = std::array< std::array < int, 2 >, 2 >{ { { 0, 0 }, { 0, 0 } } };
-        auto pat = std::bitset< MAX_NUM_STEPS >( m_pVary[ i ].getPatternLong() );
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]; j++ )
+        auto& pat = m_patternBanks[ bank ][ i ];
+        for ( size_t j = 0; j < nBeats; j++ )
         {
             auto bit = pat[ j ] ? 1 : 0;
-            auto nextStep = ( j + 1 ) % m_nBeatsBanks[ *bankNumberParameter ];
+            auto nextStep = ( j + 1 ) % nBeats;
             auto nextBit = pat[ nextStep ] ? 1 : 0;
             transitionTable[ bit ][ nextBit ] += 1;
         }
@@ -459,136 +1472,149 @@ void Sjf_AAIM_DrumsAudioProcessor::markovHorizontal()
         auto rnd = rand01() * (totals[ 0 ] + totals[ 1 ]);
         auto trig = ( rnd < totals[ 0 ] ) ? false : true;
         
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]; j++ )
+        for ( size_t j = 0; j < nBeats; j++ )
         {
-            m_patternBanks[ *bankNumberParameter ][ i ][ j ] = trig;
-            m_pVary[ i ].setBeat( j, trig );
+            m_patternBanks[ bank ][ i ][ j ] = trig;
             rnd = rand01() * ( transitionTable[ trig ][ 0 ] + transitionTable[ trig ][ 1 ]);
             trig = ( rnd < transitionTable[ trig ][ 0 ] ) ? false : true;
         }
         
     }
+    patternBankVaried();
 }
 
 void Sjf_AAIM_DrumsAudioProcessor::cellShuffleVariation()
 {
-    auto indis = m_rGen.getBaseindispensability();
-    std::vector < size_t > steps{ };
-    auto count = 1ul;
-    for ( size_t i = 1; i < indis.size() -1; i++ )
+    // voices of the same length are cut into the same cells and shuffled together, so they still play as one
+    auto bank = getCurrentBank();
+    auto& metres = getMetres();
+    auto rd = std::random_device{};
+    auto rng = std::default_random_engine{ rd() };
+    std::vector< size_t > voices;
+    voices.reserve( NUM_VOICES );
+    uint32_t shuffledVoices = 0;
+    for ( size_t v = 0; v < NUM_VOICES; v++ )
     {
-        if ( indis[ i ] > indis[ i - 1 ] && indis[ i ] > indis[ i + 1 ] )
-        {
-            steps.push_back( count );
-            count = 1;
-        }
-        else
+        if ( ( shuffledVoices >> v ) & 1u )
+            continue;
+        auto nBeats = getStoredVoiceLength( bank, v );
+        voices.clear();
+        for ( size_t k = v; k < NUM_VOICES; k++ )
         {
-            count += 1;
+            if ( getStoredVoiceLength( bank, k ) != nBeats )
+                continue;
+            voices.push_back( k );
+            shuffledVoices |= 1u << k;
         }
-    }
-    steps.push_back( count + 1 );
-    std::vector< std::vector< std::bitset< NUM_VOICES > > > cells;
-    cells.reserve( steps.size() );
-    count = 0;
-    for ( size_t i = 0; i < steps.size(); i++ )
-    {
-        std::vector< std::bitset< NUM_VOICES > > cell;
-        cell.reserve( steps[ i ] );
-        for ( size_t j = 0; j < steps[ i ]; j++ )
+        // a new cell starts on every step more indispensable than those either side
+        auto& indis = metres[ nBeats ];
+        std::vector < size_t > steps{ };
+        auto count = 1ul;
+        for ( size_t i = 1; i + 1 < nBeats; i++ )
         {
-            std::bitset< NUM_VOICES > step;
-            step.reset();
-            for ( size_t k = 0; k < NUM_VOICES; k++ )
+            if ( indis[ i ] > indis[ i - 1 ] && indis[ i ] > indis[ i + 1 ] )
+            {
+                steps.push_back( count );
+                count = 1;
+            }
+            else
             {
-                step[ k ] = m_pVary[ k ].getStep( count );
+                count += 1;
             }
-            cell.emplace_back( step );
-            count += 1;
         }
-        cells.emplace_back( cell );
-    }
-    // shuffle cells
-    auto rd = std::random_device{};
-    auto rng = std::default_random_engine{ rd() };
-    std::shuffle(std::begin( cells ), std::end( cells ), rng);
-    
-    count = 0;
-    for ( size_t i = 0; i < cells.size(); i++ )
-        for ( size_t j = 0; j < cells[ i ].size(); j++ )
+        steps.push_back( nBeats > 1 ? count + 1 : 1 );
+        std::vector< std::vector< std::bitset< NUM_VOICES > > > cells;
+        cells.reserve( steps.size() );
+        count = 0;
+        for ( size_t i = 0; i < steps.size(); i++ )
         {
-            for ( size_t k = 0; k < NUM_VOICES; k++ )
+            std::vector< std::bitset< NUM_VOICES > > cell;
+            cell.reserve( steps[ i ] );
+            for ( size_t j = 0; j < steps[ i ]; j++ )
             {
-                auto trig = cells[ i ][ j ][ k ];
-                m_patternBanks[ *bankNumberParameter ][ k ][ count ] = trig;
-                m_pVary[ k ].setBeat( count, trig );
+                std::bitset< NUM_VOICES > step;
+                step.reset();
+                for ( auto k : voices )
+                {
+                    step[ k ] = m_patternBanks[ bank ][ k ][ count ];
+                }
+                cell.emplace_back( step );
+                count += 1;
             }
-            count += 1;
+            cells.emplace_back( cell );
         }
+        // shuffle cells
+        std::shuffle(std::begin( cells ), std::end( cells ), rng);
+        
+        count = 0;
+        for ( size_t i = 0; i < cells.size(); i++ )
+            for ( size_t j = 0; j < cells[ i ].size(); j++ )
+            {
+                for ( auto k : voices )
+                {
+                    m_patternBanks[ bank ][ k ][ count ] = cells[ i ][ j ][ k ];
+                }
+                count += 1;
+            }
+    }
+    patternBankVaried();
 }
 
 void Sjf_AAIM_DrumsAudioProcessor::palindromeVariation()
 {
-    auto nBeats = m_nBeatsBanks[ *bankNumberParameter ] * 2;
+    auto bank = getCurrentBank();
+    auto nBeats = m_nBeatsBanks[ bank ] * 2;
     nBeats = ( nBeats > MAX_NUM_STEPS ) ? MAX_NUM_STEPS : nBeats;
-    m_rGen.setNumBeats( nBeats );
-    m_nBeatsBanks[ *bankNumberParameter ] = static_cast<int>(nBeats);
-    for ( size_t i = 0; i < m_pVary.size(); i++ )
+    // every voice doubles its own length, those that follow the bank follow it to its new length
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
     {
-        m_pVary[ i ].setNumBeats( m_nBeatsBanks[ *bankNumberParameter ] );
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]/2; j++ )
-        {
-            auto step = m_nBeatsBanks[ *bankNumberParameter ] - 1 - j;
-            auto trig = m_pVary[ i ].getStep( j );
-            m_patternBanks[ *bankNumberParameter ][ i ][ step ] = trig;
-            m_pVary[ i ].setBeat( step, trig );
-        }
+        auto voiceBeats = std::min< size_t >( getStoredVoiceLength( bank, i ) * 2, MAX_NUM_STEPS );
+        if ( m_voiceNBeatsBanks[ bank ][ i ] > 0 )
+            m_voiceNBeatsBanks[ bank ][ i ] = static_cast< uint8_t >( voiceBeats );
+        auto& pat = m_patternBanks[ bank ][ i ];
+        for ( size_t j = 0; j < voiceBeats/2; j++ )
+            pat[ voiceBeats - 1 - j ] = pat[ j ];
     }
+    m_nBeatsBanks[ bank ] = static_cast<int>(nBeats);
+    patternBankVaried();
 }
 
 
 void Sjf_AAIM_DrumsAudioProcessor::doublePattern()
 {
-    auto nBeats = m_nBeatsBanks[ *bankNumberParameter ] * 2;
+    auto bank = getCurrentBank();
+    auto nBeats = m_nBeatsBanks[ bank ] * 2;
     nBeats = ( nBeats > MAX_NUM_STEPS ) ? MAX_NUM_STEPS : nBeats;
-    m_nBeatsBanks[ *bankNumberParameter ] = static_cast<int>(nBeats);
-    for ( size_t i = 0; i < m_pVary.size(); i++ )
+    // every voice doubles its own length, those that follow the bank follow it to its new length
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
     {
-        m_pVary[ i ].setNumBeats( nBeats );
-        for ( size_t j = 0; j < nBeats/2; j++ )
-        {
-            auto step = nBeats/2 + j;
-            auto trig = m_pVary[ i ].getStep( j );
-            m_patternBanks[ *bankNumberParameter ][ i ][ step ] = trig;
-            m_pVary[ i ].setBeat( step, trig );
-        }
+        auto voiceBeats = getStoredVoiceLength( bank, i );
+        auto doubledBeats = std::min< size_t >( voiceBeats * 2, MAX_NUM_STEPS );
+        if ( m_voiceNBeatsBanks[ bank ][ i ] > 0 )
+            m_voiceNBeatsBanks[ bank ][ i ] = static_cast< uint8_t >( doubledBeats );
+        auto& pat = m_patternBanks[ bank ][ i ];
+        for ( size_t j = 0; j < doubledBeats - voiceBeats; j++ )
+            pat[ voiceBeats + j ] = pat[ j ];
     }
+    m_nBeatsBanks[ bank ] = static_cast<int>(nBeats);
+    patternBankVaried();
 }
 
 
 void Sjf_AAIM_DrumsAudioProcessor::rotatePattern( bool trueIfLeftFalseIfRight)
 {
-    for ( size_t i = 0; i < m_pVary.size(); i++ )
+    auto bank = getCurrentBank();
+    for ( size_t i = 0; i < NUM_VOICES; i++ )
     {
-        auto pat = std::bitset< MAX_NUM_STEPS >( m_pVary[ i ].getPatternLong() );
-        for ( size_t j = 0; j < m_nBeatsBanks[ *bankNumberParameter ]; j++ )
+        auto pat = m_patternBanks[ bank ][ i ];
+        auto nBeats = getStoredVoiceLength( bank, i );
+        for ( size_t j = 0; j < nBeats; j++ )
         {
-            if ( trueIfLeftFalseIfRight )
-            {
-                auto rotatedLeft = ( j + m_nBeatsBanks[ *bankNumberParameter ] - 1 ) % m_nBeatsBanks[ *bankNumberParameter ];
-                auto trig = pat[ j ];
-                m_patternBanks[ *bankNumberParameter ][ i ][ rotatedLeft ] = trig;
-                m_pVary[ i ].setBeat( rotatedLeft, trig );
-            }
-            else
-            {
-                auto rotatedRight = ( j + 1 ) % m_nBeatsBanks[ *bankNumberParameter ];
-                auto trig = pat[ j ];
-                m_patternBanks[ *bankNumberParameter ][ i ][ rotatedRight ] = trig;
-                m_pVary[ i ].setBeat( rotatedRight, trig );
-            }
+            auto rotatedStep = trueIfLeftFalseIfRight ? ( j + nBeats - 1 ) % nBeats : ( j + 1 ) % nBeats;
+            m_patternBanks[ bank ][ i ][ rotatedStep ] = pat[ j ];
         }
     }
+    patternBankVaried();
 }
 
 
@@ -12,6 +12,23 @@
 #include "../sjf_AAIM_Cplusplus/sjf_AAIM_rhythmGen.h"
 #include "../sjf_AAIM_Cplusplus/sjf_AAIM_patternVary.h"
 #include "../sjf_AAIM_Cplusplus/sjf_audio/sjf_audioUtilitiesC++.h"
+#include "sjf_AAIM_patternHistory.h"
+#include "sjf_AAIM_patternLibraryIndex.h"
+#include "sjf_AAIM_patternLibraryFile.h"
+#include "sjf_AAIM_ioiTable.h"
+#include "sjf_AAIM_voiceClock.h"
+#include "sjf_AAIM_midiControl.h"
+#include "sjf_AAIM_gateOutput.h"
+#include "sjf_AAIM_onsetFollower.h"
+#include "sjf_AAIM_syncBus.h"
+#include "sjf_AAIM_rtAudit.h"
+#include "sjf_AAIM_noteOffQueue.h"
+#include "sjf_AAIM_accentTable.h"
+#include "sjf_AAIM_bankMorph.h"
+#include "sjf_AAIM_bankChain.h"
+#include "sjf_AAIM_rhythmMetrics.h"
+#include "sjf_AAIM_midiImport.h"
+#include "sjf_AAIM_tripleBuffer.h"
 #include <algorithm>    // std::shuffle
 #include <vector>       // std::vector
 #include <random>       // std::default_random_engine
@@ -20,10 +37,15 @@
 #define MAX_NUM_STEPS 32
 #define NUM_IOIs 26
 #define NUM_BANKS 16
+
+// the benchmarks and checks in sjf_AAIM_Drums_diagnostics.h, built into debug builds unless this says otherwise
+#ifndef SJF_AAIM_DIAGNOSTICS
+ #define SJF_AAIM_DIAGNOSTICS JUCE_DEBUG
+#endif
 //==============================================================================
 /**
 */
-class Sjf_AAIM_DrumsAudioProcessor  : public juce::AudioProcessor
+class Sjf_AAIM_DrumsAudioProcessor  : public juce::AudioProcessor, private juce::Timer
                             #if JucePlugin_Enable_ARA
                              , public juce::AudioProcessorARAExtension
                             #endif
@@ -70,11 +92,26 @@ public:
     void setPattern( int row, std::vector<bool> pattern );
     const std::vector<bool>& getPattern( int row );
     
+    // the pattern of a voice in the current bank, or in the library pattern that is playing,
+    // packed one bit per step, step 0 in the least significant bit
+    // the bank is shown as it is stored, whatever the morph or the arrangement are playing from it
+    uint32_t getPatternWord( int row )
+    {
+        if ( m_hot.libraryPatternActive )
+            return static_cast< uint32_t >( m_pVary[ row ].getPatternLong() );
+        auto length = getStoredVoiceLength( getCurrentBank(), static_cast< size_t >( row ) );
+        return static_cast< uint32_t >( m_patternBanks[ getCurrentBank() ][ row ].to_ulong() ) & ( length >= 32 ? ~0u : ( 1u << length ) - 1u );
+    }
+    // changes whenever the pattern of that voice might have changed, so views can skip voices that haven't
+    uint32_t getPatternGeneration( int row ){ return m_patternGenerations[ row ].load( std::memory_order_acquire ); }
     
-    void setIOIProbability( float division, float chanceForThatDivision)
-    { m_rGen.setIOIProbability( division, chanceForThatDivision); };
     
-    std::vector< std::array< float , 4> > getIOIProbability( ) { return m_rGen.getIOIProbabilities(); }
+    // ioiIndex is the position of the division in ioiFactors
+    void setIOIProbability( size_t ioiIndex, float chanceForThatDivision );
+    
+    // indexed like ioiFactors, the version changes whenever any probability does
+    const std::array< float, NUM_IOIs >& getIOIProbabilities() const { return m_ioiTable.getProbabilities(); }
+    uint32_t getIOIVersion() const { return m_ioiTable.getVersion(); }
     
     bool stateLoaded(){ return m_stateLoadedFlag; }
     void setStateLoadedFalse( ){ m_stateLoadedFlag = false; }
@@ -87,7 +124,10 @@ public:
     
     void setNonAutomatableParameterValues();
     
-    int getCurrentStep(){ return m_currentStep; }
+    // delays the second step of every pair, currentBeat is in steps and swing is the exponent
+    static double applySwingToPosition( double currentBeat, float swing );
+    
+    int getCurrentStep(){ return m_hot.currentStep; }
     
     void copyPatternBankContents( size_t bankToCopyFrom, size_t bankToCopyTo );
     
@@ -107,65 +147,405 @@ public:
     
     void setNumBeats( int nBeats )
     {
-        m_nBeatsBanks[ *bankNumberParameter ] = nBeats;
-        m_rGen.setNumBeats( m_nBeatsBanks[ *bankNumberParameter ] );
-        for ( size_t i = 0; i < NUM_VOICES; i++ )
-            m_pVary[ i ].setNumBeats( m_nBeatsBanks[ *bankNumberParameter ] );
+        if ( m_hot.libraryPatternActive )
+            return;
+        m_nBeatsBanks[ getCurrentBank() ] = nBeats;
+        // the generator and the voices take the new length when the audio thread reloads the bank
+        publishPatternBanks();
+        markPatternChanged();
+        storePatternHistory();
     }
-    size_t getNumBeats(){ return m_nBeatsBanks[ *bankNumberParameter ]; }
+    size_t getNumBeats(){ return m_hot.libraryPatternActive ? m_hot.libraryNumBeats : m_nBeatsBanks[ getCurrentBank() ]; }
+    
+    void setTsDenominator( int tsDenominator )
+    {
+        if ( m_hot.libraryPatternActive )
+            return;
+        m_divBanks[ getCurrentBank() ] = tsDenominator;
+        // voices with their own division run relative to the bank's
+        publishPatternBanks();
+        storePatternHistory();
+    }
+    int getTsDenominator(){ return static_cast<int>( m_hot.libraryPatternActive ? m_hot.libraryDivision : m_divBanks[ getCurrentBank() ] ); }
+    
+    // length and division of a single voice in the current bank, 0 follows the bank
+    void setVoiceNumBeats( int voice, int nBeats );
+    int getVoiceNumBeats( int voice ){ return m_voiceNBeatsBanks[ getCurrentBank() ][ voice ]; }
+    
+    void setVoiceDivision( int voice, int division );
+    int getVoiceDivision( int voice ){ return m_voiceDivBanks[ getCurrentBank() ][ voice ]; }
+    
+    // how long each of a voice's notes lasts in steps of the pattern, the same in every bank
+    // 0 holds the note until the voice plays again
+    static constexpr float DEFAULT_GATE_LENGTH = 0.5f, MAX_GATE_LENGTH = 4.0f;
+    void setVoiceGateLength( int voice, float steps );
+    float getVoiceGateLength( int voice ){ return m_voiceGateLengths[ voice ].load( std::memory_order_relaxed ); }
+    
+    // accents of a voice in the current bank, the generator's velocity is scaled and offset at each step
+    // and then moved by up to +/- the random range
+    // setAccent is called for every step of a drag, so call storePatternHistory once it is done
+    using accentTable = sjf_accentTable< NUM_VOICES, MAX_NUM_STEPS >;
+    void setAccent( int voice, int step, float scale, float offset );
+    void setAccentRandomRange( int voice, float range );
+    const accentTable::voiceAccents& getAccents( int voice ){ return m_accentBanks[ getCurrentBank() ][ voice ]; }
+    
+    // call after any edit to the pattern banks so that it can be undone
+    void storePatternHistory();
+    
+    bool undoPatternEdit();
+    
+    bool redoPatternEdit();
+    
+    bool canUndoPatternEdit(){ return m_patternHistory.canUndo(); }
+    bool canRedoPatternEdit(){ return m_patternHistory.canRedo(); }
+    
+    bool loadPatternLibrary( const juce::File& libraryFile );
+    
+    size_t getPatternLibrarySize(){ return m_libraryFile == nullptr ? 0 : m_libraryFile->size(); }
+    
+    juce::String getPatternLibraryName(){ return m_libraryFile == nullptr ? juce::String() : m_libraryFile->getFile().getFileNameWithoutExtension(); }
+    juce::File getPatternLibraryFile(){ return m_libraryFile == nullptr ? juce::File() : m_libraryFile->getFile(); }
     
-    void setTsDenominator( int tsDenominator ){ m_divBanks[ *bankNumberParameter ] = tsDenominator; }
-    int getTsDenominator(){ return static_cast<int>( m_divBanks[ *bankNumberParameter ] ); }
+    // true while the libraryPattern parameter is selecting a pattern from the library rather than the banks
+    bool isLibraryPatternActive(){ return m_hot.libraryPatternActive; }
+    
+    // copies the library pattern that is playing into the current bank and switches back to the banks
+    void copyActiveLibraryPatternToBank();
+    
+    // library indices of the patterns closest to the current bank, closest first
+    std::vector< size_t > findSimilarPatterns( size_t nMatches, bool useMetricWeights );
+    
+    void loadLibraryPattern( size_t libraryIndex, size_t bank );
+    
+    // replaces the current bank with the closest library pattern, calling again steps through the next closest
+    bool loadSimilarPattern( bool useMetricWeights );
+    
+    // message thread, each bar of the midi file goes into a bank from the current bank onwards, quantised to the current bank's
+    // length and division, returns how many banks were filled. Whole directories go into a library with midiImport::importDirectory
+    using midiImport = sjf_midiImport< NUM_VOICES, MAX_NUM_STEPS >;
+    int importMidiFile( const juce::File& midiFile );
+    
+    // the arrangement played while the arrangement parameter is on, see sjf_bankChain for the format
+    // returns false and keeps the current chain if the text isn't valid
+    bool setBankChain( const juce::String& text );
+    juce::String getBankChainText();
+    
+    // message thread, brings the metrics of what is playing up to date and returns true if any voice had changed,
+    // only the steps that changed since the last call are looked at
+    using rhythmMetrics = sjf_rhythmMetrics< NUM_VOICES, MAX_NUM_STEPS >;
+    bool updateRhythmMetrics();
+    const rhythmMetrics& getRhythmMetrics() const { return m_rhythmMetrics; }
+    
+    // the generator's indispensability for every pattern length, indexed by length, worked out once for all instances
+    static const std::array< std::vector< float >, MAX_NUM_STEPS + 1 >& getMetres();
+    
+#if SJF_AAIM_DIAGNOSTICS
+    // instances anywhere in the process that are playing a block now, and how many blocks they have played between them,
+    // stopped instances are left out as they never run the generator
+    static int getNumPlaying(){ return s_nPlaying.load(); }
+    static uint64_t getNumBlocksPlayed(){ return s_nBlocksPlayed.load(); }
+#endif
     
 private:
     
+    using patternHistory = sjf_patternHistory< NUM_VOICES, NUM_BANKS, accentTable::bankAccents >;
+    
+#if SJF_AAIM_DIAGNOSTICS
+    // the library's generators draw from std::rand, so the golden renders need to know whether any instance played alongside them
+    static inline std::atomic< int > s_nPlaying { 0 };
+    static inline std::atomic< uint64_t > s_nBlocksPlayed { 0 };
+    struct scopedPlaying
+    {
+        scopedPlaying(){ s_nPlaying++; s_nBlocksPlayed++; }
+        ~scopedPlaying(){ s_nPlaying--; }
+    };
+#endif
+    
+    patternHistory::bankSet getPatternBankSnapshots();
+    
+    void restorePatternBanks( uint32_t changedBanks );
+    
+    // message thread, hands the banks as they are stored to the audio thread, which plays from its own copy
+    // and picks the new one up at its next step, call after every edit
+    void publishPatternBanks();
+    void publishAccents();
+    
+    void loadPatternBank();
+    
+    // after a variation has changed the current bank
+    void patternBankVaried();
+    
+    void markPatternChanged( size_t voice ){ m_patternGenerations[ voice ].fetch_add( 1, std::memory_order_release ); }
+    void markPatternChanged()
+    {
+        for ( size_t i = 0; i < NUM_VOICES; i++ )
+            markPatternChanged( i );
+    }
+    
+    // sets each voice's cycle length and rate from the current bank or library pattern
+    void updateVoiceClock();
+    
+    // the bank that is playing, a bank picked on the audio thread plays before the host's parameter has caught up with it
+    size_t getCurrentBank()
+    {
+        auto bank = m_hot.bankOverride.load( std::memory_order_relaxed );
+        return static_cast< size_t >( bank != noBankOverride ? bank : static_cast< int >( *m_hot.bankNumberParameter ) );
+    }
+    
+    // audio thread, the bank as it was last published
+    const patternHistory::bankSnapshot& getPlayingBank( size_t bank ){ return m_playingBanks.read()[ bank ]; }
+    
+    // audio thread, the length of a voice in what is playing
+    size_t getVoiceLength( size_t voice )
+    {
+        if ( m_hot.libraryPatternActive )
+            return m_hot.libraryNumBeats;
+        auto& bank = getPlayingBank( getCurrentBank() );
+        return bank.voiceNBeats[ voice ] > 0 ? bank.voiceNBeats[ voice ] : bank.nBeats;
+    }
+    
+    // message thread, the length of a voice in a bank as it is stored
+    size_t getStoredVoiceLength( size_t bank, size_t voice )
+    {
+        return m_voiceNBeatsBanks[ bank ][ voice ] > 0 ? m_voiceNBeatsBanks[ bank ][ voice ] : m_nBeatsBanks[ bank ];
+    }
+    
+    // pushes the whole table back to the generator, e.g. after playing a library pattern with its own IOIs
+    void restoreIOIProbabilities();
+    
+    // busy while the message thread holds the library, unavailable if there is no library or no such pattern in it
+    enum libraryLoadResults { libraryLoaded, libraryBusy, libraryUnavailable };
+    libraryLoadResults loadLibraryPatternForPlayback( int libraryIndex );
+    
+    void buildPatternLibraryIndex();
+    
+    // audio thread
+    size_t getActiveNumBeats(){ return m_hot.libraryPatternActive ? m_hot.libraryNumBeats : getPlayingBank( getCurrentBank() ).nBeats; }
+    size_t getActiveDivision(){ return m_hot.libraryPatternActive ? m_hot.libraryDivision : getPlayingBank( getCurrentBank() ).division; }
+    
     juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
     
+    // the names the banks, divisions and gate lengths are saved under
+    // they are only read and written with the state, so they are made once, the first time any instance needs them
+    struct stateIdentifiers
+    {
+        stateIdentifiers();
+        std::array< juce::Identifier, NUM_IOIs > ioiDiv, ioiProb;
+        std::array< std::array< juce::Identifier, NUM_VOICES >, NUM_BANKS > pattern, voiceNumBeats, voiceDiv, voiceAccents;
+        std::array< juce::Identifier, NUM_BANKS > bankNumBeats, bankDiv;
+        std::array< juce::Identifier, NUM_VOICES > voiceGateLength;
+    };
+    static const stateIdentifiers& getStateIdentifiers();
+    
     void setParameters();
     
+    // audio thread, applies one incoming midi control event at the sample it arrived on
+    void applyMidiControl( const sjf_midiControl::event& e );
+    // message thread, passes banks picked on the audio thread on to the host and runs the variations requested over midi
+    // polled rather than triggered because posting a message from the audio thread can block
+    void timerCallback() override;
+    
     static BusesProperties getBusesLayout()
     {
         // Live doesn't like to load midi-only plugins, so we add an audio output there.
-        return juce::PluginHostType().isAbletonLive() ? BusesProperties().withOutput ("out", juce::AudioChannelSet::stereo())
+        auto buses = juce::PluginHostType().isAbletonLive() ? BusesProperties().withOutput ("out", juce::AudioChannelSet::stereo())
                                                 : BusesProperties();
+        if ( !hasAuxiliaryBuses() )
+            return buses;
+        // gate and velocity per voice for modular/DC coupled interfaces, off unless the host enables it
+        // a sidechain input lets the generator follow a live band, also off unless the host enables it
+        return buses.withOutput( "Gates", juce::AudioChannelSet::discreteChannels( NUM_VOICES * 2 ), false )
+                    .withInput( "Sidechain", juce::AudioChannelSet::stereo(), false );
     }
     
-    double calculateCurrentBeat( double currentBeat, double hostPosition, double increment, size_t sampleIndex, bool swingOnFlag, float swing );
-    double applySwingToPosition( double currentBeat, float swing );
-    
-    juce::AudioProcessorValueTreeState parameters;
+    // an AU midi effect ('aumi') has no audio buses a host will connect, the other formats get the gates and the sidechain
+    static bool hasAuxiliaryBuses()
+    {
+        return juce::PluginHostType::getPluginLoadedAs() != juce::AudioProcessor::wrapperType_AudioUnit;
+    }
     
-    AAIM_rhythmGen< float > m_rGen;
-
-    std::array< AAIM_patternVary< float >, NUM_VOICES > m_pVary;
+    // position at the start of the block and increment per sample, both in quarter notes, from the host or the internal clock
+    // returns false if nothing should play
+    bool updateClock( int numSamples, double& position, double& increment );
+    
+    // one pulse from the generator, or from the sync leader, played by the voices with a bit set in voices
+    void triggerVoices( double patternBeat, float velocity, float ioi, bool play, juce::MidiBuffer& midiMessages, int samplePosition, int midiChannel, uint32_t mutedVoices, uint32_t voices );
+    
+    // claims or releases the sync group as the parameters ask, returns what this instance does for the block
+    enum syncModes { syncOff, syncLeader, syncFollower };
+    syncModes updateSyncRole();
+    // plays the leader's pulses instead of running the generator, a block late so that the leader has published
+    // all of them whichever order the host processes the two in, the timer reports the delay as latency
+    void renderFollowerBlock( juce::MidiBuffer& midiMessages, int numSamples, double quarterNotePosition, double quarterNotesPerSample );
+    
+    void renderGateOutput( juce::AudioBuffer<float>& buffer );
+    
+    // flattens the current bank's accents, library patterns play without any
+    void buildAccentTable();
+    
+    // blends the morph bank into the current one as far as the morph parameter asks, only the steps that change are set
+    void updateMorph();
+    
+    // audio thread, switches to the chain's bank for the bar quarterNotePosition falls in
+    void applyBankChain( double quarterNotePosition );
+    // audio thread, varies the words that are playing for as long as the chain's entry lasts, see sjf_bankChain::applyVariation
+    // a change to the morph while it plays blends the stored banks again
+    void playChainVariation( int variation );
+    // the first sample after start that lands on a bar line
+    int getNextBarSample( double quarterNotePosition, double quarterNotesPerSample, int start );
+    // message thread, sets up the spare generator for the chain's next bank before its bar line
+    void prepareNextChainBank();
+    
+    // sends the note offs due before samplePosition at the samples they are due on
+    void sendNoteOffs( juce::MidiBuffer& midiMessages, int samplePosition );
+    // ends every sounding note at samplePosition, e.g. when the transport stops or the bank changes
+    void flushNoteOffs( juce::MidiBuffer& midiMessages, int samplePosition );
+    
+    // everything a run of samples needs, taken once so the sample loop doesn't touch the parameters or banks
+    struct renderContext
+    {
+        double position = 0, increment = 0; // in steps of the active division
+        double compensation = 0;
+        size_t nBeats = 1, division = 0;
+        float swing = 1;
+        bool swingOn = false;
+        double quarterNotePosition = 0, quarterNotesPerSample = 0;
+        int midiChannel = 1;
+        uint32_t mutedVoices = 0;
+    };
+    renderContext makeRenderContext( double quarterNotePosition, double quarterNotesPerSample );
+    // renders from start until end, or until the bank or its settings change, and returns where it stopped
+    template< bool SWING >
+    int renderSegment( const renderContext& context, juce::MidiBuffer& midiMessages, int start, int end );
     
-    juce::AudioPlayHead* playHead;
-    juce::AudioPlayHead::PositionInfo positionInfo;
+    juce::AudioProcessorValueTreeState parameters;
     
     enum beatDivisions
     {
         halfNote = 1, quarterNote, eightNote, sixteenthNote, thirtySecondNote, sixtyFourthNote
     };
     
-    int m_midiChannel = 1, m_currentStep = -1, m_lastLoadedBank = -1, m_internalCount = 0;;
-    double m_lastRGenPhase = 1, m_lastBankChangePosition = 0, m_lastHostPosition = 0, m_internalSyncCompensation = 0;
-    
-    std::atomic<float>* midiChannelParameter = nullptr;
-    std::atomic<float>* complexityParameter = nullptr;
-    std::atomic<float>* restsParameter = nullptr;
-    std::atomic<float>* fillsParameter = nullptr;
-    std::atomic<float>* swingParameter = nullptr;
-    std::atomic<float>* bankNumberParameter = nullptr;
-    std::atomic<float>* internalResetParameter = nullptr;
+    // Auto follows the host while it is playing and runs from the internal clock when it isn't
+    enum clockSources
+    {
+        hostClock, internalClock, autoClock
+    };
     
+    static constexpr int64_t NO_CHAIN_BAR = std::numeric_limits< int64_t >::min();
+    static constexpr int noBankOverride = -1;
+    // everything processBlock reads or writes on every sample, kept together and aligned to a cache line
+    // so that instances running on different threads never share a line with each other,
+    // the large arrays and juce::Values below are only touched when a pattern or the state changes
+    struct alignas( 64 ) hotState
+    {
+        std::atomic<float>* midiChannelParameter = nullptr;
+        std::atomic<float>* complexityParameter = nullptr;
+        std::atomic<float>* restsParameter = nullptr;
+        std::atomic<float>* fillsParameter = nullptr;
+        std::atomic<float>* swingParameter = nullptr;
+        std::atomic<float>* bankNumberParameter = nullptr;
+        std::atomic<float>* internalResetParameter = nullptr;
+        std::atomic<float>* libraryPatternParameter = nullptr;
+        std::atomic<float>* clockSourceParameter = nullptr;
+        std::atomic<float>* internalBpmParameter = nullptr;
+        std::atomic<float>* followAmountParameter = nullptr;
+        std::atomic<float>* syncModeParameter = nullptr;
+        std::atomic<float>* syncGroupParameter = nullptr;
+        std::atomic<float>* morphParameter = nullptr;
+        std::atomic<float>* morphBankParameter = nullptr;
+        std::atomic<float>* arrangementParameter = nullptr;
+        
+        double lastRGenPhase = 1, internalSyncCompensation = 0, lastBankChangePosition = 0, lastHostPosition = 0;
+        int midiChannel = 1, lastLoadedBank = -1, lastLoadedLibraryPattern = -1, internalCount = 0;
+        std::atomic< int > currentStep { -1 }; // also read by the editor
+        std::atomic< bool > libraryPatternActive { false };
+        size_t libraryNumBeats = 0, libraryDivision = 0;
+        uint32_t mutedVoices = 0; // one bit per voice, set from midi input
+        // the generator's last onset, voices off its pulse play their own steps with it
+        float pulseVelocity = 0, pulseIOI = 1;
+        bool pulsePlay = false;
+        bool fillHeld = false, restartPending = false, bankChangePending = false;
+        bool idle = false; // the last block had nothing to play
+        int64_t lastBeatIndex = -1; // unwrapped step the last sample was on
+        int lastPublishedStep = -1;
+        // the group this instance leads, or follows, and how far it has read
+        sjf_syncBus::ring* syncRing = nullptr;
+        sjf_syncBus::ring* followedRing = nullptr;
+        uint64_t syncReadIndex = 0;
+        int followerDelay = 0; // samples a follower plays behind the leader, the largest block the host will send
+        // internal clock, quarter notes at the last tempo change plus samples counted since
+        double clockOrigin = 0, clockIncrement = 0;
+        uint64_t clockSamples = 0;
+        // what the voices are playing now, set whenever the morph level or bank changes
+        size_t morphLevel = 0;
+        int morphBank = -1;
+        bool morphMasksDirty = true;
+        std::array< uint32_t, NUM_VOICES > playingWords{};
+        // samples processed since prepareToPlay before and after this block, note offs are scheduled on this count
+        int64_t blockStartSample = 0, blockEndSample = 0;
+        double samplesPerStep = 0;
+        // quarter notes per bar from the host's time signature, and the chain bar last played
+        double barLength = 4;
+        std::atomic< int64_t > chainBar { NO_CHAIN_BAR }; // also read by the timer
+        bool chainVariationPlaying = false; // the voices are playing a varied copy of the bank
+        // a bank picked by midi, the arrangement or a sync leader, played until the timer has set the bank parameter to it
+        std::atomic< int > bankOverride { noBankOverride };
+        
+        juce::AudioPlayHead* playHead = nullptr;
+        juce::AudioPlayHead::PositionInfo positionInfo;
+    };
     
+    hotState m_hot;
     
-    std::array< juce::Value, NUM_IOIs > ioiDivParameters, ioiProbParameters;
-    std::array< std::array< juce::Value, NUM_VOICES >, NUM_BANKS > patternBanksParameters;
-    std::array< juce::Value, NUM_BANKS > patternBanksNumBeatsParameters, divBanksParameters;
+    AAIM_rhythmGen< float > m_rGen;
+    sjf_ioiTable< NUM_IOIs > m_ioiTable { ioiFactors };
+
+    std::array< AAIM_patternVary< float >, NUM_VOICES > m_pVary;
+    std::array< std::atomic< uint32_t >, NUM_VOICES > m_patternGenerations {};
+    sjf_voiceClock< NUM_VOICES > m_voiceClock;
+    sjf_midiControl m_midiControl { NUM_BANKS, NUM_VOICES };
+    sjf_gateOutput< NUM_VOICES > m_gateOutput;
+    sjf_onsetFollower m_onsetFollower;
+    const bool m_auxiliaryBuses = hasAuxiliaryBuses();
+    sjf_noteOffQueue< NUM_VOICES > m_noteOffs;
+    std::array< std::atomic< float >, NUM_VOICES > m_voiceGateLengths;
+    accentTable m_accentTable;
+    juce::Random m_accentRandom;
+    sjf_bankMorph< NUM_VOICES, MAX_NUM_STEPS > m_bankMorph;
+    rhythmMetrics m_rhythmMetrics;
+    std::array< uint32_t, NUM_VOICES > m_metricsGenerations{};
+    juce::Random m_morphRandom, m_chainRandom;
+    juce::RangedAudioParameter* m_bankParameter = nullptr;
+    std::atomic< uint32_t > m_pendingVariations { 0 }; // one bit per variation requested over midi
+    
+    juce::Value patternLibraryFileParameter;
     std::array< std::array< std::bitset< MAX_NUM_STEPS >, NUM_VOICES >, NUM_BANKS > m_patternBanks;
     std::array< size_t, NUM_BANKS > m_nBeatsBanks, m_divBanks;
+    std::array< std::array< uint8_t, NUM_VOICES >, NUM_BANKS > m_voiceNBeatsBanks{}, m_voiceDivBanks{};
+    std::array< accentTable::bankAccents, NUM_BANKS > m_accentBanks;
     bool m_stateLoadedFlag = false;
+    // the arrays above belong to the message thread, the audio thread plays from these copies
+    sjf_tripleBuffer< patternHistory::bankSet > m_playingBanks;
+    sjf_tripleBuffer< patternHistory::accentSet > m_playingAccents;
+    
+    patternHistory m_patternHistory;
+    
+    std::shared_ptr< const sjf_patternLibraryFile > m_libraryFile;
+    sjf_rtAudit::spinLock m_libraryFileLock;
+    
+    std::shared_ptr< const sjf_bankChain > m_bankChain;
+    sjf_rtAudit::spinLock m_bankChainLock;
+    juce::Value bankChainParameter;
+    // the generator for the chain's next bank, owned by the timer until m_preparedBank names a bank
+    // and by the audio thread while it swaps it in
+    enum preparedStates { notPrepared = -1, preparedInUse = -2 };
+    AAIM_rhythmGen< float > m_preparedGen;
+    std::atomic< int > m_preparedBank { notPrepared };
+    uint32_t m_preparedIOIVersion = 0;
+    
+    sjf_patternLibraryIndex< NUM_VOICES > m_patternLibrary;
+    std::vector< size_t > m_similarPatterns;
+    size_t m_similarPatternPosition = 0;
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (Sjf_AAIM_DrumsAudioProcessor)
 };
@@ -0,0 +1,768 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_Drums_diagnostics.h
+    Benchmarks and checks that run inside the plugin, only compiled into debug
+    builds or when SJF_AAIM_DIAGNOSTICS is defined (see PluginProcessor.h)
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "PluginProcessor.h"
+#include "sjf_AAIM_densityPreview.h"
+#include <map>
+#include <functional>
+#include <numeric>
+
+#if SJF_AAIM_DIAGNOSTICS
+
+namespace sjf_AAIM_diagnostics
+{
+//==============================================================================
+// a transport that is always playing, moved on by whoever is processing the instance
+class benchmarkPlayHead : public juce::AudioPlayHead
+{
+public:
+    benchmarkPlayHead( double bpm, double sampleRate ) : m_bpm( bpm ), m_sampleRate( sampleRate ){}
+    
+    juce::Optional< PositionInfo > getPosition() const override
+    {
+        PositionInfo info;
+        info.setIsPlaying( true );
+        info.setBpm( m_bpm );
+        info.setTimeInSamples( m_timeInSamples );
+        info.setPpqPosition( static_cast< double >( m_timeInSamples ) * m_bpm / ( 60.0 * m_sampleRate ) );
+        return info;
+    }
+    
+    void advance( int nSamples ){ m_timeInSamples += nSamples; }
+    void reset(){ m_timeInSamples = 0; }
+    
+private:
+    double m_bpm, m_sampleRate;
+    juce::int64 m_timeInSamples = 0;
+};
+
+//==============================================================================
+// sets a parameter by its ID the same way a host would
+inline void setParameter( juce::AudioProcessor& processor, const juce::String& paramID, float normalisedValue )
+{
+    for ( auto* p : processor.getParameters() )
+        if ( auto* withID = dynamic_cast< juce::AudioProcessorParameterWithID* >( p ) )
+            if ( withID->paramID == paramID )
+                p->setValueNotifyingHost( normalisedValue );
+}
+
+// fills the current bank with a random pattern so that every voice has something to do
+inline void randomisePattern( Sjf_AAIM_DrumsAudioProcessor& processor, juce::Random& rand, float density = 0.4f )
+{
+    auto nBeats = processor.getNumBeats();
+    for ( int i = 0; i < NUM_VOICES; i++ )
+    {
+        std::vector< bool > pattern( nBeats );
+        for ( size_t j = 0; j < nBeats; j++ )
+            pattern[ j ] = rand.nextFloat() < density;
+        processor.setPattern( i, pattern );
+    }
+}
+
+// selects a bank through its parameter, as a host would
+inline void setBankParameter( juce::AudioProcessor& processor, int bank )
+{
+    setParameter( processor, "patternBank", static_cast< float >( bank ) / static_cast< float >( NUM_BANKS - 1 ) );
+}
+
+// randomises every bank, setting each one's length first unless nBeats is 0, and leaves bank 0 loaded
+inline void fillAllBanks( Sjf_AAIM_DrumsAudioProcessor& processor, juce::Random& rand, float density = 0.4f, size_t nBeats = 0 )
+{
+    for ( int b = NUM_BANKS - 1; b >= 0; b-- )
+    {
+        setBankParameter( processor, b );
+        processor.selectPatternBank();
+        if ( nBeats > 0 )
+            processor.setNumBeats( static_cast< int >( nBeats ) );
+        randomisePattern( processor, rand, density );
+    }
+}
+
+//==============================================================================
+/**
+ Runs many instances of the processor on a thread pool the way a host spreads a large session
+ over its worker threads, each thread owns a contiguous group of instances and processes them
+ block by block. The same instances are run with 1, 2, 4... threads so the report shows how
+ throughput scales with the number of cores.
+ The instances are created and destroyed with the benchmark so construct and delete it on the
+ message thread, run() can be called from any thread.
+*/
+class multiInstanceBenchmark
+{
+public:
+    multiInstanceBenchmark( int nInstances, double sampleRate = 48000, int blockSize = 256 )
+    : m_sampleRate( sampleRate ), m_blockSize( blockSize )
+    {
+        juce::Random rand( 1 );
+        for ( int i = 0; i < nInstances; i++ )
+        {
+            auto processor = std::make_unique< Sjf_AAIM_DrumsAudioProcessor >();
+            auto playHead = std::make_unique< benchmarkPlayHead >( 90.0 + 60.0 * rand.nextDouble(), sampleRate );
+            processor->setPlayHead( playHead.get() );
+            processor->setRateAndBufferSizeDetails( sampleRate, blockSize );
+            processor->prepareToPlay( sampleRate, blockSize );
+            setParameter( *processor, "complexity", rand.nextFloat() );
+            setParameter( *processor, "rests", 0.5f * rand.nextFloat() );
+            setParameter( *processor, "fills", rand.nextFloat() );
+            randomisePattern( *processor, rand );
+            m_instances.push_back( std::move( processor ) );
+            m_playHeads.push_back( std::move( playHead ) );
+        }
+    }
+    
+    ~multiInstanceBenchmark()
+    {
+        for ( auto& p : m_instances )
+            p->releaseResources();
+    }
+    
+    // processes secondsOfAudio with each thread count up to maxThreads, returns a plain text report
+    juce::String run( int maxThreads, double secondsOfAudio = 10 )
+    {
+        maxThreads = juce::jmax( 1, maxThreads );
+        auto nBlocks = static_cast< int >( secondsOfAudio * m_sampleRate / m_blockSize );
+        auto report = juce::String( "instances: " ) + juce::String( m_instances.size() )
+            + ", block size: " + juce::String( m_blockSize ) + ", sample rate: " + juce::String( m_sampleRate )
+            + ", audio per instance: " + juce::String( secondsOfAudio ) + "s\n"
+            + "threads\tms\tblocks/s\tx realtime\tscaling per core\n";
+        
+        auto singleThreadRate = 0.0;
+        for ( int nThreads = 1; ; nThreads = juce::jmin( nThreads * 2, maxThreads ) )
+        {
+            auto ms = timeRun( nThreads, nBlocks );
+            auto blocksPerSecond = 1000.0 * nBlocks * static_cast< double >( m_instances.size() ) / ms;
+            if ( nThreads == 1 )
+                singleThreadRate = blocksPerSecond;
+            report << nThreads << "\t" << juce::String( ms, 1 ) << "\t" << juce::String( blocksPerSecond, 0 )
+                << "\t" << juce::String( blocksPerSecond * m_blockSize / m_sampleRate, 1 )
+                << "\t" << juce::String( blocksPerSecond / ( singleThreadRate * nThreads ), 2 ) << "\n";
+            if ( nThreads == maxThreads )
+                break;
+        }
+        return report;
+    }
+    
+private:
+    double timeRun( int nThreads, int nBlocks )
+    {
+        for ( auto& p : m_playHeads )
+            p->reset();
+        
+        auto nInstances = static_cast< int >( m_instances.size() );
+        auto perThread = ( nInstances + nThreads - 1 ) / nThreads;
+        std::atomic< int > remaining { nThreads };
+        juce::WaitableEvent finished;
+        juce::ThreadPool pool( nThreads );
+        
+        auto start = juce::Time::getMillisecondCounterHiRes();
+        for ( int t = 0; t < nThreads; t++ )
+        {
+            auto first = t * perThread;
+            auto last = juce::jmin( first + perThread, nInstances );
+            pool.addJob( [ this, first, last, nBlocks, &remaining, &finished ]
+            {
+                juce::AudioBuffer< float > buffer( 2, m_blockSize );
+                juce::MidiBuffer midi;
+                for ( int b = 0; b < nBlocks; b++ )
+                {
+                    for ( auto i = first; i < last; i++ )
+                    {
+                        m_instances[ i ]->processBlock( buffer, midi );
+                        m_playHeads[ i ]->advance( m_blockSize );
+                    }
+                }
+                if ( --remaining == 0 )
+                    finished.signal();
+            } );
+        }
+        finished.wait();
+        return juce::Time::getMillisecondCounterHiRes() - start;
+    }
+    
+    double m_sampleRate;
+    int m_blockSize;
+    std::vector< std::unique_ptr< Sjf_AAIM_DrumsAudioProcessor > > m_instances;
+    std::vector< std::unique_ptr< benchmarkPlayHead > > m_playHeads;
+};
+
+//==============================================================================
+/**
+ Deterministic renders, to check that changes to the clock or the sample loop never move or drop an event.
+ A fresh instance is set up from a seed and the synthetic transport is rendered in blocks of a given size.
+ The AAIM library draws its random numbers from std::rand (through rand01), so that is seeded just
+ before the first block and nothing else in the process may draw from it until the render is done.
+ disturbed is set if any other instance played a block in the meantime.
+ Every midi event is recorded with its absolute sample position and its position in quarter notes.
+*/
+struct goldenSettings
+{
+    uint32_t seed = 1;
+    double bpm = 120, seconds = 8;
+    float complexity = 0.6f, rests = 0.2f, fills = 0.3f, swing = 0.25f;
+};
+
+struct goldenEvent
+{
+    juce::int64 samplePosition;
+    double quarterNotes;
+    std::array< uint8_t, 3 > bytes;
+};
+
+inline std::vector< goldenEvent > renderGolden( const goldenSettings& settings, double sampleRate, int blockSize, bool& disturbed )
+{
+    juce::Random rand( settings.seed );
+    Sjf_AAIM_DrumsAudioProcessor processor;
+    benchmarkPlayHead playHead( settings.bpm, sampleRate );
+    processor.setPlayHead( &playHead );
+    processor.setRateAndBufferSizeDetails( sampleRate, blockSize );
+    processor.prepareToPlay( sampleRate, blockSize );
+    setParameter( processor, "complexity", settings.complexity );
+    setParameter( processor, "rests", settings.rests );
+    setParameter( processor, "fills", settings.fills );
+    setParameter( processor, "swing", 0.5f * ( settings.swing + 1.0f ) );
+    randomisePattern( processor, rand );
+    std::srand( settings.seed );
+    auto blocksPlayed = Sjf_AAIM_DrumsAudioProcessor::getNumBlocksPlayed();
+    uint64_t nBlocks = 0;
+    
+    std::vector< goldenEvent > events;
+    juce::AudioBuffer< float > buffer( 2, blockSize );
+    juce::MidiBuffer midi;
+    auto totalSamples = static_cast< juce::int64 >( settings.seconds * sampleRate );
+    for ( juce::int64 start = 0; start < totalSamples; start += blockSize )
+    {
+        auto nSamples = static_cast< int >( juce::jmin( static_cast< juce::int64 >( blockSize ), totalSamples - start ) );
+        buffer.setSize( 2, nSamples, false, false, true );
+        midi.clear();
+        processor.processBlock( buffer, midi );
+        nBlocks++;
+        for ( const auto metadata : midi )
+        {
+            goldenEvent e { start + metadata.samplePosition, 0, {} };
+            e.quarterNotes = static_cast< double >( e.samplePosition ) * settings.bpm / ( 60.0 * sampleRate );
+            for ( int i = 0; i < metadata.numBytes && i < 3; i++ )
+                e.bytes[ static_cast< size_t >( i ) ] = metadata.data[ i ];
+            events.push_back( e );
+        }
+        playHead.advance( nSamples );
+    }
+    processor.releaseResources();
+    disturbed = Sjf_AAIM_DrumsAudioProcessor::getNumBlocksPlayed() - blocksPlayed != nBlocks;
+    return events;
+}
+
+// one event per line, sample position, quarter notes and the midi bytes
+inline juce::String serialiseGolden( const std::vector< goldenEvent >& events )
+{
+    juce::String text;
+    for ( auto& e : events )
+        text << juce::String( e.samplePosition ) << "\t" << juce::String( e.quarterNotes, 9 ) << "\t"
+            << static_cast< int >( e.bytes[ 0 ] ) << " " << static_cast< int >( e.bytes[ 1 ] ) << " " << static_cast< int >( e.bytes[ 2 ] ) << "\n";
+    return text;
+}
+
+// index of the first event that differs, or -1 if they all match
+// events at different sample rates can't land on exactly the same instant so they may differ by the given amount of time
+inline int firstGoldenDifference( const std::vector< goldenEvent >& a, const std::vector< goldenEvent >& b, double quarterNoteTolerance )
+{
+    for ( size_t i = 0; i < a.size() && i < b.size(); i++ )
+    {
+        auto sameTime = quarterNoteTolerance > 0 ? std::abs( a[ i ].quarterNotes - b[ i ].quarterNotes ) <= quarterNoteTolerance
+                                                 : a[ i ].samplePosition == b[ i ].samplePosition;
+        if ( !sameTime || a[ i ].bytes != b[ i ].bytes )
+            return static_cast< int >( i );
+    }
+    return a.size() == b.size() ? -1 : static_cast< int >( juce::jmin( a.size(), b.size() ) );
+}
+
+/**
+ Renders the same settings with block sizes from 1 to 4096 at sample rates from 44.1 to 192kHz.
+ Every block size must give exactly the same events as 512 samples at the same rate, and every rate
+ must give the same events as 48kHz to within one sample of the lower rate.
+ The 48kHz stream is also kept in a file, if one from an earlier run exists it must match it exactly,
+ that is the check to run before and after changing the clock. Returns a plain text report.
+ The renders share std::rand with everything else in the process, so this refuses to start while
+ a density preview is simulating or any instance is playing, and stops if an instance starts playing
+ before it is done. It can't see anything else in the host that uses std::rand (e.g. another plugin),
+ so a difference found inside a host should be confirmed from a standalone build with no audio running.
+*/
+inline juce::String compareGoldenRenders( const juce::File& goldenFile, const goldenSettings& settings = {} )
+{
+    if ( sjf_densityPreview< NUM_VOICES, MAX_NUM_STEPS, NUM_IOIs >::isRunning() )
+        return "not run, turn the density preview off first so the renders are reproducible\n";
+    if ( Sjf_AAIM_DrumsAudioProcessor::getNumPlaying() > 0 )
+        return "not run, stop playback in every instance first so the renders are reproducible\n";
+    
+    auto disturbed = false;
+    auto stopped = juce::String( "stopped, an instance started playing during the renders so they are not reproducible\n" );
+    
+    static constexpr std::array< int, 14 > blockSizes { 1, 2, 3, 16, 17, 64, 100, 127, 256, 441, 512, 1000, 2048, 4096 };
+    static constexpr std::array< double, 6 > sampleRates { 44100, 48000, 88200, 96000, 176400, 192000 };
+    static constexpr int referenceBlockSize = 512;
+    
+    auto describe = []( const std::vector< goldenEvent >& events, int index )
+    {
+        if ( index >= static_cast< int >( events.size() ) )
+            return juce::String( "(no event)" );
+        return serialiseGolden( { events[ static_cast< size_t >( index ) ] } ).trimEnd();
+    };
+    
+    auto reference = renderGolden( settings, 48000, referenceBlockSize, disturbed );
+    if ( disturbed )
+        return stopped;
+    auto referenceText = serialiseGolden( reference );
+    juce::String report;
+    report << "seed " << static_cast< int >( settings.seed ) << ", " << settings.bpm << " bpm, " << settings.seconds << "s, "
+        << static_cast< int >( reference.size() ) << " events at 48kHz\n";
+    
+    if ( goldenFile.existsAsFile() )
+    {
+        auto golden = goldenFile.loadFileAsString();
+        if ( golden == referenceText )
+            report << "matches " << goldenFile.getFullPathName() << "\n";
+        else
+        {
+            auto goldenLines = juce::StringArray::fromLines( golden ), lines = juce::StringArray::fromLines( referenceText );
+            auto line = 0;
+            while ( line < goldenLines.size() && line < lines.size() && goldenLines[ line ] == lines[ line ] )
+                line++;
+            report << "DIFFERS from " << goldenFile.getFullPathName() << " at event " << line << "\n";
+        }
+    }
+    else
+    {
+        goldenFile.replaceWithText( referenceText );
+        report << "written to " << goldenFile.getFullPathName() << "\n";
+    }
+    
+    auto failures = 0;
+    for ( auto sr : sampleRates )
+    {
+        auto rateReference = renderGolden( settings, sr, referenceBlockSize, disturbed );
+        if ( disturbed )
+            return report + stopped;
+        auto tolerance = settings.bpm / ( 60.0 * juce::jmin( sr, 48000.0 ) );
+        auto diff = firstGoldenDifference( reference, rateReference, tolerance );
+        if ( diff >= 0 )
+        {
+            failures++;
+            report << sr << "Hz differs from 48kHz at event " << diff << ": " << describe( rateReference, diff ) << " vs " << describe( reference, diff ) << "\n";
+        }
+        for ( auto blockSize : blockSizes )
+        {
+            if ( blockSize == referenceBlockSize )
+                continue;
+            auto events = renderGolden( settings, sr, blockSize, disturbed );
+            if ( disturbed )
+                return report + stopped;
+            diff = firstGoldenDifference( rateReference, events, 0 );
+            if ( diff >= 0 )
+            {
+                failures++;
+                report << sr << "Hz, block size " << blockSize << " differs at event " << diff << ": " << describe( events, diff ) << " vs " << describe( rateReference, diff ) << "\n";
+            }
+        }
+    }
+    report << ( failures == 0 ? juce::String( "all block sizes and sample rates identical\n" ) : juce::String( failures ) + " renders differ\n" );
+    return report;
+}
+
+//==============================================================================
+/**
+ Timings of the individual primitives the processor is built from, to see where the time goes
+ before optimising any of them. Each primitive is run at every pattern length and density,
+ density is the chance of a step being on for patterns and the complexity given to the generator.
+ A sample is a batch of calls timed together, with anything that sets the primitive up again done
+ between batches and not timed. After a warm up batch many samples are taken and the median and
+ 10th/90th percentiles reported, which are far steadier than the mean on a busy machine.
+ Everything random is seeded so consecutive builds time exactly the same work.
+*/
+struct microBenchmarkResult
+{
+    juce::String name;
+    size_t nBeats;
+    float density;
+    double medianNs, p10Ns, p90Ns; // per call
+};
+
+template< typename Setup, typename Call >
+inline microBenchmarkResult timePrimitive( const juce::String& name, size_t nBeats, float density, Setup&& setup, Call&& call, int callsPerSample, int nSamples = 101 )
+{
+    std::vector< double > nsPerCall;
+    nsPerCall.reserve( static_cast< size_t >( nSamples ) );
+    for ( int s = -1; s < nSamples; s++ )
+    {
+        setup();
+        auto start = juce::Time::getHighResolutionTicks();
+        for ( int i = 0; i < callsPerSample; i++ )
+            call( i );
+        auto ticks = juce::Time::getHighResolutionTicks() - start;
+        if ( s >= 0 ) // the first batch only warms the caches up
+            nsPerCall.push_back( juce::Time::highResolutionTicksToSeconds( ticks ) * 1.0e9 / callsPerSample );
+    }
+    std::sort( nsPerCall.begin(), nsPerCall.end() );
+    auto n = nsPerCall.size();
+    return { name, nBeats, density, nsPerCall[ n / 2 ], nsPerCall[ n / 10 ], nsPerCall[ n - 1 - n / 10 ] };
+}
+
+inline std::vector< microBenchmarkResult > runMicroBenchmarks()
+{
+    static constexpr std::array< size_t, 4 > nBeatsToTest { 4, 8, 16, 32 };
+    static constexpr std::array< float, 3 > densitiesToTest { 0.1f, 0.4f, 0.8f };
+    static constexpr int fastCalls = 4096; // the generator and pattern calls are too quick to time one at a time
+    
+    std::vector< microBenchmarkResult > results;
+    volatile double sink = 0; // keeps the compiler from removing calls whose results aren't otherwise used
+    
+    Sjf_AAIM_DrumsAudioProcessor processor;
+    processor.setRateAndBufferSizeDetails( 48000, 256 );
+    processor.prepareToPlay( 48000, 256 );
+    
+    for ( auto nBeats : nBeatsToTest )
+    {
+        for ( auto density : densitiesToTest )
+        {
+            juce::Random rand( 1 );
+            std::srand( 1 );
+            auto noSetup = []{};
+            
+            AAIM_rhythmGen< float > gen;
+            gen.setNumBeats( nBeats );
+            gen.setComplexity( density );
+            gen.setRests( 0.2f );
+            auto beatIncrement = static_cast< float >( nBeats ) / static_cast< float >( fastCalls );
+            results.push_back( timePrimitive( "rhythmGen::runGenerator", nBeats, density, noSetup, [ & ]( int i )
+            {
+                sink = sink + gen.runGenerator( static_cast< float >( i ) * beatIncrement )[ 1 ];
+            }, fastCalls ) );
+            results.push_back( timePrimitive( "rhythmGen::setNumBeats", nBeats, density, noSetup, [ & ]( int i )
+            {
+                gen.setNumBeats( ( i & 1 ) ? nBeats : nBeats / 2 );
+            }, fastCalls ) );
+            results.push_back( timePrimitive( "rhythmGen::setComplexity", nBeats, density, noSetup, [ & ]( int i )
+            {
+                gen.setComplexity( ( i & 1 ) ? density : density * 0.5f );
+            }, fastCalls ) );
+            results.push_back( timePrimitive( "rhythmGen::setRests", nBeats, density, noSetup, [ & ]( int i )
+            {
+                gen.setRests( ( i & 1 ) ? density : density * 0.5f );
+            }, fastCalls ) );
+            
+            AAIM_patternVary< float > vary;
+            vary.setNumBeats( nBeats );
+            for ( size_t j = 0; j < nBeats; j++ )
+                vary.setBeat( j, rand.nextFloat() < density );
+            vary.setFills( 0.5f );
+            results.push_back( timePrimitive( "patternVary::triggerBeat", nBeats, density, noSetup, [ & ]( int i )
+            {
+                sink = sink + vary.triggerBeat( static_cast< float >( i ) * beatIncrement, 0.5f );
+            }, fastCalls ) );
+            results.push_back( timePrimitive( "patternVary::setBeat", nBeats, density, noSetup, [ & ]( int i )
+            {
+                vary.setBeat( static_cast< size_t >( i ) % nBeats, ( i & 3 ) == 0 );
+            }, fastCalls ) );
+            results.push_back( timePrimitive( "patternVary::setFills", nBeats, density, noSetup, [ & ]( int i )
+            {
+                vary.setFills( ( i & 1 ) ? density : density * 0.5f );
+            }, fastCalls ) );
+            
+            results.push_back( timePrimitive( "applySwingToPosition", nBeats, density, noSetup, [ & ]( int i )
+            {
+                sink = sink + Sjf_AAIM_DrumsAudioProcessor::applySwingToPosition( static_cast< double >( i ) * beatIncrement, 1.0f + density );
+            }, fastCalls ) );
+            
+            // every bank with this length and density, a bank change swaps between 0 and 1
+            fillAllBanks( processor, rand, density, nBeats );
+            auto bank = 0;
+            results.push_back( timePrimitive( "selectPatternBank", nBeats, density, [ & ]
+            {
+                bank = 1 - bank;
+                setBankParameter( processor, bank );
+            }, [ & ]( int ){ processor.selectPatternBank(); }, 1 ) );
+            
+            // the variations change the pattern they work on, so each call starts from a fresh one
+            auto resetPattern = [ & ]
+            {
+                processor.setNumBeats( static_cast< int >( nBeats ) );
+                randomisePattern( processor, rand, density );
+            };
+            std::array< std::pair< const char*, std::function< void() > >, 7 > variations
+            {{
+                { "reversePattern", [ & ]{ processor.reversePattern(); } },
+                { "markovHorizontal", [ & ]{ processor.markovHorizontal(); } },
+                { "cellShuffleVariation", [ & ]{ processor.cellShuffleVariation(); } },
+                { "palindromeVariation", [ & ]{ processor.palindromeVariation(); } },
+                { "doublePattern", [ & ]{ processor.doublePattern(); } },
+                { "rotatePattern left", [ & ]{ processor.rotatePattern( true ); } },
+                { "rotatePattern right", [ & ]{ processor.rotatePattern( false ); } }
+            }};
+            for ( auto& [ name, variation ] : variations )
+                results.push_back( timePrimitive( name, nBeats, density, resetPattern, [ & ]( int ){ variation(); }, 1 ) );
+        }
+    }
+    processor.releaseResources();
+    return results;
+}
+
+// one result per line, tab separated with a header line, so runs from two builds can be diffed or read back
+inline juce::String serialiseMicroBenchmarks( const std::vector< microBenchmarkResult >& results )
+{
+    juce::String text( "primitive\tnBeats\tdensity\tmedian ns\tp10 ns\tp90 ns\n" );
+    for ( auto& r : results )
+        text << r.name << "\t" << static_cast< int >( r.nBeats ) << "\t" << juce::String( r.density, 2 ) << "\t"
+            << juce::String( r.medianNs, 1 ) << "\t" << juce::String( r.p10Ns, 1 ) << "\t" << juce::String( r.p90Ns, 1 ) << "\n";
+    return text;
+}
+
+/**
+ Runs the suite and compares each median with the same primitive in the baseline file, a change is
+ only flagged when the new median is outside the baseline's 10th-90th percentile range.
+ If there is no baseline yet this run becomes it, otherwise this run is written next to it
+ (with "_latest" added to the name) so it can be diffed or copied over the baseline.
+*/
+inline juce::String compareMicroBenchmarks( const juce::File& baselineFile )
+{
+    auto results = runMicroBenchmarks();
+    auto text = serialiseMicroBenchmarks( results );
+    if ( !baselineFile.existsAsFile() )
+    {
+        baselineFile.replaceWithText( text );
+        return "baseline written to " + baselineFile.getFullPathName() + "\n\n" + text;
+    }
+    
+    std::map< juce::String, std::array< double, 3 > > baseline; // keyed by the first three columns
+    auto lines = juce::StringArray::fromLines( baselineFile.loadFileAsString() );
+    for ( int i = 1; i < lines.size(); i++ )
+    {
+        auto columns = juce::StringArray::fromTokens( lines[ i ], "\t", "" );
+        if ( columns.size() == 6 )
+            baseline[ columns[ 0 ] + "\t" + columns[ 1 ] + "\t" + columns[ 2 ] ] = { columns[ 3 ].getDoubleValue(), columns[ 4 ].getDoubleValue(), columns[ 5 ].getDoubleValue() };
+    }
+    
+    auto latestFile = baselineFile.getSiblingFile( baselineFile.getFileNameWithoutExtension() + "_latest" + baselineFile.getFileExtension() );
+    latestFile.replaceWithText( text );
+    juce::String report;
+    report << "compared with " << baselineFile.getFullPathName() << ", this run is in " << latestFile.getFullPathName() << "\n"
+        << "primitive\tnBeats\tdensity\tmedian ns\tbaseline ns\tratio\n";
+    auto nSlower = 0, nFaster = 0;
+    for ( auto& r : results )
+    {
+        auto key = r.name + "\t" + juce::String( static_cast< int >( r.nBeats ) ) + "\t" + juce::String( r.density, 2 );
+        report << key << "\t" << juce::String( r.medianNs, 1 );
+        auto found = baseline.find( key );
+        if ( found == baseline.end() )
+        {
+            report << "\t-\tnew\n";
+            continue;
+        }
+        auto [ median, p10, p90 ] = found->second;
+        report << "\t" << juce::String( median, 1 ) << "\t" << juce::String( median > 0 ? r.medianNs / median : 0, 2 );
+        if ( r.medianNs > p90 )
+        {
+            nSlower++;
+            report << "\tSLOWER";
+        }
+        else if ( r.medianNs < p10 )
+        {
+            nFaster++;
+            report << "\tfaster";
+        }
+        report << "\n";
+    }
+    report << nSlower << " slower and " << nFaster << " faster than the baseline\n";
+    return report;
+}
+
+//==============================================================================
+/**
+ Times what opening a large template costs for each instance: constructing it, restoring a saved
+ state into it and opening its editor. The state has every bank filled so it restores as slowly
+ as a real session's would. The first of each is shown on its own as it also pays for anything
+ made once and shared between instances, e.g. the state's property names and the editor's logo.
+ Editors can only be made on the message thread, so call this from there.
+*/
+inline juce::String runStartupBenchmark( int nInstances = 200, int nEditors = 20 )
+{
+    juce::MemoryBlock state;
+    {
+        juce::Random rand( 1 );
+        Sjf_AAIM_DrumsAudioProcessor processor;
+        fillAllBanks( processor, rand );
+        processor.getStateInformation( state );
+    }
+    
+    auto timeMs = []( auto&& f )
+    {
+        auto start = juce::Time::getMillisecondCounterHiRes();
+        f();
+        return juce::Time::getMillisecondCounterHiRes() - start;
+    };
+    std::vector< std::unique_ptr< Sjf_AAIM_DrumsAudioProcessor > > instances;
+    instances.reserve( static_cast< size_t >( nInstances ) );
+    std::vector< double > constructMs, restoreMs, editorMs;
+    for ( int i = 0; i < nInstances; i++ )
+        constructMs.push_back( timeMs( [ & ]{ instances.push_back( std::make_unique< Sjf_AAIM_DrumsAudioProcessor >() ); } ) );
+    for ( auto& p : instances )
+        restoreMs.push_back( timeMs( [ & ]{ p->setStateInformation( state.getData(), static_cast< int >( state.getSize() ) ); } ) );
+    for ( int e = 0; e < nEditors && !instances.empty(); e++ )
+    {
+        std::unique_ptr< juce::AudioProcessorEditor > editor;
+        editorMs.push_back( timeMs( [ & ]{ editor.reset( instances[ static_cast< size_t >( e ) % instances.size() ]->createEditor() ); } ) );
+    }
+    
+    juce::String report;
+    report << "instances: " << nInstances << ", editors: " << nEditors << ", state: " << static_cast< int >( state.getSize() ) << " bytes\n"
+        << "stage\tfirst ms\tmedian ms\ttotal ms\n";
+    auto addLine = [ &report ]( const juce::String& name, std::vector< double > ms )
+    {
+        if ( ms.empty() )
+            return;
+        auto first = ms.front();
+        auto total = std::accumulate( ms.begin(), ms.end(), 0.0 );
+        std::sort( ms.begin(), ms.end() );
+        report << name << "\t" << juce::String( first, 3 ) << "\t" << juce::String( ms[ ms.size() / 2 ], 3 ) << "\t" << juce::String( total, 1 ) << "\n";
+    };
+    addLine( "construct", constructMs );
+    addLine( "restore state", restoreMs );
+    addLine( "open editor", editorMs );
+    return report;
+}
+
+//==============================================================================
+/**
+ Measures every pattern in a library file with the metrics the editor shows and writes them to
+ outputFile, one tab separated line per pattern with the kit's values and then each voice's, so a
+ corpus can be sorted or filtered for curation. Each pattern only costs the steps that differ from
+ the one before it. Returns a summary with the average of the kit's values.
+*/
+inline juce::String analysePatternLibrary( const juce::File& libraryFile, const juce::File& outputFile )
+{
+    auto library = sjf_patternLibraryFile::open( libraryFile );
+    if ( library == nullptr )
+        return "couldn't open a pattern library from " + libraryFile.getFullPathName() + "\n";
+    outputFile.deleteFile();
+    juce::FileOutputStream stream( outputFile );
+    if ( !stream.openedOk() )
+        return "couldn't write to " + outputFile.getFullPathName() + "\n";
+    
+    using metricValues = Sjf_AAIM_DrumsAudioProcessor::rhythmMetrics::values;
+    Sjf_AAIM_DrumsAudioProcessor::rhythmMetrics metrics;
+    auto& metres = Sjf_AAIM_DrumsAudioProcessor::getMetres();
+    for ( size_t n = 1; n <= MAX_NUM_STEPS; n++ )
+        metrics.setMetre( n, metres[ n ] );
+    auto columns = []( const metricValues& v )
+    {
+        return "\t" + juce::String( v.density, 3 ) + "\t" + juce::String( v.syncopation, 3 ) + "\t" + juce::String( v.evenness, 3 ) + "\t" + juce::String( v.overlap, 3 );
+    };
+    
+    juce::String header( "pattern\tnBeats\tdivision\tdensity\tsyncopation\tevenness\toverlap" );
+    for ( int i = 1; i <= NUM_VOICES; i++ )
+        for ( auto name : { "density", "syncopation", "evenness", "overlap" } )
+            header << "\tvoice" << i << " " << name;
+    stream.writeText( header + "\n", false, false, nullptr );
+    metricValues sum;
+    for ( size_t r = 0; r < library->size(); r++ )
+    {
+        auto record = library->getRecord( r );
+        for ( size_t i = 0; i < NUM_VOICES; i++ )
+            metrics.setVoice( i, record->voices[ i ], record->nBeats );
+        auto kit = metrics.getKit();
+        sum.density += kit.density;
+        sum.syncopation += kit.syncopation;
+        sum.evenness += kit.evenness;
+        sum.overlap += kit.overlap;
+        auto line = juce::String( static_cast< int >( r ) ) + "\t" + juce::String( static_cast< int >( record->nBeats ) ) + "\t" + juce::String( static_cast< int >( record->division ) ) + columns( kit );
+        for ( size_t i = 0; i < NUM_VOICES; i++ )
+            line << columns( metrics.getVoice( i ) );
+        stream.writeText( line + "\n", false, false, nullptr );
+    }
+    stream.flush();
+    
+    auto n = static_cast< float >( juce::jmax< size_t >( 1, library->size() ) );
+    juce::String report;
+    report << static_cast< int >( library->size() ) << " patterns from " << libraryFile.getFileName() << " written to " << outputFile.getFullPathName() << "\n"
+        << "average kit density " << juce::String( sum.density / n, 3 ) << ", syncopation " << juce::String( sum.syncopation / n, 3 )
+        << ", evenness " << juce::String( sum.evenness / n, 3 ) << ", overlap " << juce::String( sum.overlap / n, 3 ) << "\n";
+    return report;
+}
+
+#if SJF_AAIM_RT_AUDIT
+//==============================================================================
+/**
+ Plays an instance the way a busy session would while every allocation, deallocation and lock
+ of the plugin's own made inside processBlock is recorded: parameters are swept continuously, the bank is switched, the pattern
+ is edited with the variations between blocks and midi input switches banks, mutes, fills and
+ restarts. Whatever the host does between blocks isn't audited, only the processing.
+ The violation log is cleared first, returns the report.
+*/
+inline juce::String runRealtimeAudit( double secondsOfAudio = 30, double sampleRate = 48000, int blockSize = 256 )
+{
+    juce::Random rand( 1 );
+    Sjf_AAIM_DrumsAudioProcessor processor;
+    benchmarkPlayHead playHead( 120, sampleRate );
+    processor.setPlayHead( &playHead );
+    processor.setRateAndBufferSizeDetails( sampleRate, blockSize );
+    processor.prepareToPlay( sampleRate, blockSize );
+    fillAllBanks( processor, rand );
+    
+    juce::AudioBuffer< float > buffer( 2, blockSize );
+    juce::MidiBuffer midi;
+    midi.ensureSize( 8192 ); // hosts preallocate their midi buffers too
+    auto nBlocks = static_cast< int >( secondsOfAudio * sampleRate / blockSize );
+    sjf_rtAudit::reset();
+    for ( int b = 0; b < nBlocks; b++ )
+    {
+        // the host's side, between blocks
+        auto phase = juce::MathConstants< double >::twoPi * b / 500.0;
+        setParameter( processor, "complexity", static_cast< float >( 0.5 + 0.5 * std::sin( phase ) ) );
+        setParameter( processor, "rests", static_cast< float >( 0.25 + 0.25 * std::sin( phase * 1.3 ) ) );
+        setParameter( processor, "fills", static_cast< float >( 0.5 + 0.5 * std::cos( phase * 0.7 ) ) );
+        setParameter( processor, "swing", static_cast< float >( 0.5 + 0.5 * std::sin( phase * 0.4 ) ) );
+        if ( b % 37 == 0 )
+            setBankParameter( processor, rand.nextInt( NUM_BANKS ) );
+        if ( b % 53 == 0 )
+        {
+            switch ( rand.nextInt( 4 ) )
+            {
+                case 0: processor.reversePattern(); break;
+                case 1: processor.markovHorizontal(); break;
+                case 2: processor.cellShuffleVariation(); break;
+                default: processor.rotatePattern( rand.nextBool() ); break;
+            }
+        }
+        midi.clear();
+        if ( b % 41 == 0 )
+        {
+            auto at = rand.nextInt( blockSize );
+            midi.addEvent( juce::MidiMessage::noteOn( 1, sjf_midiControl::FIRST_BANK_NOTE + rand.nextInt( NUM_BANKS ), static_cast< juce::uint8 >( 100 ) ), at );
+            midi.addEvent( juce::MidiMessage::noteOn( 1, sjf_midiControl::FIRST_MUTE_NOTE + rand.nextInt( NUM_VOICES ), static_cast< juce::uint8 >( 100 ) ), at );
+            midi.addEvent( juce::MidiMessage::noteOn( 1, sjf_midiControl::FILL_NOTE, static_cast< juce::uint8 >( 100 ) ), at );
+            midi.addEvent( juce::MidiMessage::noteOff( 1, sjf_midiControl::FILL_NOTE ), juce::jmin( blockSize - 1, at + 10 ) );
+        }
+        if ( b % 97 == 0 )
+            midi.addEvent( juce::MidiMessage::noteOn( 1, sjf_midiControl::RESTART_NOTE, static_cast< juce::uint8 >( 100 ) ), rand.nextInt( blockSize ) );
+        
+        {
+            sjf_rtAudit::scopedAudioThread audit;
+            processor.processBlock( buffer, midi );
+        }
+        playHead.advance( blockSize );
+    }
+    processor.releaseResources();
+    return juce::String( nBlocks ) + " blocks of " + juce::String( blockSize ) + " samples at " + juce::String( sampleRate ) + "Hz\n"
+        + sjf_rtAudit::getReport();
+}
+#endif
+}
+
+#endif
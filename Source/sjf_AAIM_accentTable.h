@@ -0,0 +1,97 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_accentTable.h
+    Per voice, per step accents applied to the generator's velocity
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+
+//==============================================================================
+/**
+ Each voice has an accent map, a velocity scale and offset for every step plus a random range,
+ and a bank holds one map per voice. When the bank or a map changes the maps are flattened into
+ NVOICES x NSTEPS tables so that at an onset every voice's velocity is gathered from its current
+ step and resolved with a handful of vector operations, velocity * scale + offset + random, rather
+ than arithmetic for each note. Until an accent is set the table is neutral and resolve is a fill.
+*/
+template< size_t NVOICES, size_t NSTEPS >
+class sjf_accentTable
+{
+public:
+    struct voiceAccents
+    {
+        voiceAccents(){ scale.fill( 1.0f ); offset.fill( 0.0f ); }
+        bool isNeutral() const
+        {
+            for ( size_t i = 0; i < NSTEPS; i++ )
+                if ( scale[ i ] != 1.0f || offset[ i ] != 0.0f )
+                    return false;
+            return randomRange == 0.0f;
+        }
+        bool operator==( const voiceAccents& other ) const
+        {
+            return scale == other.scale && offset == other.offset && randomRange == other.randomRange;
+        }
+
+        std::array< float, NSTEPS > scale, offset;
+        float randomRange = 0;
+    };
+    using bankAccents = std::array< voiceAccents, NVOICES >;
+
+    sjf_accentTable(){ build( bankAccents() ); }
+    ~sjf_accentTable(){}
+
+    void build( const bankAccents& accents )
+    {
+        m_neutral = true;
+        m_hasRandom = false;
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            std::copy( accents[ v ].scale.begin(), accents[ v ].scale.end(), m_scale.begin() + v * NSTEPS );
+            std::copy( accents[ v ].offset.begin(), accents[ v ].offset.end(), m_offset.begin() + v * NSTEPS );
+            m_randomRange[ v ] = accents[ v ].randomRange;
+            m_neutral = m_neutral && accents[ v ].isNeutral();
+            m_hasRandom = m_hasRandom || accents[ v ].randomRange != 0.0f;
+        }
+    }
+
+    // audio thread, writes every voice's velocity for an onset, steps is each voice's current step
+    void resolve( float velocity, const std::array< size_t, NVOICES >& steps, std::array< float, NVOICES >& velocities, juce::Random& rand )
+    {
+        if ( m_neutral )
+        {
+            velocities.fill( velocity );
+            return;
+        }
+        // the gather is the only part done per voice
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            auto index = v * NSTEPS + ( steps[ v ] < NSTEPS ? steps[ v ] : NSTEPS - 1 );
+            velocities[ v ] = m_scale[ index ];
+            m_gathered[ v ] = m_offset[ index ];
+        }
+        auto n = static_cast< int >( NVOICES );
+        juce::FloatVectorOperations::multiply( velocities.data(), velocity, n );
+        juce::FloatVectorOperations::add( velocities.data(), m_gathered.data(), n );
+        if ( m_hasRandom )
+        {
+            for ( size_t v = 0; v < NVOICES; v++ )
+                m_gathered[ v ] = rand.nextFloat() * 2.0f - 1.0f;
+            juce::FloatVectorOperations::multiply( m_gathered.data(), m_randomRange.data(), n );
+            juce::FloatVectorOperations::add( velocities.data(), m_gathered.data(), n );
+        }
+        // a velocity of 0 would be a note off
+        juce::FloatVectorOperations::clip( velocities.data(), velocities.data(), 1.0f / 127.0f, 1.0f, n );
+    }
+
+private:
+    alignas( 64 ) std::array< float, NVOICES * NSTEPS > m_scale, m_offset;
+    alignas( 64 ) std::array< float, NVOICES > m_randomRange, m_gathered;
+    bool m_neutral = true, m_hasRandom = false;
+};
@@ -0,0 +1,201 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_bankChain.h
+    An arrangement of pattern banks, resolved into a bank for every bar
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <utility>
+#include <cstdint>
+
+//==============================================================================
+/**
+ A chain is written as a list of entries such as "0x4 1x2r 0x3 2", each one a bank, how many
+ bars it plays for (one if left out) and optionally a variation applied as it starts, one of
+ r(everse) m(arkov) s(huffle) p(alindrome) d(ouble) < (rotate left) or > (rotate right).
+ The whole chain is laid out bar by bar when it is set, so finding what plays in any bar,
+ including after the host jumps or loops, is a single lookup. The chain repeats after its last bar.
+ Chains are built and parsed on the message thread, the audio thread only calls getBar and applyVariation.
+*/
+class sjf_bankChain
+{
+public:
+    static constexpr int MAX_BARS = 1024, MAX_REPEATS = 256;
+    static constexpr const char* VARIATION_SYMBOLS = "rmspd<>"; // in the order of sjf_midiControl's variation notes
+    enum variations { reverse, markov, shuffle, palindrome, doubled, rotateLeft, rotateRight };
+
+    struct bar
+    {
+        int8_t bank = 0;
+        int8_t variation = -1;  // only set on the first bar of an entry
+        bool entryStart = false;
+    };
+
+    sjf_bankChain(){}
+    ~sjf_bankChain(){}
+
+    // returns false, leaving the chain as it was, if the text isn't a valid chain or is too long
+    bool set( const juce::String& text, int nBanks )
+    {
+        std::array< bar, MAX_BARS > bars;
+        auto nBars = 0;
+        auto tokens = juce::StringArray::fromTokens( text.replaceCharacter( ',', ' ' ), " ", "" );
+        tokens.removeEmptyStrings();
+        for ( auto& token : tokens )
+        {
+            auto variation = -1;
+            auto body = token;
+            auto symbol = juce::String( VARIATION_SYMBOLS ).indexOfChar( token.getLastCharacter() );
+            if ( symbol >= 0 )
+            {
+                variation = symbol;
+                body = token.dropLastCharacters( 1 );
+            }
+            auto bankText = body.upToFirstOccurrenceOf( "x", false, true );
+            auto repeatText = body.fromFirstOccurrenceOf( "x", false, true );
+            if ( !bankText.containsOnly( "0123456789" ) || bankText.isEmpty() || !repeatText.containsOnly( "0123456789" ) )
+                return false;
+            auto bank = bankText.getIntValue();
+            auto repeats = repeatText.isEmpty() ? 1 : repeatText.getIntValue();
+            if ( bank >= nBanks || repeats < 1 || repeats > MAX_REPEATS || nBars + repeats > MAX_BARS )
+                return false;
+            for ( int r = 0; r < repeats; r++ )
+            {
+                auto& b = bars[ static_cast< size_t >( nBars + r ) ];
+                b.bank = static_cast< int8_t >( bank );
+                b.variation = static_cast< int8_t >( r == 0 ? variation : -1 );
+                b.entryStart = r == 0;
+            }
+            nBars += repeats;
+        }
+        if ( nBars == 0 )
+            return false;
+        m_bars = bars;
+        m_nBars = nBars;
+        m_text = tokens.joinIntoString( " " );
+        return true;
+    }
+
+    // any bar index, negative ones count back from the end of the chain
+    const bar& getBar( int64_t barIndex ) const
+    {
+        auto i = barIndex % m_nBars;
+        return m_bars[ static_cast< size_t >( i < 0 ? i + m_nBars : i ) ];
+    }
+
+    int getNumBars() const { return m_nBars; }
+    const juce::String& getText() const { return m_text; }
+
+    /**
+     Varies the words a bank is playing with, each voice within its own length, for as long as the entry plays,
+     the bank itself is left as it is stored. Double and palindrome keep the length, the first half is repeated
+     or mirrored onto the second, so the generator doesn't have to change at the bar line.
+     metres holds the indispensability for each length, shuffle moves the cells that start on its strongest steps
+     and voices of the same length are shuffled the same way. Nothing is allocated.
+    */
+    template< size_t NVOICES, typename Metres >
+    static void applyVariation( int variation, std::array< uint32_t, NVOICES >& words, const std::array< size_t, NVOICES >& lengths, const Metres& metres, juce::Random& random )
+    {
+        auto seed = random.nextInt64();
+        for ( size_t i = 0; i < NVOICES; i++ )
+        {
+            auto n = lengths[ i ] < 1 ? 1 : lengths[ i ] > 32 ? 32 : lengths[ i ];
+            auto word = words[ i ] & lengthMask( n );
+            uint32_t varied = 0;
+            switch ( variation )
+            {
+                case reverse:
+                    for ( size_t s = 0; s < n; s++ )
+                        varied |= ( ( word >> s ) & 1u ) << ( n - 1 - s );
+                    break;
+                case markov:
+                    varied = markovWord( word, n, random );
+                    break;
+                case shuffle:
+                {
+                    juce::Random cellRandom( seed + static_cast< juce::int64 >( n ) );
+                    varied = shuffleWord( word, n, metres[ n ], cellRandom );
+                    break;
+                }
+                case palindrome:
+                    varied = word;
+                    for ( size_t s = 0; s < n / 2; s++ )
+                        varied = ( varied & ~( 1u << ( n - 1 - s ) ) ) | ( ( ( word >> s ) & 1u ) << ( n - 1 - s ) );
+                    break;
+                case doubled:
+                    varied = word & lengthMask( n / 2 );
+                    for ( size_t s = 0; s < n - n / 2; s++ )
+                        varied |= ( ( word >> s ) & 1u ) << ( n / 2 + s );
+                    break;
+                case rotateLeft:
+                    varied = ( word >> 1 ) | ( ( word & 1u ) << ( n - 1 ) );
+                    break;
+                case rotateRight:
+                    varied = ( ( word << 1 ) | ( word >> ( n - 1 ) ) ) & lengthMask( n );
+                    break;
+                default:
+                    varied = word;
+                    break;
+            }
+            words[ i ] = varied;
+        }
+    }
+
+private:
+    static uint32_t lengthMask( size_t length ){ return length >= 32 ? ~0u : ( 1u << length ) - 1u; }
+
+    // a new word from the chances of an onset or a rest following each other in this one, as markovHorizontal
+    static uint32_t markovWord( uint32_t word, size_t n, juce::Random& random )
+    {
+        int transitions[ 2 ][ 2 ] = { { 0, 0 }, { 0, 0 } };
+        for ( size_t s = 0; s < n; s++ )
+            transitions[ ( word >> s ) & 1u ][ ( word >> ( ( s + 1 ) % n ) ) & 1u ] += 1;
+        auto toRest = transitions[ 0 ][ 0 ] + transitions[ 1 ][ 0 ], toOnset = transitions[ 0 ][ 1 ] + transitions[ 1 ][ 1 ];
+        auto trig = !( random.nextFloat() * static_cast< float >( toRest + toOnset ) < static_cast< float >( toRest ) );
+        uint32_t varied = 0;
+        for ( size_t s = 0; s < n; s++ )
+        {
+            varied |= static_cast< uint32_t >( trig ) << s;
+            auto& row = transitions[ trig ? 1 : 0 ];
+            trig = !( random.nextFloat() * static_cast< float >( row[ 0 ] + row[ 1 ] ) < static_cast< float >( row[ 0 ] ) );
+        }
+        return varied;
+    }
+
+    // cells start on the first step and on every step more indispensable than those either side, as cellShuffleVariation
+    template< typename Metre >
+    static uint32_t shuffleWord( uint32_t word, size_t n, const Metre& metre, juce::Random& random )
+    {
+        std::array< size_t, 33 > starts;
+        size_t nCells = 0;
+        starts[ nCells++ ] = 0;
+        for ( size_t s = 1; s + 1 < n && s + 1 < metre.size(); s++ )
+            if ( metre[ s ] > metre[ s - 1 ] && metre[ s ] > metre[ s + 1 ] )
+                starts[ nCells++ ] = s;
+        starts[ nCells ] = n;
+        std::array< size_t, 32 > order;
+        for ( size_t c = 0; c < nCells; c++ )
+            order[ c ] = c;
+        for ( size_t c = nCells - 1; c > 0; c-- )
+            std::swap( order[ c ], order[ static_cast< size_t >( random.nextInt( static_cast< int >( c + 1 ) ) ) ] );
+        uint32_t varied = 0;
+        size_t position = 0;
+        for ( size_t c = 0; c < nCells; c++ )
+        {
+            auto start = starts[ order[ c ] ], length = starts[ order[ c ] + 1 ] - start;
+            varied |= ( ( word >> start ) & lengthMask( length ) ) << position;
+            position += length;
+        }
+        return varied;
+    }
+
+    std::array< bar, MAX_BARS > m_bars;
+    int m_nBars = 1;
+    juce::String m_text { "0" };
+};
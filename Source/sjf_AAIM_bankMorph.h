@@ -0,0 +1,100 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_bankMorph.h
+    Probabilistic blending of two pattern banks with packed step masks
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+//==============================================================================
+/**
+ Blends bank A into bank B one step at a time, the least indispensable steps of the metre go
+ over first so the downbeats hold on to bank A the longest. Each voice has its own random
+ jitter on top of that order, so voices cross over at slightly different morph amounts, but a
+ step that has gone over to B stays there for every larger morph amount.
+
+ The order for every pattern length is worked out once up front. Whenever the banks or the
+ length change, makeMasks turns it into one word per voice for each of NUM_LEVELS morph amounts,
+ with bit s set when step s plays from bank B, and blending a voice is then
+ (A & ~mask) | (B & mask) however the morph is swept.
+*/
+template< size_t NVOICES, size_t NSTEPS >
+class sjf_bankMorph
+{
+public:
+    static constexpr size_t NUM_LEVELS = 65;
+    static_assert( NSTEPS <= 32, "steps are packed into 32 bit words" );
+    using words = std::array< uint32_t, NVOICES >;
+
+    sjf_bankMorph()
+    {
+        for ( auto& r : m_ranks )
+            for ( size_t s = 0; s < NSTEPS; s++ )
+                r[ s ] = static_cast< uint8_t >( s );
+        for ( auto& m : m_masks )
+            m.fill( 0 );
+    }
+    ~sjf_bankMorph(){}
+
+    // message thread, indispensability of each step of a pattern nBeats long, most important highest
+    template< typename Container >
+    void setOrdering( size_t nBeats, const Container& indispensability )
+    {
+        if ( nBeats == 0 || nBeats > NSTEPS )
+            return;
+        std::array< uint8_t, NSTEPS > order;
+        for ( size_t s = 0; s < NSTEPS; s++ )
+            order[ s ] = static_cast< uint8_t >( s );
+        auto weight = [ & ]( size_t s ){ return s < indispensability.size() ? static_cast< double >( indispensability[ s ] ) : 0.0; };
+        std::sort( order.begin(), order.begin() + static_cast< long >( nBeats ), [ & ]( uint8_t a, uint8_t b )
+        {
+            return weight( a ) != weight( b ) ? weight( a ) < weight( b ) : a > b;
+        } );
+        for ( size_t r = 0; r < nBeats; r++ )
+            m_ranks[ nBeats ][ order[ r ] ] = static_cast< uint8_t >( r );
+    }
+
+    // audio thread, a new set of masks for patterns nBeats long
+    void makeMasks( size_t nBeats, juce::Random& rand )
+    {
+        nBeats = juce::jlimit< size_t >( 1, NSTEPS, nBeats );
+        for ( auto& m : m_masks )
+            m.fill( 0 );
+        // each step goes over at the first level past its place in the order
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            for ( size_t s = 0; s < nBeats; s++ )
+            {
+                auto threshold = ( static_cast< float >( m_ranks[ nBeats ][ s ] ) + rand.nextFloat() ) / static_cast< float >( nBeats );
+                auto level = juce::jmin( NUM_LEVELS - 1, static_cast< size_t >( threshold * static_cast< float >( NUM_LEVELS - 1 ) ) + 1 );
+                m_masks[ level ][ v ] |= 1u << s;
+            }
+        }
+        for ( size_t l = 1; l < NUM_LEVELS; l++ )
+            for ( size_t v = 0; v < NVOICES; v++ )
+                m_masks[ l ][ v ] |= m_masks[ l - 1 ][ v ];
+    }
+
+    static size_t getLevel( float morph )
+    {
+        return static_cast< size_t >( juce::jlimit( 0.0f, 1.0f, morph ) * static_cast< float >( NUM_LEVELS - 1 ) + 0.5f );
+    }
+
+    uint32_t blend( uint32_t a, uint32_t b, size_t level, size_t voice ) const
+    {
+        auto mask = m_masks[ level ][ voice ];
+        return ( a & ~mask ) | ( b & mask );
+    }
+
+private:
+    std::array< std::array< uint8_t, NSTEPS >, NSTEPS + 1 > m_ranks;
+    std::array< words, NUM_LEVELS > m_masks;
+};
@@ -0,0 +1,293 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_densityPreview.h
+    Monte-Carlo estimate of how often each step plays with the current settings
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "sjf_AAIM_rtAudit.h"
+#include "sjf_AAIM_tripleBuffer.h"
+#include "../sjf_AAIM_Cplusplus/sjf_AAIM_rhythmGen.h"
+#include "../sjf_AAIM_Cplusplus/sjf_AAIM_patternVary.h"
+#include <array>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+//==============================================================================
+/**
+ Background workers, each with their own generator and pattern variation objects, simulate
+ bars with the current settings and count per voice and step how often a trigger is output and
+ with what velocity. Whenever the settings change the workers start again, results are published
+ after every few bars so the display converges while it is being watched. Each publish is a
+ complete copy of a worker's counts handed over through a triple buffer, so a result never mixes
+ two publishes of the same worker.
+ The AAIM generators draw from the global std::rand and take no generator of their own, so the
+ workers share that state with the audio thread. They run at low priority, and anything that
+ needs reproducible output can check isRunning() first.
+*/
+template< size_t NVOICES, size_t NSTEPS, size_t NIOIS >
+class sjf_densityPreview
+{
+public:
+    struct settings
+    {
+        float complexity = 0, rests = 0, fills = 0;
+        size_t nBeats = 0;
+        std::array< uint32_t, NVOICES > pattern{};
+        std::array< float, NIOIS > ioiProbabilities{};
+
+        bool operator==( const settings& other ) const
+        {
+            return complexity == other.complexity && rests == other.rests && fills == other.fills && nBeats == other.nBeats
+                && pattern == other.pattern && ioiProbabilities == other.ioiProbabilities;
+        }
+        bool operator!=( const settings& other ) const { return !( *this == other ); }
+    };
+
+    struct result
+    {
+        // probability of at least one trigger on a step per bar, mean and standard deviation of the velocity of those triggers
+        std::array< std::array< float, NSTEPS >, NVOICES > probability{}, meanVelocity{}, velocityDeviation{};
+        size_t nBeats = 0;
+        uint32_t nBars = 0;
+    };
+
+    sjf_densityPreview( const std::array< float, NIOIS >& ioiFactors, int nWorkers, uint32_t barsToSimulate = 4096 )
+    : m_ioiFactors( ioiFactors )
+    {
+        nWorkers = juce::jmax( 1, nWorkers );
+        for ( int i = 0; i < nWorkers; i++ )
+            m_workers.push_back( std::make_unique< worker >( *this, barsToSimulate / static_cast< uint32_t >( nWorkers ) ) );
+    }
+
+    ~sjf_densityPreview()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        if ( m_running )
+            return;
+        m_running = true;
+        s_nRunning++;
+        for ( auto& w : m_workers )
+            w->startThread( juce::Thread::Priority::low );
+    }
+
+    void stop()
+    {
+        if ( !m_running )
+            return;
+        for ( auto& w : m_workers )
+            w->signalThreadShouldExit();
+        for ( auto& w : m_workers )
+        {
+            w->notify();
+            w->stopThread( 1000 );
+        }
+        m_running = false;
+        s_nRunning--;
+    }
+
+    // true while any preview is simulating
+    static bool isRunning()
+    {
+        return s_nRunning.load() > 0;
+    }
+
+    // message thread, restarts the simulation if anything has changed
+    void setSettings( const settings& newSettings )
+    {
+        {
+            std::lock_guard< sjf_rtAudit::mutex > lock( m_settingsLock );
+            if ( newSettings == m_settings )
+                return;
+            m_settings = newSettings;
+            m_settingsVersion++;
+        }
+        for ( auto& w : m_workers )
+            w->notify();
+    }
+
+    // message thread only, combines whatever the workers have finished for the current settings, returns false if nothing new has been simulated
+    bool getResult( result& r )
+    {
+        uint32_t version, totalBars = 0;
+        size_t nBeats;
+        {
+            std::lock_guard< sjf_rtAudit::mutex > lock( m_settingsLock );
+            version = m_settingsVersion;
+            nBeats = m_settings.nBeats;
+        }
+        std::array< accumulator, NVOICES * NSTEPS > counts{};
+        for ( auto& w : m_workers )
+        {
+            w->m_published.update();
+            auto& published = w->m_published.read();
+            if ( published.version != version )
+                continue;
+            totalBars += published.bars;
+            for ( size_t i = 0; i < counts.size(); i++ )
+            {
+                counts[ i ].barsHit += published.counts[ i ].barsHit;
+                counts[ i ].triggers += published.counts[ i ].triggers;
+                counts[ i ].velocitySum += published.counts[ i ].velocitySum;
+                counts[ i ].velocitySquaredSum += published.counts[ i ].velocitySquaredSum;
+            }
+        }
+        if ( totalBars == 0 || ( version == m_lastVersion && totalBars == m_lastBars ) )
+            return false;
+        m_lastVersion = version;
+        m_lastBars = totalBars;
+
+        r.nBeats = nBeats;
+        r.nBars = totalBars;
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            for ( size_t s = 0; s < NSTEPS; s++ )
+            {
+                auto& cell = counts[ v * NSTEPS + s ];
+                r.probability[ v ][ s ] = static_cast< float >( cell.barsHit ) / static_cast< float >( totalBars );
+                auto n = cell.triggers;
+                auto mean = n > 0 ? cell.velocitySum / n : 0.0f;
+                r.meanVelocity[ v ][ s ] = mean;
+                r.velocityDeviation[ v ][ s ] = n > 0 ? std::sqrt( juce::jmax( 0.0f, cell.velocitySquaredSum / n - mean * mean ) ) : 0.0f;
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t TICKS_PER_STEP = 24, BARS_PER_PUBLISH = 16;
+
+    struct accumulator
+    {
+        uint32_t barsHit = 0;
+        float triggers = 0, velocitySum = 0, velocitySquaredSum = 0;
+    };
+
+    struct publishedCounts
+    {
+        uint32_t version = 0, bars = 0;
+        std::array< accumulator, NVOICES * NSTEPS > counts{};
+    };
+
+    class worker : public juce::Thread
+    {
+    public:
+        worker( sjf_densityPreview& owner, uint32_t barsToSimulate ) : juce::Thread( "AAIM density preview" ), m_owner( owner ), m_barsToSimulate( barsToSimulate ) {}
+        ~worker() override { stopThread( 1000 ); }
+
+        void run() override
+        {
+            while ( !threadShouldExit() )
+            {
+                checkForNewSettings();
+                if ( m_settings.nBeats == 0 || m_bars >= m_barsToSimulate )
+                {
+                    wait( -1 );
+                    continue;
+                }
+                for ( size_t i = 0; i < BARS_PER_PUBLISH && !threadShouldExit(); i++ )
+                    simulateBar();
+                publish();
+            }
+        }
+
+        sjf_tripleBuffer< publishedCounts > m_published;
+
+    private:
+        void checkForNewSettings()
+        {
+            {
+                std::lock_guard< sjf_rtAudit::mutex > lock( m_owner.m_settingsLock );
+                if ( m_owner.m_settingsVersion == m_version )
+                    return;
+                m_version = m_owner.m_settingsVersion;
+                m_settings = m_owner.m_settings;
+            }
+            m_rGen.setNumBeats( m_settings.nBeats );
+            m_rGen.setComplexity( m_settings.complexity );
+            m_rGen.setRests( m_settings.rests );
+            for ( size_t i = 0; i < NIOIS; i++ )
+                m_rGen.setIOIProbability( m_owner.m_ioiFactors[ i ], m_settings.ioiProbabilities[ i ] );
+            for ( size_t v = 0; v < NVOICES; v++ )
+            {
+                m_pVary[ v ].setNumBeats( m_settings.nBeats );
+                for ( size_t s = 0; s < m_settings.nBeats; s++ )
+                    m_pVary[ v ].setBeat( s, ( m_settings.pattern[ v ] >> s ) & 1u );
+                m_pVary[ v ].setFills( m_settings.fills );
+            }
+            m_bars = 0;
+            m_lastPhase = 1;
+            for ( auto& c : m_accumulators )
+                c = {};
+        }
+
+        void simulateBar()
+        {
+            std::array< uint32_t, NVOICES > hitThisBar{};
+            auto nTicks = m_settings.nBeats * TICKS_PER_STEP;
+            for ( size_t t = 0; t < nTicks; t++ )
+            {
+                auto beat = static_cast< float >( t ) / static_cast< float >( TICKS_PER_STEP );
+                auto genOut = m_rGen.runGenerator( beat );
+                if ( genOut[ 0 ] < m_lastPhase * 0.5 && genOut[ 2 ] > 0 )
+                {
+                    auto step = static_cast< size_t >( beat );
+                    for ( size_t v = 0; v < NVOICES; v++ )
+                    {
+                        if ( !m_pVary[ v ].triggerBeat( beat, genOut[ 4 ] ) )
+                            continue;
+                        hitThisBar[ v ] |= ( 1u << step );
+                        auto& a = m_accumulators[ v * NSTEPS + step ];
+                        a.triggers += 1;
+                        a.velocitySum += genOut[ 1 ];
+                        a.velocitySquaredSum += genOut[ 1 ] * genOut[ 1 ];
+                    }
+                }
+                m_lastPhase = genOut[ 0 ];
+            }
+            for ( size_t v = 0; v < NVOICES; v++ )
+                for ( size_t s = 0; s < m_settings.nBeats; s++ )
+                    m_accumulators[ v * NSTEPS + s ].barsHit += ( hitThisBar[ v ] >> s ) & 1u;
+            m_bars++;
+        }
+
+        void publish()
+        {
+            auto& p = m_published.getWriteBuffer();
+            p.version = m_version;
+            p.bars = m_bars;
+            p.counts = m_accumulators;
+            m_published.publish();
+        }
+
+        sjf_densityPreview& m_owner;
+        const uint32_t m_barsToSimulate;
+        uint32_t m_version = 0, m_bars = 0;
+        settings m_settings;
+        float m_lastPhase = 1;
+        AAIM_rhythmGen< float > m_rGen;
+        std::array< AAIM_patternVary< float >, NVOICES > m_pVary;
+        std::array< accumulator, NVOICES * NSTEPS > m_accumulators;
+    };
+
+    const std::array< float, NIOIS > m_ioiFactors;
+    sjf_rtAudit::mutex m_settingsLock;
+    settings m_settings;
+    uint32_t m_settingsVersion = 0, m_lastVersion = 0, m_lastBars = 0;
+    std::vector< std::unique_ptr< worker > > m_workers;
+    bool m_running = false;
+    static inline std::atomic< int > s_nRunning { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE( sjf_densityPreview )
+};
@@ -0,0 +1,103 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_gateOutput.h
+    Per voice gate and velocity signals for modular and DC coupled outputs
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <cstdint>
+
+//==============================================================================
+/**
+ Each voice has a pair of channels, a gate that is 1 for a fixed length after every onset
+ and a velocity CV that holds the velocity of the last onset until the next one.
+ Onsets are collected while the block is generated and the channels are written afterwards,
+ every run of samples between two onsets is a single vectorised fill rather than a
+ comparison on every sample.
+*/
+template< size_t NVOICES >
+class sjf_gateOutput
+{
+public:
+    static constexpr size_t MAX_ONSETS = 1024;
+    static constexpr double GATE_SECONDS = 0.005;
+
+    sjf_gateOutput(){}
+    ~sjf_gateOutput(){}
+
+    void prepare( double sampleRate )
+    {
+        m_gateSamples = juce::jmax( 1, static_cast< int >( sampleRate * GATE_SECONDS ) );
+        m_gateRemaining.fill( 0 );
+        m_velocity.fill( 0 );
+        m_numOnsets = 0;
+    }
+
+    // audio thread, while the block is being generated
+    void addOnset( int samplePosition, size_t voice, float velocity )
+    {
+        if ( m_numOnsets < MAX_ONSETS )
+            m_onsets[ m_numOnsets++ ] = { samplePosition, static_cast< uint32_t >( voice ), velocity };
+    }
+
+    // writes the block's gates and velocities, voice v's gate on channel 2v and its velocity on 2v+1
+    // the onset list is emptied ready for the next block
+    void render( juce::AudioBuffer< float >& bus )
+    {
+        auto numSamples = bus.getNumSamples();
+        auto nChannels = static_cast< size_t >( bus.getNumChannels() );
+        for ( size_t v = 0; v < NVOICES && v * 2 < nChannels; v++ )
+        {
+            auto gate = bus.getWritePointer( static_cast< int >( v * 2 ) );
+            auto velocity = v * 2 + 1 < nChannels ? bus.getWritePointer( static_cast< int >( v * 2 + 1 ) ) : nullptr;
+            auto start = 0;
+            for ( size_t i = 0; i < m_numOnsets; i++ )
+            {
+                if ( m_onsets[ i ].voice != v )
+                    continue;
+                auto onset = juce::jlimit( start, numSamples, m_onsets[ i ].samplePosition );
+                renderSegment( gate, velocity, v, start, onset );
+                m_gateRemaining[ v ] = m_gateSamples;
+                m_velocity[ v ] = m_onsets[ i ].velocity;
+                start = onset;
+            }
+            renderSegment( gate, velocity, v, start, numSamples );
+        }
+        m_numOnsets = 0;
+    }
+
+private:
+    void renderSegment( float* gate, float* velocity, size_t voice, int start, int end )
+    {
+        auto length = end - start;
+        if ( length <= 0 )
+            return;
+        auto high = juce::jmin( length, m_gateRemaining[ voice ] );
+        if ( high > 0 )
+            juce::FloatVectorOperations::fill( gate + start, 1.0f, high );
+        if ( length > high )
+            juce::FloatVectorOperations::clear( gate + start + high, length - high );
+        m_gateRemaining[ voice ] -= high;
+        if ( velocity != nullptr )
+            juce::FloatVectorOperations::fill( velocity + start, m_velocity[ voice ], length );
+    }
+
+    struct onset
+    {
+        int samplePosition;
+        uint32_t voice;
+        float velocity;
+    };
+
+    std::array< onset, MAX_ONSETS > m_onsets;
+    size_t m_numOnsets = 0;
+    std::array< int, NVOICES > m_gateRemaining{};
+    std::array< float, NVOICES > m_velocity{};
+    int m_gateSamples = 1;
+};
@@ -0,0 +1,64 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_ioiTable.h
+    Probability of each inter-onset interval, indexed like the list of IOI factors
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+//==============================================================================
+/**
+ Entries are addressed by their index into the list of factors rather than by the factor itself,
+ the probabilities are a plain fixed size array so readers can use it in place. Every change
+ bumps the version, a reader that remembers the last version it saw can skip all work when
+ nothing has changed.
+*/
+template< size_t N >
+class sjf_ioiTable
+{
+public:
+    sjf_ioiTable( const std::array< float, N >& factors ) : m_factors( factors ){ m_probabilities.fill( 0 ); }
+    ~sjf_ioiTable(){}
+    
+    // returns false if the entry already had that probability
+    bool setProbability( size_t index, float probability )
+    {
+        if ( index >= N || m_probabilities[ index ] == probability )
+            return false;
+        m_probabilities[ index ] = probability;
+        m_version.fetch_add( 1, std::memory_order_release );
+        return true;
+    }
+    
+    float getProbability( size_t index ) const { return m_probabilities[ index ]; }
+    float getFactor( size_t index ) const { return m_factors[ index ]; }
+    
+    const std::array< float, N >& getProbabilities() const { return m_probabilities; }
+    const std::array< float, N >& getFactors() const { return m_factors; }
+    
+    uint32_t getVersion() const { return m_version.load( std::memory_order_acquire ); }
+    
+    // index of the factor closest to the division given, for reading lists keyed by the factor itself
+    size_t findIndex( float division ) const
+    {
+        size_t closest = 0;
+        for ( size_t i = 1; i < N; i++ )
+            if ( std::abs( m_factors[ i ] - division ) < std::abs( m_factors[ closest ] - division ) )
+                closest = i;
+        return closest;
+    }
+    
+private:
+    const std::array< float, N > m_factors;
+    std::array< float, N > m_probabilities;
+    std::atomic< uint32_t > m_version { 0 };
+};
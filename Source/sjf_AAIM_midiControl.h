@@ -0,0 +1,114 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_midiControl.h
+    Incoming midi notes and controllers mapped to performance controls
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+//==============================================================================
+/**
+ Mapping (any channel):
+    notes 0-15      select pattern bank 1-16
+    notes 16-22     reverse, markov, shuffle, palindrome, double, rotate left, rotate right
+    note 23         restart the pattern from the first step
+    notes 24-39     toggle the mute of voice 1-16
+    note 40, cc 64  force fills on while held
+    cc 102          select pattern bank, value 0-15
+
+ The block's midi is read straight from the raw bytes into a fixed size list of events,
+ nothing is allocated so it is safe to call from processBlock. Events keep their sample
+ position so they can be applied at exactly the right point in the block.
+*/
+class sjf_midiControl
+{
+public:
+    enum eventType : uint8_t { selectBank, variation, restart, toggleMute, fill };
+    struct event
+    {
+        int samplePosition;
+        eventType type;
+        uint8_t index;
+        bool on;
+    };
+
+    static constexpr int FIRST_BANK_NOTE = 0, FIRST_VARIATION_NOTE = 16, NUM_VARIATIONS = 7, RESTART_NOTE = 23,
+                         FIRST_MUTE_NOTE = 24, FILL_NOTE = 40, FILL_CC = 64, BANK_CC = 102, MAX_EVENTS = 512;
+
+    sjf_midiControl( int nBanks, int nVoices ) : m_nBanks( nBanks ), m_nVoices( nVoices ){}
+    ~sjf_midiControl(){}
+
+    // reads this block's control events, anything that isn't mapped is ignored
+    void parse( const juce::MidiBuffer& midi )
+    {
+        m_numEvents = 0;
+        m_next = 0;
+        for ( const auto metadata : midi )
+        {
+            if ( m_numEvents == MAX_EVENTS )
+                break;
+            if ( metadata.numBytes < 3 )
+                continue;
+            auto status = metadata.data[ 0 ] & 0xF0;
+            int number = metadata.data[ 1 ], value = metadata.data[ 2 ];
+            if ( status == 0x90 || status == 0x80 )
+                addNote( metadata.samplePosition, number, status == 0x90 && value > 0 );
+            else if ( status == 0xB0 )
+                addController( metadata.samplePosition, number, value );
+        }
+    }
+
+    // sample position of the next event, INT_MAX once there are none left
+    int getNextPosition() const
+    {
+        return m_next < m_numEvents ? m_events[ m_next ].samplePosition : std::numeric_limits< int >::max();
+    }
+
+    // the next event due at or before the given sample, nullptr once there are none left
+    const event* next( int samplePosition )
+    {
+        return m_next < m_numEvents && m_events[ m_next ].samplePosition <= samplePosition ? &m_events[ m_next++ ] : nullptr;
+    }
+
+private:
+    void addNote( int samplePosition, int note, bool noteOn )
+    {
+        if ( note == FILL_NOTE )
+            add( samplePosition, fill, 0, noteOn );
+        else if ( !noteOn )
+            return;
+        else if ( note >= FIRST_BANK_NOTE && note < FIRST_BANK_NOTE + m_nBanks )
+            add( samplePosition, selectBank, note - FIRST_BANK_NOTE, true );
+        else if ( note >= FIRST_VARIATION_NOTE && note < FIRST_VARIATION_NOTE + NUM_VARIATIONS )
+            add( samplePosition, variation, note - FIRST_VARIATION_NOTE, true );
+        else if ( note == RESTART_NOTE )
+            add( samplePosition, restart, 0, true );
+        else if ( note >= FIRST_MUTE_NOTE && note < FIRST_MUTE_NOTE + m_nVoices )
+            add( samplePosition, toggleMute, note - FIRST_MUTE_NOTE, true );
+    }
+
+    void addController( int samplePosition, int controller, int value )
+    {
+        if ( controller == FILL_CC )
+            add( samplePosition, fill, 0, value >= 64 );
+        else if ( controller == BANK_CC && value < m_nBanks )
+            add( samplePosition, selectBank, value, true );
+    }
+
+    void add( int samplePosition, eventType type, int index, bool on )
+    {
+        m_events[ m_numEvents++ ] = { samplePosition, type, static_cast< uint8_t >( index ), on };
+    }
+
+    const int m_nBanks, m_nVoices;
+    std::array< event, MAX_EVENTS > m_events;
+    int m_numEvents = 0, m_next = 0;
+};
@@ -0,0 +1,246 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_midiImport.h
+    Drum grooves read from standard midi files straight into packed pattern words
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "sjf_AAIM_patternLibraryFile.h"
+#include <array>
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+//==============================================================================
+/**
+ Reads a standard midi file in a single pass over its bytes, in place, so a file can be parsed
+ straight from a memory mapping. Every note on is quantised to the nearest step of the grid and
+ set in the word of the bar it lands in, nothing else is kept. Notes map to voices the way the
+ voices play them, note FIRST_NOTE is voice 0, and notes outside the kit are ignored.
+ All tracks share one timeline so they are simply read one after another.
+ Files with SMPTE timing, or that aren't standard midi files, are rejected.
+*/
+template< size_t NVOICES, size_t NSTEPS >
+class sjf_midiImport
+{
+public:
+    static constexpr int FIRST_NOTE = 36;
+    static constexpr size_t MAX_BARS = 4096;
+    using bar = std::array< uint32_t, NVOICES >;
+
+    // fills bars with one entry for each bar of nBeats steps, up to the last bar with a note in it
+    // division is as in the divisionBank state, 1 = half notes ... 6 = 64th notes
+    // returns false if the data can't be read as a midi file
+    static bool parse( const uint8_t* data, size_t size, size_t nBeats, size_t division, std::vector< bar >& bars )
+    {
+        bars.clear();
+        reader r { data, data + size };
+        auto isHeader = r.match( "MThd" );
+        auto headerLength = r.read32();
+        r.read16(); // the format makes no difference as every track is read
+        auto nTracks = r.read16();
+        auto timeDivision = r.read16();
+        if ( !r.ok || !isHeader || headerLength < 6 || timeDivision == 0 || ( timeDivision & 0x8000 ) )
+            return false;
+        r.skip( headerLength - 6 );
+
+        grid g;
+        g.nBeats = nBeats < 1 ? 1 : nBeats > NSTEPS ? NSTEPS : nBeats;
+        g.ticksPerStep = static_cast< double >( timeDivision ) / std::pow( 2.0, static_cast< double >( division ) - 2.0 );
+        for ( uint32_t t = 0; t < nTracks && r.ok && r.remaining() >= 8; )
+        {
+            auto isTrack = r.match( "MTrk" );
+            auto length = r.read32();
+            if ( !r.ok || length > r.remaining() )
+                return false;
+            // any other kind of chunk is skipped
+            if ( isTrack )
+            {
+                if ( !parseTrack( reader { r.position, r.position + length }, g, bars ) )
+                    return false;
+                t++;
+            }
+            r.skip( length );
+        }
+        while ( !bars.empty() && isEmpty( bars.back() ) )
+            bars.pop_back();
+        return r.ok;
+    }
+
+    static bool isEmpty( const bar& b )
+    {
+        for ( auto word : b )
+            if ( word != 0 )
+                return false;
+        return true;
+    }
+
+    /**
+     Imports every midi file in a directory and its subdirectories into a pattern library, each
+     bar with a note in it becomes one record. The files are shared out between nThreads workers,
+     each reusing its own buffers, and the records are written in the order of the files so the
+     same directory always makes the same library.
+     Returns the number of records written, or -1 if the library file couldn't be written.
+    */
+    static int64_t importDirectory( const juce::File& directory, const juce::File& libraryFile, size_t nBeats, size_t division, int nThreads )
+    {
+        static_assert( NVOICES == sjf_patternLibraryFile::NUM_VOICES, "library records hold a fixed number of voices" );
+        auto files = directory.findChildFiles( juce::File::findFiles, true, "*.mid;*.midi" );
+        auto nFiles = static_cast< int >( files.size() );
+        std::vector< std::vector< sjf_patternLibraryFile::patternRecord > > records( files.size() );
+        nThreads = juce::jlimit( 1, juce::jmax( 1, nFiles ), nThreads );
+        std::atomic< int > nextFile { 0 }, remaining { nThreads };
+        juce::WaitableEvent finished;
+        {
+            juce::ThreadPool pool( nThreads );
+            for ( int t = 0; t < nThreads; t++ )
+            {
+                pool.addJob( [ & ]
+                {
+                    std::vector< bar > bars;
+                    for ( auto i = nextFile++; i < nFiles; i = nextFile++ )
+                    {
+                        juce::MemoryMappedFile mapped( files[ i ], juce::MemoryMappedFile::readOnly );
+                        if ( mapped.getData() == nullptr || !parse( static_cast< const uint8_t* >( mapped.getData() ), mapped.getSize(), nBeats, division, bars ) )
+                            continue;
+                        auto& fileRecords = records[ static_cast< size_t >( i ) ];
+                        for ( auto& b : bars )
+                            if ( !isEmpty( b ) )
+                                fileRecords.push_back( sjf_patternLibraryFile::makeRecord( b, nBeats, division ) );
+                    }
+                    if ( --remaining == 0 )
+                        finished.signal();
+                } );
+            }
+            finished.wait();
+        }
+
+        size_t total = 0;
+        for ( auto& r : records )
+            total += r.size();
+        std::vector< sjf_patternLibraryFile::patternRecord > library;
+        library.reserve( total );
+        for ( auto& r : records )
+            library.insert( library.end(), r.begin(), r.end() );
+        if ( !sjf_patternLibraryFile::write( libraryFile, library.data(), library.size() ) )
+            return -1;
+        return static_cast< int64_t >( library.size() );
+    }
+
+private:
+    struct grid
+    {
+        size_t nBeats = 1;
+        double ticksPerStep = 1;
+    };
+
+    // reads big endian values and midi's variable length numbers, running off the end clears ok
+    struct reader
+    {
+        const uint8_t* position;
+        const uint8_t* end;
+        bool ok = true;
+
+        size_t remaining() const { return static_cast< size_t >( end - position ); }
+
+        uint8_t read8()
+        {
+            if ( position >= end )
+            {
+                ok = false;
+                return 0;
+            }
+            return *position++;
+        }
+        uint32_t read16() { auto hi = read8(); return static_cast< uint32_t >( hi << 8 | read8() ); }
+        uint32_t read32() { auto hi = read16(); return hi << 16 | read16(); }
+        uint32_t readVariableLength()
+        {
+            uint32_t value = 0;
+            for ( int i = 0; i < 4; i++ )
+            {
+                auto b = read8();
+                value = ( value << 7 ) | ( b & 0x7f );
+                if ( !( b & 0x80 ) )
+                    break;
+            }
+            return value;
+        }
+        bool match( const char* id )
+        {
+            auto matches = remaining() >= 4 && std::memcmp( position, id, 4 ) == 0;
+            skip( 4 );
+            return matches;
+        }
+        void skip( size_t n )
+        {
+            if ( n > remaining() )
+            {
+                ok = false;
+                n = remaining();
+            }
+            position += n;
+        }
+    };
+
+    static bool parseTrack( reader r, const grid& g, std::vector< bar >& bars )
+    {
+        uint64_t tick = 0;
+        uint8_t runningStatus = 0;
+        while ( r.ok && r.remaining() > 0 )
+        {
+            tick += r.readVariableLength();
+            auto status = r.read8();
+            if ( status == 0xff )
+            {
+                // meta events, e.g. tempo and time signature, don't change where notes land on the grid
+                r.read8();
+                r.skip( r.readVariableLength() );
+                continue;
+            }
+            if ( status == 0xf0 || status == 0xf7 )
+            {
+                r.skip( r.readVariableLength() );
+                continue;
+            }
+            uint8_t data1;
+            if ( status & 0x80 )
+            {
+                runningStatus = status;
+                data1 = r.read8();
+            }
+            else if ( runningStatus != 0 )
+                data1 = status; // running status, this was already the first data byte
+            else
+                return false;
+            auto type = runningStatus & 0xf0;
+            if ( type == 0xc0 || type == 0xd0 )
+                continue;
+            auto data2 = r.read8();
+            if ( type == 0x90 && data2 > 0 )
+                addOnset( tick, data1, g, bars );
+        }
+        return r.ok;
+    }
+
+    static void addOnset( uint64_t tick, int note, const grid& g, std::vector< bar >& bars )
+    {
+        auto voice = note - FIRST_NOTE;
+        if ( voice < 0 || voice >= static_cast< int >( NVOICES ) )
+            return;
+        auto step = static_cast< uint64_t >( static_cast< double >( tick ) / g.ticksPerStep + 0.5 );
+        auto barIndex = static_cast< size_t >( step / g.nBeats );
+        if ( barIndex >= MAX_BARS )
+            return;
+        if ( bars.size() <= barIndex )
+            bars.resize( barIndex + 1, bar {} );
+        bars[ barIndex ][ static_cast< size_t >( voice ) ] |= 1u << ( step % g.nBeats );
+    }
+};
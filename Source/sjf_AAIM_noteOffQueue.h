@@ -0,0 +1,153 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_noteOffQueue.h
+    Pending note offs, one per voice, kept in order of when they are due
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <utility>
+
+//==============================================================================
+/**
+ A binary min-heap of note offs keyed by the absolute sample they are due on, with each voice's
+ place in the heap tracked so its note off can be moved or taken out when it plays again.
+ A voice only ever has one note sounding so the heap never holds more than NVOICES entries,
+ everything is preallocated and scheduling, releasing and popping are all O(log NVOICES).
+ Notes that should hold until the voice plays again are scheduled for HOLD and are only
+ released by the next note or by a flush.
+*/
+template< size_t NVOICES >
+class sjf_noteOffQueue
+{
+public:
+    static constexpr int64_t HOLD = std::numeric_limits< int64_t >::max();
+
+    struct pending
+    {
+        int64_t dueSample;
+        uint32_t voice;
+        int channel, note;
+    };
+
+    sjf_noteOffQueue(){ clear(); }
+    ~sjf_noteOffQueue(){}
+
+    void clear()
+    {
+        m_size = 0;
+        m_heapIndex.fill( NONE );
+    }
+
+    bool isEmpty() const { return m_size == 0; }
+
+    // replaces any note off already pending for the voice
+    void schedule( size_t voice, int64_t dueSample, int channel, int note )
+    {
+        auto i = m_heapIndex[ voice ];
+        if ( i == NONE )
+        {
+            i = m_size++;
+            m_heapIndex[ voice ] = i;
+        }
+        m_heap[ i ] = { dueSample, static_cast< uint32_t >( voice ), channel, note };
+        siftDown( siftUp( i ) );
+    }
+
+    // takes the voice's note off out of the queue and passes it to f, returns false if it had none
+    template< typename F >
+    bool release( size_t voice, F&& f )
+    {
+        auto i = m_heapIndex[ voice ];
+        if ( i == NONE )
+            return false;
+        auto p = m_heap[ i ];
+        removeAt( i );
+        f( p );
+        return true;
+    }
+
+    // passes every note off due before the given sample to f, earliest first
+    template< typename F >
+    void popDue( int64_t beforeSample, F&& f )
+    {
+        while ( m_size > 0 && m_heap[ 0 ].dueSample < beforeSample )
+        {
+            auto p = m_heap[ 0 ];
+            removeAt( 0 );
+            f( p );
+        }
+    }
+
+    // passes every pending note off to f whenever it was due, e.g. when the transport stops
+    template< typename F >
+    void popAll( F&& f )
+    {
+        while ( m_size > 0 )
+        {
+            auto p = m_heap[ 0 ];
+            removeAt( 0 );
+            f( p );
+        }
+    }
+
+private:
+    static constexpr size_t NONE = std::numeric_limits< size_t >::max();
+
+    void removeAt( size_t i )
+    {
+        m_heapIndex[ m_heap[ i ].voice ] = NONE;
+        if ( --m_size == i )
+            return;
+        m_heap[ i ] = m_heap[ m_size ];
+        m_heapIndex[ m_heap[ i ].voice ] = i;
+        siftDown( siftUp( i ) );
+    }
+
+    size_t siftUp( size_t i )
+    {
+        while ( i > 0 )
+        {
+            auto parent = ( i - 1 ) / 2;
+            if ( m_heap[ parent ].dueSample <= m_heap[ i ].dueSample )
+                break;
+            swap( i, parent );
+            i = parent;
+        }
+        return i;
+    }
+
+    void siftDown( size_t i )
+    {
+        while ( true )
+        {
+            auto smallest = i, left = i * 2 + 1, right = left + 1;
+            if ( left < m_size && m_heap[ left ].dueSample < m_heap[ smallest ].dueSample )
+                smallest = left;
+            if ( right < m_size && m_heap[ right ].dueSample < m_heap[ smallest ].dueSample )
+                smallest = right;
+            if ( smallest == i )
+                return;
+            swap( i, smallest );
+            i = smallest;
+        }
+    }
+
+    void swap( size_t a, size_t b )
+    {
+        std::swap( m_heap[ a ], m_heap[ b ] );
+        m_heapIndex[ m_heap[ a ].voice ] = a;
+        m_heapIndex[ m_heap[ b ].voice ] = b;
+    }
+
+    std::array< pending, NVOICES > m_heap{};
+    std::array< size_t, NVOICES > m_heapIndex{};
+    size_t m_size = 0;
+};
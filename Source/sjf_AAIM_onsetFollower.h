@@ -0,0 +1,97 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_onsetFollower.h
+    Energy and onset density of an audio input, used to let a band push the generator
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <vector>
+#include <cmath>
+
+//==============================================================================
+/**
+ The input channels are rectified and summed with vector operations, a fast one-pole follower
+ then tracks the envelope and a slow one tracks the background level. An onset is counted
+ whenever the fast envelope rises above the background by the threshold ratio, after which
+ further onsets are ignored for a short refractory time. Energy is the background level and
+ density is a running average of onsets per second, both scaled to 0-1.
+*/
+class sjf_onsetFollower
+{
+public:
+    static constexpr float FAST_SECONDS = 0.005f, SLOW_SECONDS = 0.3f, DENSITY_SECONDS = 2.0f, REFRACTORY_SECONDS = 0.05f;
+    static constexpr float THRESHOLD_RATIO = 1.5f, NOISE_FLOOR = 0.001f, MAX_ONSETS_PER_SECOND = 8.0f, FULL_SCALE_ENERGY = 0.25f;
+
+    sjf_onsetFollower(){}
+    ~sjf_onsetFollower(){}
+
+    // message thread, before playback starts
+    void prepare( double sampleRate, int maxBlockSize )
+    {
+        auto sr = static_cast< float >( sampleRate );
+        m_fastCoef = std::exp( -1.0f / ( FAST_SECONDS * sr ) );
+        m_slowCoef = std::exp( -1.0f / ( SLOW_SECONDS * sr ) );
+        m_densityCoef = std::exp( -1.0f / ( DENSITY_SECONDS * sr ) );
+        m_refractorySamples = static_cast< int >( REFRACTORY_SECONDS * sr );
+        m_sampleRate = sr;
+        m_rectified.assign( static_cast< size_t >( juce::jmax( 1, maxBlockSize ) ), 0.0f );
+        m_scratch.assign( m_rectified.size(), 0.0f );
+        m_fast = m_slow = m_density = 0;
+        m_sinceOnset = m_refractorySamples;
+    }
+
+    // audio thread, larger blocks than prepared for are handled in chunks so nothing is allocated
+    void process( const juce::AudioBuffer< float >& input )
+    {
+        auto nChannels = input.getNumChannels();
+        if ( nChannels == 0 || m_rectified.empty() )
+            return;
+        auto chunkSize = static_cast< int >( m_rectified.size() );
+        for ( int start = 0; start < input.getNumSamples(); start += chunkSize )
+            processChunk( input, start, juce::jmin( chunkSize, input.getNumSamples() - start ) );
+    }
+
+    float getEnergy() const { return juce::jmin( 1.0f, m_slow / FULL_SCALE_ENERGY ); }
+    float getDensity() const { return juce::jmin( 1.0f, m_density * m_sampleRate / MAX_ONSETS_PER_SECOND ); }
+
+private:
+    void processChunk( const juce::AudioBuffer< float >& input, int start, int numSamples )
+    {
+        auto rectified = m_rectified.data();
+        juce::FloatVectorOperations::abs( rectified, input.getReadPointer( 0, start ), numSamples );
+        for ( int c = 1; c < input.getNumChannels(); c++ )
+        {
+            juce::FloatVectorOperations::abs( m_scratch.data(), input.getReadPointer( c, start ), numSamples );
+            juce::FloatVectorOperations::add( rectified, m_scratch.data(), numSamples );
+        }
+        juce::FloatVectorOperations::multiply( rectified, 1.0f / static_cast< float >( input.getNumChannels() ), numSamples );
+
+        // the followers are recursive so this part is scalar, a handful of operations per sample
+        auto fast = m_fast, slow = m_slow, density = m_density;
+        auto sinceOnset = m_sinceOnset;
+        for ( int i = 0; i < numSamples; i++ )
+        {
+            auto x = rectified[ i ];
+            fast = x + m_fastCoef * ( fast - x );
+            slow = x + m_slowCoef * ( slow - x );
+            auto onset = sinceOnset >= m_refractorySamples && fast > NOISE_FLOOR && fast > slow * THRESHOLD_RATIO;
+            sinceOnset = onset ? 0 : sinceOnset + 1;
+            // a leaky integrator of impulses, its value is the onset rate per sample
+            density = ( onset ? 1.0f - m_densityCoef : 0.0f ) + m_densityCoef * density;
+        }
+        m_fast = fast;
+        m_slow = slow;
+        m_density = density;
+        m_sinceOnset = juce::jmin( sinceOnset, m_refractorySamples );
+    }
+
+    std::vector< float > m_rectified, m_scratch;
+    float m_fastCoef = 0, m_slowCoef = 0, m_densityCoef = 0, m_sampleRate = 44100;
+    float m_fast = 0, m_slow = 0, m_density = 0;
+    int m_refractorySamples = 0, m_sinceOnset = 0;
+};
@@ -0,0 +1,226 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_patternHistory.h
+    Bounded undo/redo history of the pattern banks
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+//==============================================================================
+/**
+ Each bank is stored as one packed word per voice plus its length and division.
+ History steps only hold indices into a pool of bank snapshots, so banks that are
+ unchanged between steps are shared rather than copied (copy-on-write).
+ A bank's accents are pooled apart from its pattern, they are far larger and change
+ far less often, so an edit to one only adds to its own pool.
+*/
+template< size_t NVOICES, size_t NBANKS, typename ACCENTS >
+class sjf_patternHistory
+{
+public:
+    struct bankSnapshot
+    {
+        std::array< uint32_t, NVOICES > words{};
+        uint8_t nBeats = 0, division = 0;
+        // per voice length and division, 0 follows the bank
+        std::array< uint8_t, NVOICES > voiceNBeats{}, voiceDivisions{};
+
+        bool operator==( const bankSnapshot& other ) const
+        {
+            return nBeats == other.nBeats && division == other.division && words == other.words
+                && voiceNBeats == other.voiceNBeats && voiceDivisions == other.voiceDivisions;
+        }
+    };
+    using bankSet = std::array< bankSnapshot, NBANKS >;
+    using accentSet = std::array< ACCENTS, NBANKS >;
+
+    // every step can add at most NBANKS snapshots to the pool, so the capacity is limited to keep pool indices 16 bit
+    sjf_patternHistory( size_t capacity = 2048 ) : m_entries( capacity < 2 ? 2 : ( capacity > 65535 / NBANKS ? 65535 / NBANKS : capacity ) ){}
+    ~sjf_patternHistory(){}
+
+    // discard all history and start again from the given banks
+    void reset( const bankSet& banks, const accentSet& accents )
+    {
+        m_banks.clear();
+        m_accents.clear();
+        m_head = 0;
+        m_size = 1;
+        m_position = 0;
+        for ( size_t i = 0; i < NBANKS; i++ )
+        {
+            m_entries[ 0 ].banks[ i ] = m_banks.add( banks[ i ] );
+            m_entries[ 0 ].accents[ i ] = m_accents.add( accents[ i ] );
+        }
+    }
+
+    // store the given banks as a new step, returns false if nothing has changed since the current step
+    bool commit( const bankSet& banks, const accentSet& accents )
+    {
+        if ( m_size == 0 )
+        {
+            reset( banks, accents );
+            return true;
+        }
+        auto& current = m_entries[ index( m_position ) ];
+        auto changed = false;
+        for ( size_t i = 0; i < NBANKS && !changed; i++ )
+            changed = !( m_banks.items[ current.banks[ i ] ] == banks[ i ] ) || !( m_accents.items[ current.accents[ i ] ] == accents[ i ] );
+        if ( !changed )
+            return false;
+
+        // anything that could have been redone is lost
+        while ( m_size > m_position + 1 )
+        {
+            release( m_entries[ index( m_size - 1 ) ] );
+            m_size--;
+        }
+        if ( m_size == m_entries.size() )
+        {
+            release( m_entries[ m_head ] );
+            m_head = ( m_head + 1 ) % m_entries.size();
+            m_size--;
+            m_position--;
+        }
+
+        auto& previous = m_entries[ index( m_position ) ];
+        auto& e = m_entries[ index( m_size ) ];
+        for ( size_t i = 0; i < NBANKS; i++ )
+        {
+            e.banks[ i ] = m_banks.share( previous.banks[ i ], banks[ i ] );
+            e.accents[ i ] = m_accents.share( previous.accents[ i ], accents[ i ] );
+        }
+        m_size++;
+        m_position = m_size - 1;
+        return true;
+    }
+
+    bool canUndo() const { return m_size > 0 && m_position > 0; }
+    bool canRedo() const { return m_position + 1 < m_size; }
+
+    // step back/forward, the mask returned has a bit set for each bank that differs from the previous step
+    uint32_t undo()
+    {
+        if ( !canUndo() )
+            return 0;
+        m_position--;
+        return changedBanks( m_position + 1, m_position );
+    }
+
+    uint32_t redo()
+    {
+        if ( !canRedo() )
+            return 0;
+        m_position++;
+        return changedBanks( m_position - 1, m_position );
+    }
+
+    const bankSnapshot& getBank( size_t bank ) const
+    {
+        return m_banks.items[ m_entries[ index( m_position ) ].banks[ bank ] ];
+    }
+
+    const ACCENTS& getAccents( size_t bank ) const
+    {
+        return m_accents.items[ m_entries[ index( m_position ) ].accents[ bank ] ];
+    }
+
+    size_t getNumSteps() const { return m_size; }
+
+    // approximate heap usage in bytes
+    size_t getMemoryUsage() const
+    {
+        return m_entries.capacity() * sizeof( entry ) + m_banks.getMemoryUsage() + m_accents.getMemoryUsage();
+    }
+
+private:
+    struct entry
+    {
+        std::array< uint16_t, NBANKS > banks, accents;
+    };
+
+    template< typename T >
+    struct pool
+    {
+        void clear()
+        {
+            items.clear();
+            refCounts.clear();
+            freeList.clear();
+        }
+
+        uint16_t add( const T& item )
+        {
+            if ( !freeList.empty() )
+            {
+                auto slot = freeList.back();
+                freeList.pop_back();
+                items[ slot ] = item;
+                refCounts[ slot ] = 1;
+                return slot;
+            }
+            items.push_back( item );
+            refCounts.push_back( 1 );
+            return static_cast< uint16_t >( items.size() - 1 );
+        }
+
+        // the previous step's slot if the item is unchanged, otherwise a new one
+        uint16_t share( uint16_t previous, const T& item )
+        {
+            if ( !( items[ previous ] == item ) )
+                return add( item );
+            refCounts[ previous ] += 1;
+            return previous;
+        }
+
+        void release( uint16_t slot )
+        {
+            refCounts[ slot ] -= 1;
+            if ( refCounts[ slot ] == 0 )
+                freeList.push_back( slot );
+        }
+
+        size_t getMemoryUsage() const
+        {
+            return items.capacity() * sizeof( T ) + refCounts.capacity() * sizeof( uint32_t ) + freeList.capacity() * sizeof( uint16_t );
+        }
+
+        std::vector< T > items;
+        std::vector< uint32_t > refCounts;
+        std::vector< uint16_t > freeList;
+    };
+
+    size_t index( size_t position ) const { return ( m_head + position ) % m_entries.size(); }
+
+    void release( const entry& e )
+    {
+        for ( size_t i = 0; i < NBANKS; i++ )
+        {
+            m_banks.release( e.banks[ i ] );
+            m_accents.release( e.accents[ i ] );
+        }
+    }
+
+    uint32_t changedBanks( size_t from, size_t to ) const
+    {
+        auto& a = m_entries[ index( from ) ];
+        auto& b = m_entries[ index( to ) ];
+        auto mask = 0u;
+        for ( size_t i = 0; i < NBANKS; i++ )
+            if ( a.banks[ i ] != b.banks[ i ] || a.accents[ i ] != b.accents[ i ] )
+                mask |= ( 1u << i );
+        return mask;
+    }
+
+    std::vector< entry > m_entries;
+    pool< bankSnapshot > m_banks;
+    pool< ACCENTS > m_accents;
+    size_t m_head = 0, m_size = 0, m_position = 0;
+};
@@ -0,0 +1,136 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_patternLibraryFile.h
+    Read only, memory mapped library of patterns shared between plugin instances
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "sjf_AAIM_rtAudit.h"
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+//==============================================================================
+/**
+ File layout (little endian):
+    header  - 64 bytes, magic "AAIMPLIB", format version, record size and number of records
+    records - fixed size, one per pattern, see patternRecord below
+
+ The file is mapped read only, pages are only read from disk when a pattern is actually used
+ and every instance that opens the same file shares the same mapping.
+*/
+class sjf_patternLibraryFile
+{
+public:
+    static constexpr int NUM_VOICES = 16, NUM_IOIs = 26;
+    static constexpr uint32_t VERSION = 1;
+
+    struct patternRecord
+    {
+        uint32_t voices[ NUM_VOICES ];  // one bit per step, step 0 in the least significant bit
+        uint8_t nBeats;
+        uint8_t division;               // same values as the divisionBank state, 1 = half notes ... 6 = 64th notes
+        uint8_t flags;                  // hasIOIs
+        uint8_t reserved;
+        float ioiProbabilities[ NUM_IOIs ]; // indexed like Sjf_AAIM_DrumsAudioProcessor::ioiFactors
+        uint8_t padding[ 20 ];
+    };
+    enum recordFlags { hasIOIs = 1 };
+    static_assert( sizeof( patternRecord ) == 192, "library records should be exactly three cache lines" );
+
+    struct fileHeader
+    {
+        char magic[ 8 ];
+        uint32_t version, recordSize;
+        uint64_t numRecords;
+        uint8_t padding[ 40 ];
+    };
+    static_assert( sizeof( fileHeader ) == 64, "library header should be one cache line" );
+
+    //==============================================================================
+    // opens a library, instances asking for the same file get the same mapping
+    static std::shared_ptr< const sjf_patternLibraryFile > open( const juce::File& file )
+    {
+        static sjf_rtAudit::mutex cacheLock;
+        static std::map< juce::String, std::weak_ptr< const sjf_patternLibraryFile > > cache;
+
+        std::lock_guard< sjf_rtAudit::mutex > lock( cacheLock );
+        auto path = file.getFullPathName();
+        if ( auto existing = cache[ path ].lock() )
+            return existing;
+        auto library = std::shared_ptr< const sjf_patternLibraryFile >( new sjf_patternLibraryFile( file ) );
+        if ( library->size() == 0 )
+            return nullptr;
+        cache[ path ] = library;
+        return library;
+    }
+
+    // writes a complete library, returns false if the file couldn't be written
+    static bool write( const juce::File& file, const patternRecord* records, size_t numRecords )
+    {
+        file.deleteFile();
+        juce::FileOutputStream stream( file );
+        if ( !stream.openedOk() )
+            return false;
+        fileHeader header {};
+        std::memcpy( header.magic, "AAIMPLIB", 8 );
+        header.version = VERSION;
+        header.recordSize = sizeof( patternRecord );
+        header.numRecords = numRecords;
+        if ( !stream.write( &header, sizeof( header ) ) )
+            return false;
+        if ( numRecords > 0 && !stream.write( records, numRecords * sizeof( patternRecord ) ) )
+            return false;
+        stream.flush();
+        return true;
+    }
+
+    static patternRecord makeRecord( const std::array< uint32_t, NUM_VOICES >& voices, size_t nBeats, size_t division )
+    {
+        patternRecord r {};
+        for ( size_t i = 0; i < NUM_VOICES; i++ )
+            r.voices[ i ] = voices[ i ];
+        r.nBeats = static_cast< uint8_t >( nBeats );
+        r.division = static_cast< uint8_t >( division );
+        return r;
+    }
+
+    //==============================================================================
+    size_t size() const { return m_numRecords; }
+
+    const patternRecord* getRecord( size_t index ) const
+    {
+        return index < m_numRecords ? m_records + index : nullptr;
+    }
+
+    const juce::File& getFile() const { return m_file; }
+
+private:
+    sjf_patternLibraryFile( const juce::File& file ) : m_file( file ), m_map( file, juce::MemoryMappedFile::readOnly )
+    {
+        auto data = static_cast< const uint8_t* >( m_map.getData() );
+        if ( data == nullptr || m_map.getSize() < sizeof( fileHeader ) )
+            return;
+        fileHeader header;
+        std::memcpy( &header, data, sizeof( header ) );
+        if ( std::memcmp( header.magic, "AAIMPLIB", 8 ) != 0 || header.version != VERSION || header.recordSize != sizeof( patternRecord ) )
+            return;
+        auto available = ( m_map.getSize() - sizeof( fileHeader ) ) / sizeof( patternRecord );
+        m_numRecords = static_cast< size_t >( header.numRecords ) < available ? static_cast< size_t >( header.numRecords ) : available;
+        m_records = reinterpret_cast< const patternRecord* >( data + sizeof( fileHeader ) );
+    }
+
+    juce::File m_file;
+    juce::MemoryMappedFile m_map;
+    const patternRecord* m_records = nullptr;
+    size_t m_numRecords = 0;
+
+    JUCE_DECLARE_NON_COPYABLE( sjf_patternLibraryFile )
+};
@@ -0,0 +1,207 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_patternLibraryIndex.h
+    Nearest neighbour search over a library of drum patterns
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+#include <algorithm>
+
+//==============================================================================
+/**
+ Patterns are stored as packed rows of one 32 bit word per voice (512 bits for 16 voices)
+ and compared by weighted Hamming distance, i.e. popcount of the XOR of two rows.
+ Optionally each step can be weighted by its metric indispensability, the weighted popcount
+ of each byte is then precomputed so a voice costs four table lookups.
+*/
+template< size_t NVOICES >
+class sjf_patternLibraryIndex
+{
+public:
+    using words = std::array< uint32_t, NVOICES >;
+    struct alignas( 64 ) row { words w; };
+    struct match { size_t index; uint32_t distance; };
+    static constexpr size_t MAX_STEPS = 32, MAX_METRIC_WEIGHT = 15, MAX_MATCHES = 64;
+
+    sjf_patternLibraryIndex(){ m_voiceWeights.fill( 1 ); setMetricWeights( std::vector< float >{} ); }
+    ~sjf_patternLibraryIndex(){}
+
+    void clear()
+    {
+        m_rows.clear();
+        m_nBeats.clear();
+        m_divisions.clear();
+    }
+
+    void reserve( size_t nPatterns )
+    {
+        m_rows.reserve( nPatterns );
+        m_nBeats.reserve( nPatterns );
+        m_divisions.reserve( nPatterns );
+    }
+
+    size_t addPattern( const words& pattern, uint8_t nBeats, uint8_t division )
+    {
+        m_rows.push_back( { pattern } );
+        m_nBeats.push_back( nBeats );
+        m_divisions.push_back( division );
+        return m_rows.size() - 1;
+    }
+
+    size_t size() const { return m_rows.size(); }
+    const words& getPattern( size_t index ) const { return m_rows[ index ].w; }
+    uint8_t getNumBeats( size_t index ) const { return m_nBeats[ index ]; }
+    uint8_t getDivision( size_t index ) const { return m_divisions[ index ]; }
+
+    // relative importance of each voice, e.g. kick and snare differences count more than percussion
+    void setVoiceWeight( size_t voice, uint32_t weight ){ m_voiceWeights[ voice ] = weight; }
+
+    // indispensability of each step, as returned by AAIM_rhythmGen::getBaseindispensability()
+    // a difference on a step costs 1 plus its indispensability scaled to 0-MAX_METRIC_WEIGHT
+    template< typename Container >
+    void setMetricWeights( const Container& indispensability )
+    {
+        std::array< uint16_t, MAX_STEPS > stepWeights;
+        stepWeights.fill( 1 );
+        auto maxIndis = 0.0;
+        for ( auto& i : indispensability )
+            maxIndis = static_cast< double >( i ) > maxIndis ? static_cast< double >( i ) : maxIndis;
+        for ( size_t i = 0; i < indispensability.size() && i < MAX_STEPS && maxIndis > 0; i++ )
+            stepWeights[ i ] += static_cast< uint16_t >( 0.5 + MAX_METRIC_WEIGHT * static_cast< double >( indispensability[ i ] ) / maxIndis );
+        
+        for ( size_t b = 0; b < 4; b++ )
+        {
+            for ( size_t x = 0; x < 256; x++ )
+            {
+                auto w = 0u;
+                for ( size_t bit = 0; bit < 8; bit++ )
+                    if ( x & ( 1u << bit ) )
+                        w += stepWeights[ b * 8 + bit ];
+                m_metricTable[ b ][ x ] = static_cast< uint16_t >( w );
+            }
+        }
+    }
+
+    uint32_t distance( const words& a, const words& b, uint32_t stepMask, bool useMetricWeights ) const
+    {
+        return useMetricWeights ? rowDistance< true >( a, b, stepMask ) : rowDistance< false >( a, b, stepMask );
+    }
+
+    // the k closest patterns to the query, closest first
+    // only the first nBeats steps are compared and an exact duplicate of the query can be skipped
+    // large libraries are split across threads, each scanning a contiguous range of rows
+    std::vector< match > findNearest( const words& query, size_t k, size_t nBeats, bool useMetricWeights, bool skipIdentical = true ) const
+    {
+        k = k < MAX_MATCHES ? k : MAX_MATCHES;
+        if ( k == 0 )
+            return {};
+        auto nThreads = static_cast< size_t >( std::thread::hardware_concurrency() );
+        nThreads = nThreads > MAX_THREADS ? MAX_THREADS : ( nThreads < 1 ? 1 : nThreads );
+        if ( m_rows.size() < MIN_ROWS_PER_THREAD * 2 )
+            nThreads = 1;
+        
+        std::array< matchList, MAX_THREADS > results;
+        std::array< std::thread, MAX_THREADS > threads;
+        auto rowsPerThread = ( m_rows.size() + nThreads - 1 ) / nThreads;
+        for ( size_t t = 0; t < nThreads; t++ )
+        {
+            auto start = t * rowsPerThread;
+            auto end = std::min( start + rowsPerThread, m_rows.size() );
+            auto job = [ this, &query, &results, t, k, nBeats, useMetricWeights, skipIdentical, start, end ]
+            {
+                if ( useMetricWeights )
+                    search< true >( results[ t ], query, k, nBeats, skipIdentical, start, end );
+                else
+                    search< false >( results[ t ], query, k, nBeats, skipIdentical, start, end );
+            };
+            if ( t == nThreads - 1 )
+                job();
+            else
+                threads[ t ] = std::thread( job );
+        }
+        for ( size_t t = 0; t + 1 < nThreads; t++ )
+            threads[ t ].join();
+        
+        std::vector< match > merged;
+        for ( size_t t = 0; t < nThreads; t++ )
+            merged.insert( merged.end(), results[ t ].best.begin(), results[ t ].best.begin() + results[ t ].size );
+        std::sort( merged.begin(), merged.end(), []( const match& a, const match& b )
+                  { return a.distance == b.distance ? a.index < b.index : a.distance < b.distance; } );
+        if ( merged.size() > k )
+            merged.resize( k );
+        return merged;
+    }
+
+private:
+    // SWAR popcount, unlike std::popcount this vectorises across voices even without a hardware popcount instruction
+    static inline uint32_t countBits( uint32_t x )
+    {
+        x = x - ( ( x >> 1 ) & 0x55555555u );
+        x = ( x & 0x33333333u ) + ( ( x >> 2 ) & 0x33333333u );
+        x = ( x + ( x >> 4 ) ) & 0x0F0F0F0Fu;
+        return ( x * 0x01010101u ) >> 24;
+    }
+
+    template< bool METRIC >
+    uint32_t rowDistance( const words& a, const words& b, uint32_t stepMask ) const
+    {
+        auto d = 0u;
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            auto x = ( a[ v ] ^ b[ v ] ) & stepMask;
+            if constexpr ( METRIC )
+                d += m_voiceWeights[ v ] * ( m_metricTable[ 0 ][ x & 0xFF ] + m_metricTable[ 1 ][ ( x >> 8 ) & 0xFF ]
+                                            + m_metricTable[ 2 ][ ( x >> 16 ) & 0xFF ] + m_metricTable[ 3 ][ x >> 24 ] );
+            else
+                d += m_voiceWeights[ v ] * countBits( x );
+        }
+        return d;
+    }
+
+    static constexpr size_t MAX_THREADS = 8, MIN_ROWS_PER_THREAD = 1 << 15;
+    
+    struct matchList
+    {
+        std::array< match, MAX_MATCHES > best;
+        size_t size = 0;
+    };
+    
+    template< bool METRIC >
+    void search( matchList& result, const words& query, size_t k, size_t nBeats, bool skipIdentical, size_t start, size_t end ) const
+    {
+        auto stepMask = nBeats >= MAX_STEPS ? ~0u : ( 1u << nBeats ) - 1u;
+        // keep the best matches in a small sorted array, the worst is always at the back
+        auto& best = result.best;
+        auto& nBest = result.size;
+        auto worst = ~0u;
+        for ( size_t i = start; i < end; i++ )
+        {
+            auto d = rowDistance< METRIC >( query, m_rows[ i ].w, stepMask );
+            if ( ( nBest == k && d >= worst ) || ( skipIdentical && d == 0 ) )
+                continue;
+            auto pos = nBest < k ? nBest++ : k - 1;
+            while ( pos > 0 && best[ pos - 1 ].distance > d )
+            {
+                best[ pos ] = best[ pos - 1 ];
+                pos--;
+            }
+            best[ pos ] = { i, d };
+            if ( nBest == k )
+                worst = best[ k - 1 ].distance;
+        }
+    }
+
+    std::vector< row > m_rows;
+    std::vector< uint8_t > m_nBeats, m_divisions;
+    std::array< uint32_t, NVOICES > m_voiceWeights;
+    std::array< std::array< uint16_t, 256 >, 4 > m_metricTable;
+};
@@ -0,0 +1,194 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_rhythmMetrics.h
+    Density, syncopation, evenness and overlap of each voice and the whole kit
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+//==============================================================================
+/**
+ Rhythm measures of a set of packed pattern words, kept up to date one step at a time.
+ Each voice keeps running totals that a single step only changes locally, so toggling a step
+ costs a few bit scans and popcounts whatever the pattern:
+    density     - onsets per step
+    syncopation - for each onset followed by a rest on a stronger step, how much stronger that
+                  step is in the metre's indispensability, averaged over the onsets
+    evenness    - how close the gaps between onsets are to all being the same length, from the
+                  sum of their squares, 1 when they are all equal
+    overlap     - the share of onsets that land on a step another voice also plays
+ The kit's values are the same measures over all voices together.
+ setVoice works out which steps changed from the word alone, so it can be fed every voice's
+ word whenever it might have changed. A voice is only rescanned when its length changes.
+*/
+template< size_t NVOICES, size_t NSTEPS >
+class sjf_rhythmMetrics
+{
+public:
+    static_assert( NSTEPS <= 32 && NVOICES <= 32, "steps and voices are packed into 32 bit words" );
+
+    struct values
+    {
+        float density = 0, syncopation = 0, evenness = 0, overlap = 0;
+    };
+
+    sjf_rhythmMetrics()
+    {
+        for ( auto& w : m_weights )
+            w.fill( 0 );
+        m_columns.fill( 0 );
+    }
+    ~sjf_rhythmMetrics(){}
+
+    // indispensability of each step of a pattern nBeats long, most important highest, needed once for each length
+    template< typename Container >
+    void setMetre( size_t nBeats, const Container& indispensability )
+    {
+        if ( nBeats == 0 || nBeats > NSTEPS )
+            return;
+        auto maxWeight = 0.0;
+        for ( size_t s = 0; s < nBeats && s < indispensability.size(); s++ )
+            maxWeight = std::max( maxWeight, static_cast< double >( indispensability[ s ] ) );
+        // whole numbers so that the running totals never drift however many edits are made
+        for ( size_t s = 0; s < nBeats; s++ )
+            m_weights[ nBeats ][ s ] = s < indispensability.size() && maxWeight > 0 ? static_cast< uint32_t >( WEIGHT_SCALE * static_cast< double >( indispensability[ s ] ) / maxWeight + 0.5 ) : 0;
+    }
+
+    // the voice's pattern is now word, only the steps that differ from the last word are looked at
+    void setVoice( size_t voice, uint32_t word, size_t length )
+    {
+        length = length < 1 ? 1 : length > NSTEPS ? NSTEPS : length;
+        word &= lengthMask( length );
+        auto& v = m_voices[ voice ];
+        if ( length != v.length )
+        {
+            for ( auto w = v.word; w != 0; w &= w - 1 )
+                toggle( voice, static_cast< size_t >( std::countr_zero( w ) ) );
+            v.length = length;
+        }
+        for ( auto changed = word ^ v.word; changed != 0; changed &= changed - 1 )
+            toggle( voice, static_cast< size_t >( std::countr_zero( changed ) ) );
+    }
+
+    // turns one step of a voice on or off
+    void toggle( size_t voice, size_t step )
+    {
+        auto& v = m_voices[ voice ];
+        if ( step >= v.length )
+            return;
+        auto n = static_cast< uint32_t >( v.length );
+        auto s = static_cast< uint32_t >( step );
+        auto bit = 1u << s;
+        auto on = ( v.word & bit ) == 0;
+        auto prev = s == 0 ? n - 1 : s - 1;
+
+        // only the pairs of steps either side of this one can change their syncopation
+        v.syncopation -= syncopationAt( v, prev ) + ( prev == s ? 0 : syncopationAt( v, s ) );
+
+        // the gap this step sits in is split in two, or two are joined
+        auto others = v.word & ~bit;
+        if ( others == 0 )
+            v.gapSquares = on ? n * n : 0;
+        else
+        {
+            auto below = others & ( bit - 1 );
+            auto toPrevious = below != 0 ? s - ( 31 - static_cast< uint32_t >( std::countl_zero( below ) ) ) : s + n - ( 31 - static_cast< uint32_t >( std::countl_zero( others ) ) );
+            auto above = s < 31 ? others >> ( s + 1 ) : 0u;
+            auto toNext = above != 0 ? 1 + static_cast< uint32_t >( std::countr_zero( above ) ) : n - s + static_cast< uint32_t >( std::countr_zero( others ) );
+            auto whole = toPrevious + toNext;
+            auto split = toPrevious * toPrevious + toNext * toNext;
+            v.gapSquares = on ? v.gapSquares + split - whole * whole : v.gapSquares + whole * whole - split;
+        }
+
+        v.word ^= bit;
+        v.onsets = on ? v.onsets + 1 : v.onsets - 1;
+        v.syncopation += syncopationAt( v, prev ) + ( prev == s ? 0 : syncopationAt( v, s ) );
+
+        // a step shared by two voices counts for both of them, for more than two only this voice changes
+        auto voiceBit = 1u << voice;
+        auto column = m_columns[ step ] & ~voiceBit;
+        if ( column != 0 )
+        {
+            v.shared = on ? v.shared + 1 : v.shared - 1;
+            if ( std::popcount( column ) == 1 )
+            {
+                auto& other = m_voices[ static_cast< size_t >( std::countr_zero( column ) ) ];
+                other.shared = on ? other.shared + 1 : other.shared - 1;
+            }
+        }
+        m_columns[ step ] ^= voiceBit;
+    }
+
+    values getVoice( size_t voice ) const
+    {
+        auto& v = m_voices[ voice ];
+        values result;
+        result.density = static_cast< float >( v.onsets ) / static_cast< float >( v.length );
+        if ( v.onsets == 0 )
+            return result;
+        auto onsets = static_cast< float >( v.onsets );
+        result.syncopation = static_cast< float >( v.syncopation ) / ( WEIGHT_SCALE * onsets );
+        result.evenness = static_cast< float >( v.length * v.length ) / ( onsets * static_cast< float >( v.gapSquares ) );
+        result.overlap = static_cast< float >( v.shared ) / onsets;
+        return result;
+    }
+
+    values getKit() const
+    {
+        uint64_t onsets = 0, steps = 0, syncopation = 0, shared = 0;
+        auto evenness = 0.0f;
+        for ( size_t i = 0; i < NVOICES; i++ )
+        {
+            auto& v = m_voices[ i ];
+            onsets += v.onsets;
+            steps += v.length;
+            syncopation += v.syncopation;
+            shared += v.shared;
+            evenness += static_cast< float >( v.onsets ) * getVoice( i ).evenness;
+        }
+        values result;
+        result.density = static_cast< float >( onsets ) / static_cast< float >( steps );
+        if ( onsets == 0 )
+            return result;
+        result.syncopation = static_cast< float >( syncopation ) / ( WEIGHT_SCALE * static_cast< float >( onsets ) );
+        result.evenness = evenness / static_cast< float >( onsets );
+        result.overlap = static_cast< float >( shared ) / static_cast< float >( onsets );
+        return result;
+    }
+
+private:
+    static constexpr float WEIGHT_SCALE = 65535.0f;
+
+    struct voiceState
+    {
+        uint32_t word = 0;
+        size_t length = 1;
+        uint32_t onsets = 0, gapSquares = 0, shared = 0;
+        uint32_t syncopation = 0;
+    };
+
+    static uint32_t lengthMask( size_t length ){ return length >= 32 ? ~0u : ( 1u << length ) - 1u; }
+
+    // an onset at step s followed by a rest on a stronger step
+    uint32_t syncopationAt( const voiceState& v, uint32_t s ) const
+    {
+        auto next = s + 1 == v.length ? 0 : s + 1;
+        if ( !( ( v.word >> s ) & 1u ) || ( ( v.word >> next ) & 1u ) )
+            return 0;
+        auto& w = m_weights[ v.length ];
+        return w[ next ] > w[ s ] ? w[ next ] - w[ s ] : 0;
+    }
+
+    std::array< std::array< uint32_t, NSTEPS >, NSTEPS + 1 > m_weights;
+    std::array< voiceState, NVOICES > m_voices;
+    std::array< uint32_t, NSTEPS > m_columns; // one bit per voice playing each step
+};
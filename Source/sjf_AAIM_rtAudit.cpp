@@ -0,0 +1,419 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_rtAudit.cpp
+    Hooks for the real-time safety audit, see sjf_AAIM_rtAudit.h
+
+  ==============================================================================
+*/
+
+#include "sjf_AAIM_rtAudit.h"
+
+#if SJF_AAIM_RT_AUDIT
+
+#include <map>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <cstdlib>
+
+#if JUCE_MAC
+ #include <malloc/malloc.h>
+ #include <mach/mach.h>
+#endif
+
+namespace sjf_rtAudit
+{
+    namespace
+    {
+        // thread_local can allocate on first use, which would recurse from inside the malloc hooks,
+        // so audited threads are kept in a small table of ids instead
+        struct auditedThread
+        {
+            std::atomic< juce::Thread::ThreadID > id { nullptr };
+            int depth = 0; // only touched by the thread itself
+            bool recording = false;
+        };
+        std::array< auditedThread, 8 > g_auditedThreads;
+
+        auditedThread* findThread( juce::Thread::ThreadID id )
+        {
+            for ( auto& t : g_auditedThreads )
+                if ( t.id.load( std::memory_order_acquire ) == id )
+                    return &t;
+            return nullptr;
+        }
+
+        struct violationLog
+        {
+            std::mutex lock;
+            std::map< juce::String, int > counts; // keyed by type and stack trace
+            int total = 0;
+        };
+
+        violationLog& getLog()
+        {
+            static violationLog* log = new violationLog(); // never destroyed, hooks can run during static destruction
+            return *log;
+        }
+
+        const char* getTypeName( violationType type )
+        {
+            switch ( type )
+            {
+                case allocation: return "allocation";
+                case deallocation: return "deallocation";
+                case lock: return "lock";
+            }
+            return "";
+        }
+    }
+
+    void beginAuditedScope()
+    {
+        auto id = juce::Thread::getCurrentThreadId();
+        auto* thread = findThread( id );
+        for ( size_t i = 0; i < g_auditedThreads.size() && thread == nullptr; i++ )
+        {
+            juce::Thread::ThreadID expected = nullptr;
+            if ( g_auditedThreads[ i ].id.compare_exchange_strong( expected, id ) )
+                thread = &g_auditedThreads[ i ];
+        }
+        if ( thread != nullptr ) // more threads than slots are simply not audited
+            thread->depth++;
+    }
+
+    void endAuditedScope()
+    {
+        auto* thread = findThread( juce::Thread::getCurrentThreadId() );
+        if ( thread != nullptr && --thread->depth == 0 )
+            thread->id.store( nullptr, std::memory_order_release );
+    }
+
+    bool isInAuditedScope()
+    {
+        auto* thread = findThread( juce::Thread::getCurrentThreadId() );
+        return thread != nullptr && !thread->recording;
+    }
+
+    void recordViolation( violationType type, size_t size )
+    {
+        auto* thread = findThread( juce::Thread::getCurrentThreadId() );
+        if ( thread == nullptr || thread->recording )
+            return;
+        thread->recording = true;
+        auto key = juce::String( getTypeName( type ) ) + ( size > 0 ? " of " + juce::String( size ) + " bytes" : juce::String() )
+            + "\n" + juce::SystemStats::getStackBacktrace();
+        {
+            auto& log = getLog();
+            std::lock_guard< std::mutex > guard( log.lock );
+            log.counts[ key ] += 1;
+            log.total += 1;
+        }
+        thread->recording = false;
+    }
+
+    int getNumViolations()
+    {
+        auto& log = getLog();
+        std::lock_guard< std::mutex > guard( log.lock );
+        return log.total;
+    }
+
+    juce::String getReport()
+    {
+        auto& log = getLog();
+        std::lock_guard< std::mutex > guard( log.lock );
+        juce::String report;
+        report << log.total << " audio thread violations from " << static_cast< int >( log.counts.size() ) << " call sites\n";
+        for ( auto& [ key, count ] : log.counts )
+            report << "\n" << count << "x " << key << "\n";
+        return report;
+    }
+
+    void reset()
+    {
+        auto& log = getLog();
+        std::lock_guard< std::mutex > guard( log.lock );
+        log.counts.clear();
+        log.total = 0;
+    }
+}
+
+//==============================================================================
+//      OPERATOR NEW/DELETE
+//==============================================================================
+// on macOS and Linux these already end up in the malloc hooks below
+#if ! JUCE_MAC && ! JUCE_LINUX
+void* operator new( size_t size )
+{
+    sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+    if ( auto p = std::malloc( size > 0 ? size : 1 ) )
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept
+{
+    sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+    return std::malloc( size > 0 ? size : 1 );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& tag ) noexcept
+{
+    return operator new( size, tag );
+}
+
+void operator delete( void* p ) noexcept
+{
+    if ( p != nullptr )
+        sjf_rtAudit::recordViolation( sjf_rtAudit::deallocation, 0 );
+    std::free( p );
+}
+
+void operator delete[]( void* p ) noexcept { operator delete( p ); }
+void operator delete( void* p, size_t ) noexcept { operator delete( p ); }
+void operator delete[]( void* p, size_t ) noexcept { operator delete( p ); }
+#endif
+
+//==============================================================================
+//      MALLOC (macOS)
+//==============================================================================
+#if JUCE_MAC
+namespace
+{
+    malloc_zone_t originalZone;
+
+    void* auditedMalloc( malloc_zone_t* zone, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalZone.malloc( zone, size );
+    }
+
+    void* auditedCalloc( malloc_zone_t* zone, size_t n, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, n * size );
+        return originalZone.calloc( zone, n, size );
+    }
+
+    void* auditedRealloc( malloc_zone_t* zone, void* p, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalZone.realloc( zone, p, size );
+    }
+
+    void auditedFree( malloc_zone_t* zone, void* p )
+    {
+        if ( p != nullptr )
+            sjf_rtAudit::recordViolation( sjf_rtAudit::deallocation, 0 );
+        originalZone.free( zone, p );
+    }
+
+    // the default zone is read only from macOS 10.7, so it is made writable just long enough to swap the functions
+    struct zoneHooks
+    {
+        zoneHooks()
+        {
+            auto zone = malloc_default_zone();
+            originalZone = *zone;
+            auto page = reinterpret_cast< vm_address_t >( zone ) & ~static_cast< vm_address_t >( vm_page_size - 1 );
+            vm_protect( mach_task_self(), page, vm_page_size, 0, VM_PROT_READ | VM_PROT_WRITE );
+            zone->malloc = auditedMalloc;
+            zone->calloc = auditedCalloc;
+            zone->realloc = auditedRealloc;
+            zone->free = auditedFree;
+            vm_protect( mach_task_self(), page, vm_page_size, 0, VM_PROT_READ );
+        }
+    };
+    zoneHooks installedZoneHooks;
+}
+#endif
+
+//==============================================================================
+//      MALLOC (Linux)
+//==============================================================================
+#if JUCE_LINUX
+#if ! ( defined( __x86_64__ ) || defined( __aarch64__ ) )
+ #error "the audit only knows the relocations of x86-64 and arm64"
+#endif
+#include <link.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace
+{
+    // a plugin is loaded with dlopen, so a malloc defined here would lose to libc's in every image but the plugin's own,
+    // instead the global offset table of every image loaded by then is pointed at these, the host's included
+    // anything loaded after the plugin calls malloc directly
+    void* ( *originalMalloc )( size_t ) = nullptr;
+    void* ( *originalCalloc )( size_t, size_t ) = nullptr;
+    void* ( *originalRealloc )( void*, size_t ) = nullptr;
+    void* ( *originalAlignedAlloc )( size_t, size_t ) = nullptr;
+    int ( *originalPosixMemalign )( void**, size_t, size_t ) = nullptr;
+    void ( *originalFree )( void* ) = nullptr;
+
+    void* auditedMalloc( size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalMalloc( size );
+    }
+
+    void* auditedCalloc( size_t n, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, n * size );
+        return originalCalloc( n, size );
+    }
+
+    void* auditedRealloc( void* p, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalRealloc( p, size );
+    }
+
+    void* auditedAlignedAlloc( size_t alignment, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalAlignedAlloc( alignment, size );
+    }
+
+    int auditedPosixMemalign( void** p, size_t alignment, size_t size )
+    {
+        sjf_rtAudit::recordViolation( sjf_rtAudit::allocation, size );
+        return originalPosixMemalign( p, alignment, size );
+    }
+
+    void auditedFree( void* p )
+    {
+        if ( p != nullptr )
+            sjf_rtAudit::recordViolation( sjf_rtAudit::deallocation, 0 );
+        originalFree( p );
+    }
+
+    struct rebinding
+    {
+        const char* name;
+        void* hook;
+    };
+    const std::array< rebinding, 6 > rebindings
+    { {
+        { "malloc", reinterpret_cast< void* >( auditedMalloc ) },
+        { "calloc", reinterpret_cast< void* >( auditedCalloc ) },
+        { "realloc", reinterpret_cast< void* >( auditedRealloc ) },
+        { "aligned_alloc", reinterpret_cast< void* >( auditedAlignedAlloc ) },
+        { "posix_memalign", reinterpret_cast< void* >( auditedPosixMemalign ) },
+        { "free", reinterpret_cast< void* >( auditedFree ) }
+    } };
+
+  #if defined( __x86_64__ )
+    constexpr uint32_t jumpSlot = R_X86_64_JUMP_SLOT, globalData = R_X86_64_GLOB_DAT;
+  #else
+    constexpr uint32_t jumpSlot = R_AARCH64_JUMP_SLOT, globalData = R_AARCH64_GLOB_DAT;
+  #endif
+
+    struct imageTables
+    {
+        ElfW(Addr) base = 0, relroStart = 0, relroEnd = 0;
+        const ElfW(Sym)* symbols = nullptr;
+        const char* names = nullptr;
+    };
+
+    void rebind( const imageTables& image, const ElfW(Rela)* relocations, size_t size )
+    {
+        static const auto pageSize = static_cast< ElfW(Addr) >( sysconf( _SC_PAGESIZE ) );
+        for ( size_t i = 0; relocations != nullptr && i < size / sizeof( ElfW(Rela) ); i++ )
+        {
+            auto type = ELF64_R_TYPE( relocations[ i ].r_info );
+            auto symbol = ELF64_R_SYM( relocations[ i ].r_info );
+            if ( ( type != jumpSlot && type != globalData ) || symbol == 0 )
+                continue;
+            auto* name = image.names + image.symbols[ symbol ].st_name;
+            for ( auto& r : rebindings )
+            {
+                if ( std::strcmp( name, r.name ) != 0 )
+                    continue;
+                auto slot = image.base + relocations[ i ].r_offset;
+                auto* page = reinterpret_cast< void* >( slot & ~( pageSize - 1 ) );
+                // the table is read only after loading if it is in the image's relro segment
+                if ( mprotect( page, pageSize, PROT_READ | PROT_WRITE ) != 0 )
+                    break;
+                *reinterpret_cast< void** >( slot ) = r.hook;
+                if ( slot >= image.relroStart && slot < image.relroEnd )
+                    mprotect( page, pageSize, PROT_READ );
+                break;
+            }
+        }
+    }
+
+    int rebindImage( dl_phdr_info* info, size_t, void* )
+    {
+        imageTables image;
+        image.base = info->dlpi_addr;
+        const ElfW(Dyn)* dynamic = nullptr;
+        for ( int i = 0; i < info->dlpi_phnum; i++ )
+        {
+            auto& header = info->dlpi_phdr[ i ];
+            if ( header.p_type == PT_DYNAMIC )
+                dynamic = reinterpret_cast< const ElfW(Dyn)* >( image.base + header.p_vaddr );
+            else if ( header.p_type == PT_GNU_RELRO )
+            {
+                image.relroStart = image.base + header.p_vaddr;
+                image.relroEnd = image.relroStart + header.p_memsz;
+            }
+        }
+        if ( dynamic == nullptr )
+            return 0;
+        // the loader has already added the base to these in most images, but not e.g. in the vdso
+        auto address = [ & ]( ElfW(Addr) a ){ return a < image.base ? a + image.base : a; };
+        const ElfW(Rela)* plt = nullptr;
+        const ElfW(Rela)* data = nullptr;
+        size_t pltSize = 0, dataSize = 0;
+        auto pltIsRela = true;
+        for ( auto* d = dynamic; d->d_tag != DT_NULL; d++ )
+        {
+            switch ( d->d_tag )
+            {
+                case DT_SYMTAB: image.symbols = reinterpret_cast< const ElfW(Sym)* >( address( d->d_un.d_ptr ) ); break;
+                case DT_STRTAB: image.names = reinterpret_cast< const char* >( address( d->d_un.d_ptr ) ); break;
+                case DT_JMPREL: plt = reinterpret_cast< const ElfW(Rela)* >( address( d->d_un.d_ptr ) ); break;
+                case DT_PLTRELSZ: pltSize = d->d_un.d_val; break;
+                case DT_PLTREL: pltIsRela = d->d_un.d_val == DT_RELA; break;
+                case DT_RELA: data = reinterpret_cast< const ElfW(Rela)* >( address( d->d_un.d_ptr ) ); break;
+                case DT_RELASZ: dataSize = d->d_un.d_val; break;
+                default: break;
+            }
+        }
+        if ( image.symbols == nullptr || image.names == nullptr || !pltIsRela )
+            return 0;
+        rebind( image, plt, pltSize );
+        rebind( image, data, dataSize ); // images built without a plt call through these
+        return 0;
+    }
+
+    struct gotHooks
+    {
+        gotHooks()
+        {
+            originalMalloc = reinterpret_cast< decltype( originalMalloc ) >( dlsym( RTLD_DEFAULT, "malloc" ) );
+            originalCalloc = reinterpret_cast< decltype( originalCalloc ) >( dlsym( RTLD_DEFAULT, "calloc" ) );
+            originalRealloc = reinterpret_cast< decltype( originalRealloc ) >( dlsym( RTLD_DEFAULT, "realloc" ) );
+            originalAlignedAlloc = reinterpret_cast< decltype( originalAlignedAlloc ) >( dlsym( RTLD_DEFAULT, "aligned_alloc" ) );
+            originalPosixMemalign = reinterpret_cast< decltype( originalPosixMemalign ) >( dlsym( RTLD_DEFAULT, "posix_memalign" ) );
+            originalFree = reinterpret_cast< decltype( originalFree ) >( dlsym( RTLD_DEFAULT, "free" ) );
+            if ( originalMalloc && originalCalloc && originalRealloc && originalAlignedAlloc && originalPosixMemalign && originalFree )
+                dl_iterate_phdr( rebindImage, nullptr );
+        }
+    };
+    gotHooks installedGotHooks;
+}
+#endif
+
+#endif
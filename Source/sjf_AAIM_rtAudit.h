@@ -0,0 +1,99 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_rtAudit.h
+    Records allocations and locks taken on the audio thread, only compiled
+    in when SJF_AAIM_RT_AUDIT is defined
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <mutex>
+
+#ifndef SJF_AAIM_RT_AUDIT
+ #define SJF_AAIM_RT_AUDIT 0
+#endif
+
+#if SJF_AAIM_RT_AUDIT
+
+//==============================================================================
+/**
+ While a thread is inside an audited scope every allocation and deallocation it makes is
+ recorded with a stack trace. On macOS the default malloc zone is hooked and on Linux the
+ malloc family is rebound in every image that is loaded along with the plugin, both of which
+ cover operator new as well, elsewhere only operator new and delete are replaced.
+ Locks are recorded where the plugin takes its own, through the spinLock and mutex below,
+ a blocking acquire is a violation but a try lock never waits so it isn't. Locks taken inside
+ the host or JUCE aren't seen.
+ Up to eight threads can be audited at once, and recording itself allocates, so a thread's
+ hooks are ignored while it records a violation.
+*/
+namespace sjf_rtAudit
+{
+    enum violationType { allocation, deallocation, lock };
+
+    void beginAuditedScope();
+    void endAuditedScope();
+    bool isInAuditedScope();
+
+    // called by the hooks
+    void recordViolation( violationType type, size_t size );
+
+    // identical stack traces are counted together
+    int getNumViolations();
+    juce::String getReport();
+    void reset();
+
+    struct scopedAudioThread
+    {
+        scopedAudioThread(){ beginAuditedScope(); }
+        ~scopedAudioThread(){ endAuditedScope(); }
+    };
+
+    // used in place of juce::SpinLock and std::mutex
+    class spinLock
+    {
+    public:
+        void enter() const
+        {
+            recordViolation( violationType::lock, 0 );
+            m_lock.enter();
+        }
+        bool tryEnter() const noexcept { return m_lock.tryEnter(); }
+        void exit() const noexcept { m_lock.exit(); }
+
+        using ScopedLockType = juce::GenericScopedLock< spinLock >;
+        using ScopedTryLockType = juce::GenericScopedTryLock< spinLock >;
+
+    private:
+        juce::SpinLock m_lock;
+    };
+
+    class mutex
+    {
+    public:
+        void lock()
+        {
+            recordViolation( violationType::lock, 0 );
+            m_mutex.lock();
+        }
+        bool try_lock() noexcept { return m_mutex.try_lock(); }
+        void unlock() noexcept { m_mutex.unlock(); }
+
+    private:
+        std::mutex m_mutex;
+    };
+}
+
+#else
+
+namespace sjf_rtAudit
+{
+    using spinLock = juce::SpinLock;
+    using mutex = std::mutex;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_syncBus.h
+    Generator decisions shared from a leader instance to any number of followers
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+//==============================================================================
+/**
+ Each sync group is a fixed size ring that lives for as long as the process, so instances
+ never allocate or lock to use one. One instance per group claims the ring as leader and
+ writes an event for every pulse its generator outputs, followers read those events in place
+ and play them with their own patterns instead of running a generator of their own.
+ Events are keyed by their position on the host's timeline in quarter notes. Followers play
+ them a block late, by which time the leader has published them whatever order the host
+ processes the instances in, and place each one on its own sample.
+
+ The ring is large enough that followers are never more than a few blocks behind, a follower
+ that has been lapped (e.g. after not being processed for a while) skips to the newest events.
+*/
+class sjf_syncBus
+{
+public:
+    static constexpr size_t NUM_GROUPS = 8, RING_SIZE = 1024;
+    static_assert( ( RING_SIZE & ( RING_SIZE - 1 ) ) == 0, "ring size should be a power of two" );
+
+    struct pulse
+    {
+        double quarterNotePosition = 0;   // when, on the host's timeline
+        double patternBeat = 0;           // the leader's position in its pattern in steps, after any reset
+        float velocity = 0, ioi = 0;
+        int32_t bank = 0;                 // -1 while the leader plays from its pattern library
+        bool play = false;                // false when the generator chose a rest
+    };
+
+    class ring
+    {
+    public:
+        // any thread, returns false if another instance is already leading this group
+        bool claimLeader( const void* owner )
+        {
+            const void* expected = nullptr;
+            return m_leader.compare_exchange_strong( expected, owner ) || expected == owner;
+        }
+
+        void releaseLeader( const void* owner )
+        {
+            auto expected = owner;
+            m_leader.compare_exchange_strong( expected, nullptr );
+        }
+
+        // leader only
+        void publish( const pulse& p )
+        {
+            auto w = m_writeIndex.load( std::memory_order_relaxed );
+            m_slots[ w & ( RING_SIZE - 1 ) ] = p;
+            m_writeIndex.store( w + 1, std::memory_order_release );
+        }
+
+        // followers, the next unread pulse read in place, or nullptr if there isn't one
+        const pulse* peek( uint64_t& readIndex ) const
+        {
+            auto w = m_writeIndex.load( std::memory_order_acquire );
+            if ( w - readIndex > RING_SIZE / 2 )
+                readIndex = w - RING_SIZE / 2; // lapped, keep the newest half so the leader can't overwrite what is being read
+            return readIndex < w ? &m_slots[ readIndex & ( RING_SIZE - 1 ) ] : nullptr;
+        }
+
+        // where a new follower should start reading from
+        uint64_t getWriteIndex() const { return m_writeIndex.load( std::memory_order_acquire ); }
+
+    private:
+        std::array< pulse, RING_SIZE > m_slots;
+        alignas( 64 ) std::atomic< uint64_t > m_writeIndex { 0 };
+        alignas( 64 ) std::atomic< const void* > m_leader { nullptr };
+    };
+
+    static ring& getGroup( size_t group )
+    {
+        static std::array< ring, NUM_GROUPS > groups;
+        return groups[ group < NUM_GROUPS ? group : NUM_GROUPS - 1 ];
+    }
+};
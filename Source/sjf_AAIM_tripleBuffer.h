@@ -0,0 +1,55 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_tripleBuffer.h
+    Hands a value from one writing thread to one reading thread without locks
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+//==============================================================================
+/**
+ Three copies of the value, one the writer fills, one the reader reads and one in between.
+ The writer fills its copy and publishes it by swapping it with the one in between, the reader
+ swaps that one for its own when it asks for an update, so publishing and updating are each a
+ single exchange whatever the size of the value and neither side ever sees a copy the other is
+ still working on. The writer's copy is whatever the reader gave back, so it has to be filled
+ completely every time before it is published.
+*/
+template< typename T >
+class sjf_tripleBuffer
+{
+public:
+    sjf_tripleBuffer(){}
+    ~sjf_tripleBuffer(){}
+
+    // writer
+    T& getWriteBuffer(){ return m_buffers[ m_back ]; }
+    void publish()
+    {
+        m_back = m_middle.exchange( static_cast< uint8_t >( m_back | published ), std::memory_order_acq_rel ) & indexMask;
+    }
+
+    // reader, returns true if anything was published since the last update, read stays the same until then
+    bool update()
+    {
+        if ( !( m_middle.load( std::memory_order_relaxed ) & published ) )
+            return false;
+        m_front = m_middle.exchange( m_front, std::memory_order_acq_rel ) & indexMask;
+        return true;
+    }
+    const T& read() const { return m_buffers[ m_front ]; }
+
+private:
+    static constexpr uint8_t indexMask = 3, published = 4;
+
+    std::array< T, 3 > m_buffers{};
+    uint8_t m_back = 0, m_front = 1;
+    std::atomic< uint8_t > m_middle { 2 };
+};
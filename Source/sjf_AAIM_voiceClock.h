@@ -0,0 +1,109 @@
+/*
+  ==============================================================================
+
+    sjf_AAIM_voiceClock.h
+    Position of every voice within its own cycle for polymetric patterns
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+//==============================================================================
+/**
+ Each voice has its own cycle length in steps and its own rate relative to the master pulse.
+ The lengths, rates and positions are kept as separate arrays so that all voices are advanced
+ in a single loop without branches, which the compiler can vectorise.
+ Voices at the master rate play on the generator's onsets, voices with a rate of their own can't,
+ they would only ever be asked about the steps that happen to line up with an onset, so stepsCrossed
+ tells the caller when each of them reaches a new step of its own.
+*/
+template< size_t NVOICES >
+class sjf_voiceClock
+{
+public:
+    static_assert( NVOICES <= 32, "voices are packed into 32 bit masks" );
+    
+    sjf_voiceClock()
+    {
+        m_length.fill( 1 );
+        m_inverseLength.fill( 1 );
+        m_rate.fill( 1 );
+        m_position.fill( 0 );
+        m_lastStep.fill( 0 );
+    }
+    ~sjf_voiceClock(){}
+    
+    // rate is the number of the voice's steps per master step, e.g. 2 for 16ths over an 8th note pulse
+    void setVoice( size_t voice, double length, double rate )
+    {
+        m_length[ voice ] = length < 1 ? 1 : length;
+        m_inverseLength[ voice ] = 1.0 / m_length[ voice ];
+        m_rate[ voice ] = rate;
+        auto bit = 1u << voice;
+        m_offPulse = rate != 1 ? m_offPulse | bit : m_offPulse & ~bit;
+        // the next call only finds out which step each voice is on, so a change of bank doesn't play anything by itself
+        m_resync = true;
+        m_lastCrossing = std::numeric_limits< double >::infinity();
+    }
+    
+    // one bit for each voice that plays on the master pulse
+    uint32_t getPulseVoices() const { return ~m_offPulse & ALL_VOICES; }
+    
+    // one bit for each voice off the master pulse that has moved onto a new step of its own since the last call,
+    // including after jumping back. Between steps this is a single comparison
+    uint32_t stepsCrossed( double masterBeat )
+    {
+        if ( masterBeat >= m_lastCrossing && masterBeat < m_nextCrossing )
+            return 0;
+        uint32_t crossed = 0;
+        m_lastCrossing = -std::numeric_limits< double >::infinity();
+        m_nextCrossing = std::numeric_limits< double >::infinity();
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            if ( !( ( m_offPulse >> v ) & 1u ) )
+                continue;
+            auto step = std::floor( masterBeat * m_rate[ v ] );
+            if ( step != m_lastStep[ v ] && !m_resync )
+                crossed |= 1u << v;
+            m_lastStep[ v ] = step;
+            m_lastCrossing = std::max( m_lastCrossing, step / m_rate[ v ] );
+            m_nextCrossing = std::min( m_nextCrossing, ( step + 1 ) / m_rate[ v ] );
+        }
+        m_resync = false;
+        return crossed;
+    }
+    
+    // masterBeat is the position in master steps since the start, without wrapping to the pattern length
+    void advance( double masterBeat )
+    {
+        for ( size_t v = 0; v < NVOICES; v++ )
+        {
+            auto p = masterBeat * m_rate[ v ];
+            auto wrapped = p - std::floor( p * m_inverseLength[ v ] ) * m_length[ v ];
+            // rounding can leave the position exactly on the end of the cycle
+            m_position[ v ] = wrapped >= m_length[ v ] ? wrapped - m_length[ v ] : wrapped;
+        }
+    }
+    
+    double getPosition( size_t voice ) const { return m_position[ voice ]; }
+    double getLength( size_t voice ) const { return m_length[ voice ]; }
+    double getRate( size_t voice ) const { return m_rate[ voice ]; }
+    
+private:
+    static constexpr uint32_t ALL_VOICES = NVOICES >= 32 ? ~0u : ( 1u << NVOICES ) - 1u;
+    
+    alignas( 64 ) std::array< double, NVOICES > m_length, m_inverseLength, m_rate, m_position;
+    // the unwrapped step each voice off the pulse was last on, and the master beats between which none of them change step
+    std::array< double, NVOICES > m_lastStep;
+    double m_lastCrossing = std::numeric_limits< double >::infinity(), m_nextCrossing = std::numeric_limits< double >::infinity();
+    uint32_t m_offPulse = 0;
+    bool m_resync = true;
+};